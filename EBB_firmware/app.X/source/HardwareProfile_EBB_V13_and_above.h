@@ -163,6 +163,29 @@
 	#define Step2AltIO_TRIS		TRISAbits.TRISA5
 	#define Dir2AltIO			LATAbits.LATA2
 	#define Dir2AltIO_TRIS		TRISAbits.TRISA2
+
+    // Extra axes, only used when NUMBER_OF_STEPPERS (see ebb.h) is above 2.
+    // The EBB has no driver chips for them, so they always need external
+    // drivers. By default a third axis takes over the pen servo output (RB1)
+    // for STEP, with DIR on RB2 and ENABLE on RD0, and uses the same pins
+    // whether or not the PIC controls the two built-in drivers. Define all of
+    // Step3IO etc. (and the Alt versions) on the compiler command line to use
+    // other pins.
+#if (NUMBER_OF_STEPPERS >= 3) && !defined(Step3IO)
+    #define STEPPER3_ON_SERVO_PIN
+	#define Step3IO				LATBbits.LATB1
+	#define Step3IO_TRIS		TRISBbits.TRISB1
+	#define Dir3IO				LATBbits.LATB2
+	#define Dir3IO_TRIS			TRISBbits.TRISB2
+	#define Enable3IO			LATDbits.LATD0
+	#define Enable3IO_TRIS		TRISDbits.TRISD0
+	#define Step3AltIO			LATBbits.LATB1
+	#define Step3AltIO_TRIS		TRISBbits.TRISB1
+	#define Dir3AltIO			LATBbits.LATB2
+	#define Dir3AltIO_TRIS		TRISBbits.TRISB2
+	#define Enable3AltIO		LATDbits.LATD0
+	#define Enable3AltIO_TRIS	TRISDbits.TRISD0
+#endif
     
     /** R C   S E R V O  ************************************************/
 
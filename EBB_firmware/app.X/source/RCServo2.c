@@ -121,6 +121,14 @@ UINT8  gRC2RPn[MAX_RC2_SERVOS];
 UINT16 gRC2Target[MAX_RC2_SERVOS];
 // Amount of change from Value to Target each 24ms
 UINT16 gRC2Rate[MAX_RC2_SERVOS];
+// Motion profile (RC2_PROFILE_LINEAR etc.) for this channel's current move
+UINT8  gRC2Profile[MAX_RC2_SERVOS];
+// For eased profiles: where this channel's current move started, how far
+// along the profile table it is (in 256ths of a step, 0 = not started yet)
+// and how far it goes along the table each 24ms
+UINT16 gRC2Start[MAX_RC2_SERVOS];
+UINT16 gRC2Phase[MAX_RC2_SERVOS];
+UINT16 gRC2PhaseRate[MAX_RC2_SERVOS];
 // 
 UINT8  gRC2Ptr;
 // How many RC servos can we currently simultainously service (default 8)
@@ -137,6 +145,9 @@ UINT16 g_servo2_min;
 UINT16 g_servo2_rate_up;
 UINT16 g_servo2_rate_down;
 UINT8  g_servo2_RPn;
+// Motion profiles for pen up and pen down moves (SC,14 to SC,16)
+UINT8  g_servo2_profile_up;
+UINT8  g_servo2_profile_down;
 
 /*
 The idea with RCServo2 is to use the ECCP2 module and timer 3.
@@ -185,6 +196,10 @@ void RCServo2_Init(void)
 		gRC2RPn[i] = 0;
 		gRC2Target[i] = 0;
 		gRC2Rate[i] = 0;
+		gRC2Profile[i] = RC2_PROFILE_LINEAR;
+		gRC2Start[i] = 0;
+		gRC2Phase[i] = 0;
+		gRC2PhaseRate[i] = 0;
 	}
 	// Initialize the RPOR pointer
 	gRC2RPORPtr = &RPOR0;
@@ -216,6 +231,8 @@ void RCServo2_Init(void)
 	
 	g_servo2_rate_up = 400;
 	g_servo2_rate_down = 400;
+	g_servo2_profile_up = RC2_PROFILE_LINEAR;
+	g_servo2_profile_down = RC2_PROFILE_LINEAR;
 	process_SP(PEN_UP, 0);			// Start servo up
   RCServoPowerIO = RCSERVO_POWER_OFF;
 }
@@ -288,8 +305,17 @@ void RCServo2_S2_command (void)
 		bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
 		return;
 	}
+
+#if defined(STEPPER3_ON_SERVO_PIN)
+	// RB1 (RP4) and RB2 (RP5) are the third axis' STEP and DIR pins
+	if (Pin == 4 || Pin == 5)
+	{
+		bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+		return;
+	}
+#endif
 	
-	RCServo2_Move(Duration, Pin, Rate, Delay);
+	RCServo2_Move(Duration, Pin, Rate, Delay, RC2_PROFILE_LINEAR);
 
 	print_ack();
 }
@@ -305,6 +331,9 @@ void RCServo2_S2_command (void)
 // <Delay> is how many milliseconds after this command is excuted before the
 //      next command in the motion control FIFO is executed. 0 will run the next
 //      command immediatly.
+// <Profile> is how the servo gets from where it is to <Position> when <Rate>
+//      isn't 0: RC2_PROFILE_LINEAR (<Rate> every 24ms) or one of the eased
+//      profiles, which take the same time overall.
 // This function will allocate a new channel for RPn if the pin is not already
 // assigned to a channel. It will return the channel number used when it
 // returns. If you send in 0 for Duration, the channel for RPn will be de-
@@ -312,15 +341,20 @@ void RCServo2_S2_command (void)
 // Another thing we do here is to make sure that the proper pin is an output,
 // And, if this is the first time we're starting up the channel, make sure that
 // it starts out low.
+// When the third axis is on the pen servo pins (STEPPER3_ON_SERVO_PIN), those
+// pins are left alone, but the move still goes in the FIFO so that an SP's
+// delay and pen state work as they do with the servo turned off by SC,1,0.
 UINT8 RCServo2_Move(
 	UINT16 Position,
 	UINT8  RPn,
 	UINT16 Rate,
-  UINT16 Delay
+  UINT16 Delay,
+  UINT8  Profile
 )
 {
   UINT8 i;
   UINT8 Channel;
+  MoveCommandType move;
 
   // Get the channel that's already assigned to the RPn, or assign a new one
   // if possible. If this returns zero, then do nothing as we're out of
@@ -357,7 +391,11 @@ UINT8 RCServo2_Move(
       }
 
       // Is this the first time we've used this channel?
-      if (gRC2Value[Channel - 1] == 0)
+      if (gRC2Value[Channel - 1] == 0
+#if defined(STEPPER3_ON_SERVO_PIN)
+        && RPn != 4 && RPn != 5
+#endif
+      )
       {
         // Make sure the pin is set as an output, or this won't do much good
         SetPinTRISFromRPn(RPn, OUTPUT_PIN);
@@ -368,29 +406,36 @@ UINT8 RCServo2_Move(
         SetPinLATFromRPn(RPn, 0);
       }
 
-      // Wait until we have a free spot in the FIFO, and add our new
-      // command in
-      while(!FIFOEmpty)
-      ;
-      
+      // Anything in the motion planner has to go first
+      planner_flush();
+
       // If the pin we're controlling is B1 (the normal servo output) then
       // always make sure to turn power on and start the countdown timer
       // for that servo port. (issue #144)
+#if !defined(STEPPER3_ON_SERVO_PIN)
       if (RPn == 4)
       {
         RCServoPowerIO = RCSERVO_POWER_ON;
         gRCServoPoweroffCounterMS = gRCServoPoweroffCounterReloadMS;
       }
-
-      // Now copy the values over into the FIFO element
-      CommandFIFO[0].Command = COMMAND_SERVO_MOVE;
-      CommandFIFO[0].DelayCounter = HIGH_ISR_TICKS_PER_MS * (UINT32)Delay;
-      CommandFIFO[0].ServoChannel = Channel;
-      CommandFIFO[0].ServoRPn = RPn;
-      CommandFIFO[0].ServoPosition = Position;
-      CommandFIFO[0].ServoRate = Rate;
-
-      FIFOEmpty = FALSE;
+#endif
+
+      // Now fill in the values and add our new command to the FIFO
+      move.Command = COMMAND_SERVO_MOVE;
+      move.DelayCounter = HIGH_ISR_TICKS_PER_MS * (UINT32)Delay;
+      move.ServoChannel = Channel;
+      move.ServoRPn = RPn;
+      move.ServoPosition = Position;
+      move.ServoRate = Rate;
+      move.ServoProfile = Profile;
+      move.Steps[0] = 0;
+      move.Steps[1] = 0;
+
+      // SP can ask for the pen move to go along with the motor move before it
+      if (!attach_pen_move(&move))
+      {
+        queue_command(&move);
+      }
     }
 	}
   return Channel;
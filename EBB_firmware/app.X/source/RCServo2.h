@@ -58,12 +58,25 @@
 #define DEFAULT_EBB_SERVO_PORTB_PIN	(1)	// Note, this indicates a PortB pin number, not RPn number
 #define DEFAULT_EBB_SERVO_RPN (DEFAULT_EBB_SERVO_PORTB_PIN + 3) // RPn number for default pen up/down servo
 
+// Servo motion profiles (see SC,14 to SC,16). Eased profiles are tables of
+// how far along a move the servo should be at RC2_PROFILE_STEPS evenly spaced
+// points in time (see low_ISR() in UBW.c).
+#define RC2_PROFILE_LINEAR      0   // Constant <rate> per 24ms (default)
+#define RC2_PROFILE_SCURVE      1   // Speeds up and slows down smoothly
+#define RC2_PROFILE_EASE_OUT    2   // Starts fast, slows down smoothly at the end
+#define RC2_PROFILE_LAST        RC2_PROFILE_EASE_OUT
+#define RC2_PROFILE_STEPS       64
+
 extern UINT8 gRC2msCounter;
 extern UINT16 gRC2Value[MAX_RC2_SERVOS];
 extern UINT8 gRC2RPn[MAX_RC2_SERVOS];
 extern UINT8 gRC2Ptr;
 extern UINT16 gRC2Target[MAX_RC2_SERVOS];
 extern UINT16 gRC2Rate[MAX_RC2_SERVOS];
+extern UINT8 gRC2Profile[MAX_RC2_SERVOS];
+extern UINT16 gRC2Start[MAX_RC2_SERVOS];
+extern UINT16 gRC2Phase[MAX_RC2_SERVOS];
+extern UINT16 gRC2PhaseRate[MAX_RC2_SERVOS];
 extern far ram UINT8 * gRC2RPORPtr;
 extern UINT16 g_servo2_max;
 extern UINT16 g_servo2_min;
@@ -71,10 +84,12 @@ extern UINT8 gRC2Slots;
 extern UINT8 gRC2SlotMS;
 extern UINT16 g_servo2_rate_up;
 extern UINT16 g_servo2_rate_down;
+extern UINT8 g_servo2_profile_up;
+extern UINT8 g_servo2_profile_down;
 extern UINT8 g_servo2_RPn;
 
 void RCServo2_Init(void);
 void RCServo2_S2_command(void);
-UINT8 RCServo2_Move(UINT16 Position, UINT8 RPn, UINT16 Rate, UINT16 Delay);
+UINT8 RCServo2_Move(UINT16 Position, UINT8 RPn, UINT16 Rate, UINT16 Delay, UINT8 Profile);
 
 #endif
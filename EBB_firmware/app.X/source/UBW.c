@@ -158,7 +158,7 @@ const rom char st_LFCR[] = {"\r\n"};
 #elif defined(BOARD_EBB_V12)
 	const rom char st_version[] = {"EBBv12 EB Firmware Version 2.2.1\r\n"};
 #elif defined(BOARD_EBB_V13_AND_ABOVE)
-	const rom char st_version[] = {"EBBv13_and_above EB Firmware Version 2.7.0\r\n"};
+	const rom char st_version[] = {"EBBv13_and_above EB Firmware Version 2.8.0\r\n"};
 #elif defined(BOARD_UBW)
 	const rom char st_version[] = {"UBW EB Firmware Version 2.2.1\r\n"};
 #endif
@@ -214,6 +214,11 @@ unsigned char g_USART_TX_buf_out;
 // Normally set to TRUE. Able to set FALSE to not send "OK" message after packet reception
 BOOL	g_ack_enable;
 
+// Normally set to FALSE. Set TRUE (with CU,3,1) to accept binary frames as well as ASCII commands
+BOOL	g_binary_enable;
+// Counts down milliseconds since the last byte of a binary frame came in (see ProcessIO())
+static volatile unsigned char gBinaryFrameTimerMS = 0;
+
 // Set to TRUE to turn Pulse Mode on
 unsigned char gPulsesOn = FALSE;
 // For Pulse Mode, how long should each pulse be on for in ms?
@@ -252,6 +257,8 @@ void parse_BO_packet (void);	// BO sends data to fast parallel output
 void parse_BC_packet (void);	// BC configures fast parallel outputs
 void parse_BS_packet (void);	// BS sends binary data to fast parallel output
 void parse_CU_packet (void);	// CU configures UBW (system wide parameters)
+void parse_binary_frame (void);	// Check a full binary frame and dispatch it
+BOOL run_command (BOOL frame);	// Run what's in g_RX_buf once the motion queue can take it
 void parse_SS_packet (void);	// SS Send SPI
 void parse_RS_packet (void);	// RS Receive SPI
 void parse_SI_packet (void);	// SI Send I2C
@@ -274,11 +281,32 @@ int _user_putc (char c);		// Our UBS based stream character printer
 /** D E C L A R A T I O N S **************************************************/
 #pragma code
 
+// Eased RC servo motion profiles (see SC,14). For each profile, how far along
+// a move (in 256ths of the distance) the servo should be at each of
+// RC2_PROFILE_STEPS evenly spaced points in time. The move ends at the target.
+// S-curve: (1 - cos(pi * t)) / 2. Ease out: sin(pi * t / 2).
+static const rom UINT8 RC2ProfileTable[RC2_PROFILE_LAST][RC2_PROFILE_STEPS] =
+{
+  {
+      0,   0,   0,   1,   2,   3,   5,   7,   9,  12,  15,  18,  21,  25,  29,  33,
+     37,  42,  46,  51,  56,  62,  67,  73,  79,  84,  90,  96, 103, 109, 115, 121,
+    127, 134, 140, 146, 152, 159, 165, 171, 176, 182, 188, 193, 199, 204, 209, 213,
+    218, 222, 226, 230, 234, 237, 240, 243, 246, 248, 250, 252, 253, 254, 255, 255
+  },
+  {
+      0,   6,  12,  18,  25,  31,  37,  43,  49,  56,  62,  68,  74,  80,  86,  92,
+     97, 103, 109, 115, 120, 126, 131, 136, 142, 147, 152, 157, 162, 167, 171, 176,
+    181, 185, 189, 193, 197, 201, 205, 209, 212, 216, 219, 222, 225, 228, 231, 234,
+    236, 238, 241, 243, 244, 246, 248, 249, 251, 252, 253, 254, 254, 255, 255, 255
+  }
+};
+
 #pragma interruptlow low_ISR
 void low_ISR(void)
 {	
 	unsigned int i;
 	signed int RC2Difference = 0;
+	UINT16 RC2Distance;
 
 	// Do we have a Timer4 interrupt? (1ms rate)
 	if (PIR3bits.TMR4IF)
@@ -327,6 +355,56 @@ void low_ISR(void)
                     {
                         gRC2Value[gRC2Ptr] = gRC2Target[gRC2Ptr];
                     }
+                    else if (gRC2Profile[gRC2Ptr] != RC2_PROFILE_LINEAR)
+                    {
+                        // Eased profiles look up how far along the move the
+                        // servo should be by now. gRC2Phase[] steps through
+                        // the table at a pace that takes as many 24ms periods
+                        // as a linear move at gRC2Rate[] would.
+                        if (gRC2Target[gRC2Ptr] > gRC2Start[gRC2Ptr])
+                        {
+                            RC2Distance = gRC2Target[gRC2Ptr] - gRC2Start[gRC2Ptr];
+                        }
+                        else
+                        {
+                            RC2Distance = gRC2Start[gRC2Ptr] - gRC2Target[gRC2Ptr];
+                        }
+
+                        // First time through for this move: work out the pace
+                        if (gRC2Phase[gRC2Ptr] == 0)
+                        {
+                            if (gRC2Rate[gRC2Ptr] >= RC2Distance)
+                            {
+                                gRC2PhaseRate[gRC2Ptr] = (RC2_PROFILE_STEPS << 8);
+                            }
+                            else
+                            {
+                                gRC2PhaseRate[gRC2Ptr] = ((UINT32)gRC2Rate[gRC2Ptr] * (RC2_PROFILE_STEPS << 8)) / RC2Distance;
+                                if (gRC2PhaseRate[gRC2Ptr] == 0)
+                                {
+                                    gRC2PhaseRate[gRC2Ptr] = 1;
+                                }
+                            }
+                        }
+
+                        gRC2Phase[gRC2Ptr] += gRC2PhaseRate[gRC2Ptr];
+                        if (gRC2Phase[gRC2Ptr] >= (RC2_PROFILE_STEPS << 8))
+                        {
+                            gRC2Value[gRC2Ptr] = gRC2Target[gRC2Ptr];
+                        }
+                        else
+                        {
+                            RC2Distance = ((UINT32)RC2Distance * RC2ProfileTable[gRC2Profile[gRC2Ptr] - 1][gRC2Phase[gRC2Ptr] >> 8]) >> 8;
+                            if (gRC2Target[gRC2Ptr] > gRC2Start[gRC2Ptr])
+                            {
+                                gRC2Value[gRC2Ptr] = gRC2Start[gRC2Ptr] + RC2Distance;
+                            }
+                            else
+                            {
+                                gRC2Value[gRC2Ptr] = gRC2Start[gRC2Ptr] - RC2Distance;
+                            }
+                        }
+                    }
                     else
                     {
                         // Otherwise, add gRC2Rate[] each time through until we
@@ -523,6 +601,12 @@ void low_ISR(void)
 		{
 			QC_ms_timer--;
 		}
+
+		// Software timer for binary frame reception
+		if (gBinaryFrameTimerMS)
+		{
+			gBinaryFrameTimerMS--;
+		}
         
         // Software timer for RCServo power control
         if (gRCServoPoweroffCounterMS)
@@ -672,6 +756,9 @@ void UserInit(void)
 	// Start off always using "OK" acknoledge.
 	g_ack_enable = TRUE;
 
+	// Only ASCII commands until the PC asks for binary frames
+	g_binary_enable = FALSE;
+
 	// Use our own special output function for STDOUT
 	stdout = _H_USER;
 
@@ -821,17 +908,24 @@ void ProcessIO(void)
 	static BOOL in_esc = FALSE;
 	static char esc_sequence[3] = {0};
 	static BOOL in_cr = FALSE;
+	static BOOL in_frame = FALSE;
+	static BOOL cmd_waiting = FALSE;
 	static BYTE last_fifo_size;
     unsigned char tst_char;
 	static unsigned char button_state = 0;
 	static unsigned int button_ctr = 0;
 	char i;
 	BOOL	done = FALSE;
-	unsigned char rx_bytes = 0;
-	unsigned char byte_cnt = 0;
+	static unsigned char rx_bytes = 0;
+	static unsigned char byte_cnt = 0;
 
 	BlinkUSBStatus();
 
+	// Move any staged motion command into the FIFO, then keep the FIFO
+	// topped up from the lookahead planner
+	staging_service();
+	planner_service();
+
 #if defined(BUILD_WITH_DEMO)    
     /* Demo code, for playing back array of points so we can run without PC.*/
     
@@ -882,19 +976,89 @@ void ProcessIO(void)
 		return;
 	}
 
-	// Pull in some new data if there is new data to pull in
-	// And we aren't waiting for the current move to finish
-	
-	rx_bytes = getsUSBUSART((char *)g_RX_command_buf, 64);
+	// Send any EV packets (button, queue and motion state changes) that are due
+	events_service();
+
+	// If the last full command (or binary frame) we got had to wait for room
+	// in the motion queue, try it again. Until it runs, it stays in g_RX_buf
+	// and no more bytes get pulled in, so commands always run in order.
+	if (cmd_waiting && run_command (in_frame))
+	{
+		cmd_waiting = FALSE;
+		in_frame = FALSE;
+	}
+
+	// Pull in some new data if there is new data to pull in, and we've used
+	// up all of the last lot
+	if (!cmd_waiting && byte_cnt >= rx_bytes)
+	{
+		rx_bytes = getsUSBUSART((char *)g_RX_command_buf, 64);
+		byte_cnt = 0;
+	}
+
+	// If a binary frame stops part way through (the PC gave up on it, or
+	// lost some bytes), drop it once no more of it has come in for
+	// kBINARY_FRAME_TIMEOUT_MS, rather than taking the next commands as the
+	// rest of it. Frames can hold any byte values, so a CR can't be used to
+	// find the end of one instead.
+	if (in_frame && !cmd_waiting && byte_cnt >= rx_bytes && 0 == gBinaryFrameTimerMS)
+	{
+		printf ((far rom char *)"!9 Err: Bad binary frame\r\n");
+		in_frame = FALSE;
+		g_RX_buf_in = 0;
+		g_RX_buf_out = 0;
+	}
 
-	if (rx_bytes > 0)
+	if (!cmd_waiting && rx_bytes > 0)
 	{
-		for(byte_cnt = 0; byte_cnt < rx_bytes; byte_cnt++)
+		for(; byte_cnt < rx_bytes && !cmd_waiting; byte_cnt++)
 		{
 			tst_char = g_RX_command_buf[byte_cnt];
 
+			// Binary frames get collected into g_RX_buf (starting with the
+			// length byte) until we have the whole thing, then parsed
+			if (in_frame)
+			{
+				g_RX_buf[g_RX_buf_in] = tst_char;
+				g_RX_buf_in++;
+				gBinaryFrameTimerMS = kBINARY_FRAME_TIMEOUT_MS;
+
+				if (
+					1 == g_RX_buf_in
+					&&
+					(0 == tst_char || tst_char > kBINARY_FRAME_MAX_LENGTH)
+				)
+				{
+					// Bad length byte, so throw the frame away
+					printf ((far rom char *)"!9 Err: Bad binary frame\r\n");
+					in_frame = FALSE;
+					g_RX_buf_in = 0;
+					g_RX_buf_out = 0;
+				}
+				// Length byte, plus <length> bytes, plus the checksum
+				else if (g_RX_buf_in > 1 && g_RX_buf_in == g_RX_buf[0] + 2)
+				{
+					if (run_command (TRUE))
+					{
+						in_frame = FALSE;
+					}
+					else
+					{
+						cmd_waiting = TRUE;
+					}
+				}
+			}
+			else if (g_binary_enable && kBINARY_FRAME_START == tst_char)
+			{
+				// Start of a new binary frame. Any partial ASCII command
+				// that was being collected gets thrown away.
+				in_frame = TRUE;
+				g_RX_buf_in = 0;
+				g_RX_buf_out = 0;
+				gBinaryFrameTimerMS = kBINARY_FRAME_TIMEOUT_MS;
+			}
 			// Check to see if we are in a CR/LF situation
-			if (
+			else if (
 				!in_cr 
 				&& 
 				(
@@ -919,9 +1083,10 @@ void ProcessIO(void)
 				{
 					last_command[i] = g_RX_buf[i];
 				}
-				parse_packet ();
-				g_RX_buf_in = 0;
-				g_RX_buf_out = 0;
+				if (!run_command (FALSE))
+				{
+					cmd_waiting = TRUE;
+				}
 			}
 			else if (tst_char == 27 && in_esc == FALSE)
 			{
@@ -1133,6 +1298,54 @@ void check_and_send_TX_data (void)
 }
 
 
+// Run the ASCII command (or binary frame, if <frame> is TRUE) sitting in
+// g_RX_buf[], unless it would have to wait for room in the motion queue (see
+// command_intake_ready() in ebb.c). Returns FALSE without running it in that
+// case, so ProcessIO() can go on servicing USB and try again later.
+BOOL run_command(BOOL frame)
+{
+	unsigned char cmd1 = 0;
+	unsigned char cmd2 = 0;
+	unsigned char entries = 1;
+
+	if (!frame)
+	{
+		cmd1 = toupper (g_RX_buf[0]);
+		if (g_RX_buf[1] != ',' && g_RX_buf[1] != kCR)
+		{
+			cmd2 = toupper (g_RX_buf[1]);
+		}
+	}
+	else if (BINARY_FRAME_BLOCK == g_RX_buf[1] && g_RX_buf[0] > 1)
+	{
+		// Block move frames carry their move count first. A bad one still
+		// gets one try, and is turned away by parse_binary_frame().
+		entries = g_RX_buf[2];
+		if (0 == entries || entries > BINARY_FRAME_BLOCK_MAX_COUNT)
+		{
+			entries = 1;
+		}
+	}
+	if (!command_intake_ready (cmd1, cmd2, entries))
+	{
+		return FALSE;
+	}
+
+	if (frame)
+	{
+		parse_binary_frame ();
+	}
+	else
+	{
+		parse_timing_start (cmd1, cmd2);
+		parse_packet ();
+		parse_timing_stop ();
+	}
+	g_RX_buf_in = 0;
+	g_RX_buf_out = 0;
+	return TRUE;
+}
+
 // Look at the new packet, see what command it is, and 
 // route it appropriately. We come in knowing that
 // our packet is in g_RX_buf[], and that the beginning
@@ -1173,6 +1386,24 @@ void parse_packet(void)
 			parse_LM_packet();
 			break;
 		}
+		case ('L' * 256) + 'S':
+		{
+			// Low Level Step run
+			parse_LS_packet();
+			break;
+		}
+		case ('L' * 256) + 'A':
+		{
+			// Low Level Axis move
+			parse_LA_packet();
+			break;
+		}
+		case ('L' * 256) + 'B':
+		{
+			// Low Level Barrier
+			parse_LB_packet();
+			break;
+		}
 		case ('R' * 256) + 'X':
 		{
 			// For receiving serial
@@ -1530,6 +1761,24 @@ void parse_packet(void)
 			parse_HM_packet();
 			break;
 		}
+		case ('Q' * 256) + 'F':
+		{
+			// QF is for Query FIFO
+			parse_QF_packet();
+			break;
+		}
+		case ('Q' * 256) + 'I':
+		{
+			// QI is for Query ISR timing
+			parse_QI_packet();
+			break;
+		}
+		case ('P' * 256) + 'L':
+		{
+			// PL is for PLanner
+			parse_PL_packet();
+			break;
+		}
 		default:
 		{
 			if (0 == cmd2)
@@ -1575,6 +1824,39 @@ void parse_packet(void)
 	g_RX_buf_out = g_RX_buf_in;
 }
 
+// A full binary frame is sitting at the start of g_RX_buf. g_RX_buf[0] is
+// the length byte, g_RX_buf[1] the type byte, then the payload, and then the
+// checksum byte. The checksum byte is chosen so that all of the bytes in the
+// frame (not counting the start byte) add up to zero (mod 256).
+// If the frame checks out, hand it off to the motion code to deal with.
+void parse_binary_frame(void)
+{
+	unsigned char length = g_RX_buf[0];
+	unsigned char sum = 0;
+	unsigned char i;
+
+	for (i = 0; i < length + 2; i++)
+	{
+		sum += g_RX_buf[i];
+	}
+
+	if (
+		sum != 0
+		||
+		!process_binary_frame (g_RX_buf[1], &g_RX_buf[2], length - 1)
+	)
+	{
+		printf ((far rom char *)"!9 Err: Bad binary frame\r\n");
+		return;
+	}
+
+	// Motion parameter errors get printed out by ProcessIO like normal
+	if (0 == error_byte)
+	{
+		print_ack ();
+	}
+}
+
 // Print out the positive acknowledgment that the packet was received
 // if we have acks turned on.
 void print_ack(void)
@@ -1596,6 +1878,10 @@ void parse_R_packet(void)
 // "CU,<parameter_number>,<paramter_value><CR>"
 // <paramter_number>	<parameter_value>
 // 1					{1|0} turns on or off the 'ack' ("OK" at end of packets)
+// 2					{1|0} turns on or off SM command limit checks
+// 3					{1|0} turns on or off binary frame reception
+// 4					{1|0} turns on or off EV (event) packets
+// 5					<0 to 15> FIFO depth that sends EV,L (0 = no EV,L)
 void parse_CU_packet(void)
 {
 	unsigned char parameter_number;
@@ -1631,6 +1917,39 @@ void parse_CU_packet(void)
 		{
 			bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
 		}
+    }
+    if (3 == parameter_number)
+    {
+        if (0 == paramater_value || 1 == paramater_value)
+        {
+            g_binary_enable = paramater_value;
+        }
+		else
+		{
+			bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+		}
+    }
+    if (4 == parameter_number)
+    {
+        if (0 == paramater_value || 1 == paramater_value)
+        {
+            gEventsEnable = paramater_value;
+        }
+		else
+		{
+			bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+		}
+    }
+    if (5 == parameter_number)
+    {
+        if (paramater_value >= 0 && paramater_value < COMMAND_FIFO_LENGTH)
+        {
+            gEventLowWater = paramater_value;
+        }
+		else
+		{
+			bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+		}
     }
 	print_ack();
 }
@@ -57,6 +57,15 @@
 #define kRX_BUF_SIZE			256				// In bytes
 #define kRX_COMMAND_BUF_SIZE	64				// In bytes
 
+// Binary frames (turned on with CU,3,1) start with this byte, which can never
+// be part of an ASCII command. Next comes a length byte (which counts the type
+// byte and the payload), then the type byte, the payload, and a checksum byte.
+#define kBINARY_FRAME_START			0xEB
+#define kBINARY_FRAME_MAX_LENGTH	(kRX_BUF_SIZE - 3)
+// A frame that gets no more bytes for this long is thrown away, so that a
+// frame cut short can't swallow the commands that come after it
+#define kBINARY_FRAME_TIMEOUT_MS	50
+
 #define kREQUIRED	FALSE
 #define kOPTIONAL	TRUE
 
@@ -128,6 +137,7 @@ extern volatile unsigned int ISR_A_FIFO[16];                       // Stores the
 extern unsigned char error_byte;
 //extern unsigned char error_byte;
 extern BOOL	g_ack_enable;
+extern BOOL	g_binary_enable;
 
 extern volatile unsigned int g_RC_value[kRC_DATA_SIZE];			// Stores reload values for TMR0
 extern volatile tRC_state g_RC_state[kRC_DATA_SIZE];
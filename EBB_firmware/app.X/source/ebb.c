@@ -258,6 +258,54 @@
 //                  EM command now always clears accumulators
 //                  Reduced effective pulse width for step pulses down to
 //                    between 1.6 and 2.3 uS.
+// 2.8.0 10/17/26 - Motion command FIFO is now 16 elements deep (holds up to 15
+//                    commands) instead of 1, as a single producer/single
+//                    consumer ring buffer. Moved to its own linker section.
+//                  Added QF (Query FIFO) command to report FIFO depth
+//                  ES command now clears out all motor moves in the FIFO
+//                  Added binary LM and LT frames, turned on with CU,3,1
+//                  Added binary block move frame, which queues up to 10 LM
+//                    moves with a single ack
+//                  Source can be built with gcc (EBB_SIM) for the host
+//                    motion simulator in EBB_firmware/sim
+//                  Added QI (Query ISR timing) command to measure how much
+//                    of each 25KHz tick the stepper ISR uses, and how long
+//                    SM, XM and HM take to parse
+//                  Added PL command to turn on an optional lookahead planner
+//                    that adds acceleration and cornering to SM moves
+//                  SM/XM/HM step rates now come from a reciprocal (multiply
+//                    only) instead of 32 bit divisions, and are full
+//                    precision for all moves, including short ones
+//                  Motion commands no longer spin in the parser when the FIFO
+//                    is full. The command is staged and acked, and queries
+//                    (QM, QS, QB, etc.) sent before the next motion command
+//                    are still answered while motion is backlogged. Block
+//                    frames and planner flushes wait in the USB buffers for
+//                    room instead of in the parser
+//                  Added opt-in event reports (CU,4 and CU,5) so the host
+//                    can be told about button presses, queue low-water,
+//                    queue empty and motion done instead of polling
+//                  Added LS (Low level Step run) command and binary LS frame:
+//                    each axis gets a run of steps given as a first interval,
+//                    a count, and a change in interval per step, which the ISR
+//                    times with a countdown instead of an accumulator
+//                  Added LA (Low level Axis move) and LB (Low level Barrier)
+//                    commands: LA moves go into a separate queue for each
+//                    axis, so the two axes can run moves independently of
+//                    each other, and LB (or any other command) waits for
+//                    both axes to catch up
+//                  Motion engine can be built for 3 steppers (define
+//                    NUMBER_OF_STEPPERS, each axis has its own pin map in the
+//                    hardware profile). Axis 3 is moved with LA,
+//                    enabled with EM and reported by QS. On EBB v1.3 and
+//                    above, axis 3 defaults to the pen servo pins (RB1/RB2)
+//                  Added optional <Lead> parameter to SP: the pen move is
+//                    attached to the motor move before it and starts <Lead>
+//                    ISR ticks before that move ends, instead of waiting for
+//                    the move to finish
+//                  Added SC,14 to SC,16 to pick eased (S-curve or ease out)
+//                    pen servo motion profiles instead of a constant rate,
+//                    from tables in low_ISR()
 
 #include <p18cxxx.h>
 #include <usart.h>
@@ -265,11 +313,13 @@
 #include <ctype.h>
 #include <delays.h>
 #include <math.h>
+#if !defined(EBB_SIM)
 #include "Usb\usb.h"
 #include "Usb\usb_function_cdc.h"
 #include "usb_config.h"
+#endif
 #include "HardwareProfile.h"
-#include "ubw.h"
+#include "UBW.h"
 #include "ebb.h"
 #include "delays.h"
 #include "ebb_demo.h"
@@ -279,10 +329,116 @@
 // the StepAdd values.
 #define OVERFLOW_MUL	(0x8000 / HIGH_ISR_TICKS_PER_MS)
 
+// TRUE if Steps in Duration mS is faster than the ISR can step (25KHz).
+// Same as (Steps/Duration) > HIGH_ISR_TICKS_PER_MS, without the division.
+// Duration must be 0xFFFFFF or less.
+#define STEP_RATE_TOO_FAST(Steps, Duration) \
+  ((UINT32)(Steps) >= ((UINT32)(Duration) * (HIGH_ISR_TICKS_PER_MS + 1)))
+// TRUE if Steps in Duration mS is slower than the ISR can step (1.31Hz).
+// Same as (Duration/1311) >= Steps && Steps != 0, without the division.
+#define STEP_RATE_TOO_SLOW(Steps, Duration) \
+  ((Steps) != 0 && (UINT32)(Steps) <= (0xFFFFFFFF / 1311) && ((UINT32)(Steps) * 1311) <= (UINT32)(Duration))
+
 #define MAX_RC_DURATION 11890
 
-// Maximum number of elements in the command FIFO
-#define COMMAND_FIFO_LENGTH     1
+// Per-axis code in the ISR is written out separately for each axis instead of
+// looping over the axes: on the PIC, indexing an array with a variable costs
+// far more than the fixed addresses the compiler uses for a constant index.
+// FOR_EACH_AXIS(M) expands to M(1) M(2) and so on, one for each axis, with
+// the axis number counting from 1 (as in the pin and bit names).
+#if NUMBER_OF_STEPPERS == 2
+#define FOR_EACH_AXIS(M)    M(1) M(2)
+#else
+#define FOR_EACH_AXIS(M)    M(1) M(2) M(3)
+#endif
+
+#if (NUMBER_OF_STEPPERS >= 3) && !defined(Step3IO)
+#error "No pins set up for a third axis on this board (see Step3IO in HardwareProfile_EBB_V13_and_above.h)"
+#endif
+
+// Start axis n's next LA move if it's done with the last one
+#define ISR_AXIS_LOAD(n)                                                      \
+  if (AxisMove[n - 1].Steps == 0 && AxisQueueOut[n - 1] != AxisQueueIn[n - 1]) \
+  {                                                                           \
+    AxisMove[n - 1] = AxisQueue[n - 1][AxisQueueOut[n - 1]];                  \
+    AxisQueueOut[n - 1] = (AxisQueueOut[n - 1] + 1) & AXIS_QUEUE_MASK;        \
+    if (AxisMove[n - 1].ClearAcc)                                             \
+    {                                                                         \
+      acc_union[n - 1].value = 0;                                             \
+    }                                                                         \
+    AxisDirBits = (AxisDirBits & ~DIR##n##_BIT) | AxisMove[n - 1].DirBits;    \
+  }
+
+// One tick of axis n's LA move, with the same accumulator math as LM
+#define ISR_AXIS_STEP(n)                                                      \
+  if (AxisMove[n - 1].Steps)                                                  \
+  {                                                                           \
+    AxisMove[n - 1].Rate.value += AxisMove[n - 1].Accel;                      \
+    if (AxisMove[n - 1].Rate.bytes.b4 & 0x80)                                 \
+    {                                                                         \
+      AxisMove[n - 1].Rate.bytes.b4 += 0x80;                                  \
+    }                                                                         \
+    acc_union[n - 1].value = acc_union[n - 1].value + AxisMove[n - 1].Rate.value; \
+    if (acc_union[n - 1].bytes.b4 & 0x80)                                     \
+    {                                                                         \
+      acc_union[n - 1].bytes.b4 = acc_union[n - 1].bytes.b4 & 0x7F;           \
+      OutByte = OutByte | STEP##n##_BIT;                                      \
+      TookStep = TRUE;                                                        \
+      AxisMove[n - 1].Steps--;                                                \
+    }                                                                         \
+  }
+
+// Part of an expression: TRUE if axis n has an LA move running or queued
+#define ISR_AXIS_BUSY(n)                                                      \
+  AxisMove[n - 1].Steps || (AxisQueueOut[n - 1] != AxisQueueIn[n - 1]) ||
+
+// Set axis n's DIR pin, and raise its STEP pin if it's stepping this tick
+#define ISR_DIR_OUT(n)                                                        \
+  if (OutByte & DIR##n##_BIT)                                                 \
+  {                                                                           \
+    Dir##n##IO = 1;                                                           \
+  }                                                                           \
+  else                                                                        \
+  {                                                                           \
+    Dir##n##IO = 0;                                                           \
+  }
+#define ISR_STEP_OUT(n)                                                       \
+  if (OutByte & STEP##n##_BIT)                                                \
+  {                                                                           \
+    Step##n##IO = 1;                                                          \
+  }
+#define ISR_DIR_ALT_OUT(n)                                                    \
+  if (OutByte & DIR##n##_BIT)                                                 \
+  {                                                                           \
+    Dir##n##AltIO = 1;                                                        \
+  }                                                                           \
+  else                                                                        \
+  {                                                                           \
+    Dir##n##AltIO = 0;                                                        \
+  }
+#define ISR_STEP_ALT_OUT(n)                                                   \
+  if (OutByte & STEP##n##_BIT)                                                \
+  {                                                                           \
+    Step##n##AltIO = 1;                                                       \
+  }
+
+// Count a step on axis n in its global step position
+#define ISR_COUNT_STEP(n)                                                     \
+  if (OutByte & STEP##n##_BIT)                                                \
+  {                                                                           \
+    if (OutByte & DIR##n##_BIT)                                               \
+    {                                                                         \
+      globalStepCounter[n - 1]--;                                             \
+    }                                                                         \
+    else                                                                      \
+    {                                                                         \
+      globalStepCounter[n - 1]++;                                             \
+    }                                                                         \
+  }
+
+// End axis n's STEP pulse
+#define ISR_STEP_CLEAR(n)       Step##n##IO = 0;
+#define ISR_STEP_ALT_CLEAR(n)   Step##n##AltIO = 0;
 
 typedef enum
 {
@@ -298,6 +454,34 @@ static void process_SM(
   UINT8 ClearAccs
 );
 
+static void process_LM(
+  UINT32 Rate1,
+  INT32 Steps1,
+  INT32 Accel1,
+  UINT32 Rate2,
+  INT32 Steps2,
+  INT32 Accel2,
+  UINT8 ClearAccs
+);
+
+static void process_LT(
+  UINT32 Intervals,
+  INT32 Rate1,
+  INT32 Accel1,
+  INT32 Rate2,
+  INT32 Accel2,
+  UINT8 ClearAccs
+);
+
+static void process_LS(
+  UINT16 Interval1,
+  INT32 Count1,
+  INT16 Add1,
+  UINT16 Interval2,
+  INT32 Count2,
+  INT16 Add2
+);
+
 typedef enum
 {
 	PIC_CONTROLS_DRIVERS = 0,
@@ -309,19 +493,132 @@ typedef enum
 static volatile MoveCommandType CurrentCommand;
 //#pragma udata access fast_vars
 // Accumulator for each axis
-static u32b4_t acc_union[2];
-BOOL FIFOEmpty;
+static u32b4_t acc_union[NUMBER_OF_STEPPERS];
 
 #pragma udata
+// Index of the next FIFO element to be filled (only written by main loop)
+volatile UINT8 gFIFOIn;
+// Index of the next FIFO element to be executed (only written by ISR)
+volatile UINT8 gFIFOOut;
 /* These values hold the global step position of each axis */
-volatile static INT32 globalStepCounter1;
-volatile static INT32 globalStepCounter2;
+volatile static INT32 globalStepCounter[NUMBER_OF_STEPPERS];
 
 static unsigned char OutByte;
 static unsigned char TookStep;
 static unsigned char AllDone;
+static unsigned char StartServo;
 static unsigned char i;
+
+#pragma udata CMD_FIFO
 MoveCommandType CommandFIFO[COMMAND_FIFO_LENGTH];
+#pragma udata
+
+// Independent per-axis moves (see parse_LA_packet()). The ISR takes LA
+// commands out of the FIFO and puts them in the queue for their axis, and
+// each axis then runs its own queue. Only the ISR touches these (other than
+// EBB_Init() and ES, with interrupts off).
+#pragma udata AXIS_QUEUE
+static AxisMoveType AxisQueue[NUMBER_OF_STEPPERS][AXIS_QUEUE_LENGTH];
+#pragma udata
+static volatile AxisMoveType AxisMove[NUMBER_OF_STEPPERS];
+static UINT8 AxisQueueIn[NUMBER_OF_STEPPERS];
+static UINT8 AxisQueueOut[NUMBER_OF_STEPPERS];
+// DIR bits for the LA moves each axis is running
+static UINT8 AxisDirBits;
+// TRUE while any axis has an LA move running or waiting in its queue
+static volatile BOOL AxisBusy;
+static UINT8 AxisIndex;
+
+// ISR timing statistics (see parse_QI_packet())
+static BOOL ISRTimingEnable;
+static UINT16 ISRTimingEntry;
+static UINT16 ISRTimingExit;
+static UINT16 ISRTimingDuration;
+static UINT8 ISRTimingType;
+static UINT8 ISRTimingBin;
+static UINT16 ISRDurationMin[ISR_TIMING_TYPES];
+static UINT16 ISRDurationMax[ISR_TIMING_TYPES];
+static UINT16 ISRLatencyMin[ISR_TIMING_TYPES];
+static UINT16 ISRLatencyMax[ISR_TIMING_TYPES];
+
+// Each histogram fills most of a RAM bank, so they get their own sections
+#pragma udata ISR_DURATION_HIST
+static UINT32 ISRDurationHist[ISR_TIMING_TYPES][ISR_TIMING_BINS];
+#pragma udata ISR_LATENCY_HIST
+static UINT32 ISRLatencyHist[ISR_TIMING_TYPES][ISR_TIMING_BINS];
+#pragma udata
+
+// Command parse timing statistics, for SM, XM and HM (see parse_timing_start())
+static volatile UINT32 ISRTickCount;
+static UINT32 ParseTimingStart;
+static UINT8 ParseTimingType = PARSE_TIMING_TYPES;
+static UINT16 ParseTimingCount[PARSE_TIMING_TYPES];
+static UINT32 ParseTimingMin[PARSE_TIMING_TYPES];
+static UINT32 ParseTimingMax[PARSE_TIMING_TYPES];
+// First letter of each timed command
+static const rom char ParseTimingLetter[PARSE_TIMING_TYPES] = {'S', 'X', 'H'};
+
+// The reciprocal of a divisor (see reciprocal_setup())
+typedef struct
+{
+  UINT32 Divisor;
+  UINT32 Inverse;                   // 2^63 / (Divisor << Shift)
+  UINT8 Shift;
+} ReciprocalType;
+
+// One SM move waiting in the lookahead planner (see parse_PL_packet())
+typedef struct
+{
+  INT32 Steps[NUMBER_OF_STEPPERS];  // Signed steps for each axis
+  UINT32 Length;                    // Length of the move in steps
+  UINT32 NominalSq;                 // Top speed squared, (steps/s)^2
+  UINT32 MaxEntrySq;                // Fastest allowed speed at the start
+  UINT32 EntrySq;                   // Planned speed at the start
+  UINT32 TwoAD;                     // Speed squared gained over whole move
+  UINT8 ClearAccs;
+} PlannerBlockType;
+
+// The planner buffer fills most of a RAM bank, so it gets its own section
+#pragma udata PLANNER
+static PlannerBlockType PlannerBlock[PLANNER_LENGTH];
+#pragma udata
+
+// Index of the oldest move in the planner, and how many moves it holds
+static UINT8 PlannerOut;
+static UINT8 PlannerCount;
+// Set TRUE (with PL command) to send SM moves through the planner
+BOOL gPlannerEnable;
+// Planner settings from the PL command
+static UINT32 PlannerAccel = PLANNER_DEFAULT_ACCEL;
+static UINT16 PlannerJunctionDeviation = PLANNER_DEFAULT_JUNCTION_DEVIATION;
+static UINT16 PlannerMinRate = PLANNER_DEFAULT_MIN_RATE;
+// Values worked out from the settings by planner_setup()
+static UINT32 PlannerTwoA;
+static UINT32 PlannerMinSq;
+static UINT32 PlannerTwoADLimit;
+static UINT32 PlannerJunctionK;
+// Speed (squared) the FIFO will be going at when the oldest planned move starts
+static UINT32 PlannerExitSq;
+// Direction and top speed of the last move added, for the next junction
+static BOOL PlannerPrevValid;
+static INT16 PlannerPrevUnit[NUMBER_OF_STEPPERS];
+static UINT32 PlannerPrevNominalSq;
+// TRUE while the planner itself is calling process_LM()
+static BOOL PlannerPushing;
+// TRUE while a command that flushes the planner is held back until
+// planner_service() has handed all of the planned moves to the FIFO
+static BOOL PlannerDraining;
+
+// A command that has been parsed, but didn't fit in the FIFO yet (see
+// queue_command())
+static MoveCommandType StagedCommand;
+BOOL gCommandStaged;
+
+// Set by SP while it queues a pen move that is to be attached to the motor
+// move before it, starting PenAttachLead ticks before that move ends (see
+// attach_pen_move())
+static BOOL PenAttach;
+static UINT32 PenAttachLead;
 
 unsigned int DemoModeActive;
 unsigned int comd_counter;
@@ -335,6 +632,10 @@ static PenStateType PenState;
 static unsigned long NodeCount;
 static char Layer;
 static BOOL ButtonPushed;
+// Set by the ISR once per button press (debounced), cleared by events_service()
+static BOOL ButtonEvent;
+// Counts down while the button is up, so bounce doesn't look like a new press
+static UINT16 ButtonReleaseTicks;
 static BOOL UseAltPause;
 unsigned char QC_ms_timer;
 static UINT StoredEngraverPower;
@@ -344,10 +645,21 @@ BOOL gUseSolenoid;
 BOOL gUseRCPenServo;
 // When FALSE, we skip parameter checks for motor move commands so they can run faster
 BOOL gLimitChecks = TRUE;
+// When TRUE, events_service() sends EV packets to the PC (CU,4)
+BOOL gEventsEnable;
+// EV,L is sent when the FIFO drains down to this many commands (CU,5), 0 = off
+UINT8 gEventLowWater;
 
 /* Local function definitions */
 UINT8 process_QM(void);
 void clear_StepCounters(void);
+static void clear_ISRTiming(void);
+static void extra_axis_pins(void);
+static void enable_extra_axis(UINT8 Axis, UINT8 EnableState);
+static UINT32 move_ticks_left(MoveCommandType * Move);
+static void planner_setup(void);
+static void planner_push(void);
+static BOOL planner_add(UINT32 Duration, INT32 Steps1, INT32 Steps2, UINT8 ClearAccs);
 
 
 // ISR
@@ -370,6 +682,19 @@ void high_ISR(void)
   // 25KHz ISR fire
 	if (PIR1bits.TMR1IF)
 	{
+    if (ISRTimingEnable)
+    {
+      // TMR1 has been counting up from zero since it rolled over, so this
+      // is our entry latency. Reading TMR1L latches TMR1H, so read it first.
+      ISRTimingEntry = TMR1L;
+      ISRTimingEntry |= ((UINT16)TMR1H << 8);
+      ISRTimingType = (UINT8)CurrentCommand.Command;
+      if (AxisBusy)
+      {
+        ISRTimingType = COMMAND_AXIS_MOVE;
+      }
+    }
+
 		// Clear the interrupt 
 		PIR1bits.TMR1IF = 0;
 		TMR1H = TIMER1_H_RELOAD;	//
@@ -378,6 +703,7 @@ void high_ISR(void)
 		OutByte = CurrentCommand.DirBits;
 		TookStep = FALSE;
 		AllDone = TRUE;
+		StartServo = FALSE;
 
     // Note, you don't even need a command to delay. Any command can have
     // a delay associated with it, if DelayCounter is != 0.
@@ -406,12 +732,52 @@ void high_ISR(void)
       (CurrentCommand.Command == COMMAND_MOTOR_MOVE)
       || 
       (CurrentCommand.Command == COMMAND_MOTOR_MOVE_TIMED)
+      ||
+      (CurrentCommand.Command == COMMAND_STEP_RUN)
     )
 		{
       // Only output DIR bits if we are actually doing something
 			if (CurrentCommand.Active[0] || CurrentCommand.Active[1])
       {
-        if (CurrentCommand.Command == COMMAND_MOTOR_MOVE_TIMED)
+        if (CurrentCommand.Command == COMMAND_STEP_RUN)
+        {
+          // LS step runs: no accumulators, just a 16 bit countdown to the
+          // next step on each axis. After each step the interval changes by
+          // Add (kept in Accel) and the countdown starts over from it.
+          if (CurrentCommand.Active[0])
+          {
+            CurrentCommand.Rate[0].words.w1--;
+            if (CurrentCommand.Rate[0].words.w1 == 0)
+            {
+              OutByte = OutByte | STEP1_BIT;
+              TookStep = TRUE;
+              CurrentCommand.Rate[0].words.w2 += (UINT16)CurrentCommand.Accel[0];
+              CurrentCommand.Rate[0].words.w1 = CurrentCommand.Rate[0].words.w2;
+              CurrentCommand.Steps[0]--;
+              if (CurrentCommand.Steps[0] == 0)
+              {
+                CurrentCommand.Active[0] = FALSE;
+              }
+            }
+          }
+          if (CurrentCommand.Active[1])
+          {
+            CurrentCommand.Rate[1].words.w1--;
+            if (CurrentCommand.Rate[1].words.w1 == 0)
+            {
+              OutByte = OutByte | STEP2_BIT;
+              TookStep = TRUE;
+              CurrentCommand.Rate[1].words.w2 += (UINT16)CurrentCommand.Accel[1];
+              CurrentCommand.Rate[1].words.w1 = CurrentCommand.Rate[1].words.w2;
+              CurrentCommand.Steps[1]--;
+              if (CurrentCommand.Steps[1] == 0)
+              {
+                CurrentCommand.Active[1] = FALSE;
+              }
+            }
+          }
+        }
+        else if (CurrentCommand.Command == COMMAND_MOTOR_MOVE_TIMED)
         {
           // Has time run out for this command yet?
           if (CurrentCommand.Active[0])
@@ -512,108 +878,93 @@ void high_ISR(void)
         {
           AllDone = FALSE;
         }
-				if (TookStep)
-				{
-          if (DriverConfiguration == PIC_CONTROLS_DRIVERS)
-          {
-            // Set the dir bits
-            if (CurrentCommand.DirBits & DIR1_BIT)
-            {
-              Dir1IO = 1;
-            }
-            else
-            {
-              Dir1IO = 0;
-            }	
-            if (CurrentCommand.DirBits & DIR2_BIT)
-            {
-              Dir2IO = 1;
-            }
-            else
-            {
-              Dir2IO = 0;
-            }
-            // Set the step bits
- 						if (OutByte & STEP1_BIT)
-						{
-							Step1IO = 1;
-						}
-						if (OutByte & STEP2_BIT)
-						{
-							Step2IO = 1;
-						}
-          }
-          else if (DriverConfiguration == PIC_CONTROLS_EXTERNAL)
-          {
-            // Set the DIR Bits
-            if (CurrentCommand.DirBits & DIR1_BIT)
-            {
-              Dir1AltIO = 1;
-            }
-            else
-            {
-              Dir1AltIO = 0;
-            }	
-            if (CurrentCommand.DirBits & DIR2_BIT)
-            {
-              Dir2AltIO = 1;
-            }
-            else
-            {
-              Dir2AltIO = 0;
-            }
-            // Set the STEP bits
-						if (OutByte & STEP1_BIT)
-						{
-							Step1AltIO = 1;
-						}
-						if (OutByte & STEP2_BIT)
-						{
-							Step2AltIO = 1;
-						}
-					}
-
-          // This next section not only counts the step(s) we are taking, but
-          // also acts as a delay to keep the step bit set for a little while.
-          // The code paths though here are approximately constant time.
-          if (OutByte & STEP1_BIT)
+			}
+
+      // A pen move attached to this move by SP (see attach_pen_move()) starts
+      // ServoDelay ticks in, or right away if the steps are all done sooner
+      if (CurrentCommand.ServoRPn)
+      {
+        if (
+          CurrentCommand.ServoDelay
+          &&
+          (CurrentCommand.Active[0] || CurrentCommand.Active[1])
+        )
+        {
+          CurrentCommand.ServoDelay--;
+        }
+        else
+        {
+          // DelayCounter holds the ticks until the pen move starts plus its
+          // SP duration, so take off whatever we didn't have to wait
+          if (CurrentCommand.DelayCounter > CurrentCommand.ServoDelay)
           {
-            if (CurrentCommand.DirBits & DIR1_BIT)
-            {
-              globalStepCounter1--;
-            }
-            else
-            {
-              globalStepCounter1++;
-            }
+            CurrentCommand.DelayCounter -= CurrentCommand.ServoDelay;
           }
-          if (OutByte & STEP2_BIT)
+          else
           {
-            if (CurrentCommand.DirBits & DIR2_BIT)
-            {
-              globalStepCounter2--;
-            }
-            else
-            {
-              globalStepCounter2++;
-            }
+            CurrentCommand.DelayCounter = 0;
           }
-					if (DriverConfiguration == PIC_CONTROLS_DRIVERS)
-					{
-						Step1IO = 0;
-						Step2IO = 0;
-					}
-          else if (DriverConfiguration == PIC_CONTROLS_EXTERNAL)
-					{
-						Step1AltIO = 0;
-						Step2AltIO = 0;
-					}
-				}
-			}
+          StartServo = TRUE;
+        }
+      }
     }
     // Check to see if we should change the state of the pen
 		else if (CurrentCommand.Command == COMMAND_SERVO_MOVE)
 		{
+      StartServo = TRUE;
+		}
+    // Check to see if we should start or stop the engraver
+		else if (CurrentCommand.Command == COMMAND_SE)
+		{
+      // Now act on the State of the SE command
+      if (CurrentCommand.SEState)
+      {
+        // Set RB3 to StoredEngraverPower
+        CCPR1L = CurrentCommand.SEPower >> 2;
+        CCP1CON = (CCP1CON & 0b11001111) | ((StoredEngraverPower << 4) & 0b00110000);
+      }
+      else
+      {
+        // Set RB3 to low by setting PWM duty cycle to zero
+        CCPR1L = 0;
+        CCP1CON = (CCP1CON & 0b11001111);
+      }
+      AllDone = TRUE;
+    }
+    // Hand an LA move over to its axis' queue, or try again next tick if
+    // that queue is full. The other axis keeps going in the meantime.
+    else if (CurrentCommand.Command == COMMAND_AXIS_MOVE)
+    {
+      // LA commands only have steps in the slot for their own axis
+      AxisIndex = 0;
+      while (
+        (AxisIndex < (NUMBER_OF_STEPPERS - 1))
+        &&
+        (CurrentCommand.Steps[AxisIndex] == 0)
+      )
+      {
+        AxisIndex++;
+      }
+      if (((AxisQueueIn[AxisIndex] + 1) & AXIS_QUEUE_MASK) != AxisQueueOut[AxisIndex])
+      {
+        AxisQueue[AxisIndex][AxisQueueIn[AxisIndex]].Rate.value = CurrentCommand.Rate[AxisIndex].value;
+        AxisQueue[AxisIndex][AxisQueueIn[AxisIndex]].Accel = CurrentCommand.Accel[AxisIndex];
+        AxisQueue[AxisIndex][AxisQueueIn[AxisIndex]].Steps = CurrentCommand.Steps[AxisIndex];
+        AxisQueue[AxisIndex][AxisQueueIn[AxisIndex]].DirBits = CurrentCommand.DirBits;
+        AxisQueue[AxisIndex][AxisQueueIn[AxisIndex]].ClearAcc = CurrentCommand.SEState;
+        AxisQueueIn[AxisIndex] = (AxisQueueIn[AxisIndex] + 1) & AXIS_QUEUE_MASK;
+        AxisBusy = TRUE;
+      }
+      else
+      {
+        AllDone = FALSE;
+      }
+    }
+
+    // Start a servo move, either an SP/S2 command of its own or a pen move
+    // attached to a motor move
+    if (StartServo)
+    {
       if (gUseRCPenServo)
       {
         // Precompute the channel, since we use it all over the place
@@ -638,7 +989,15 @@ void high_ISR(void)
         }
         else
         {
-          // Otherwise, set all of the values that start this RC servo moving
+          // Otherwise, set all of the values that start this RC servo moving.
+          // (This runs every tick for as long as an SP or S2 command's
+          // delay lasts, so only a new target starts an eased move over.)
+          if (gRC2Target[Channel] != CurrentCommand.ServoPosition)
+          {
+            gRC2Start[Channel] = gRC2Value[Channel];
+            gRC2Phase[Channel] = 0;
+          }
+          gRC2Profile[Channel] = CurrentCommand.ServoProfile;
           gRC2Rate[Channel] = CurrentCommand.ServoRate;
           gRC2Target[Channel] = CurrentCommand.ServoPosition;
           gRC2RPn[Channel] = CurrentCommand.ServoRPn;
@@ -672,53 +1031,94 @@ void high_ISR(void)
           }
         }
       }
-		}
-    // Check to see if we should start or stop the engraver
-		else if (CurrentCommand.Command == COMMAND_SE)
-		{
-      // Now act on the State of the SE command
-      if (CurrentCommand.SEState)
+
+      // An attached pen move only starts once
+      if (CurrentCommand.Command != COMMAND_SERVO_MOVE)
       {
-        // Set RB3 to StoredEngraverPower
-        CCPR1L = CurrentCommand.SEPower >> 2;
-        CCP1CON = (CCP1CON & 0b11001111) | ((StoredEngraverPower << 4) & 0b00110000);
+        CurrentCommand.ServoRPn = 0;
       }
-      else
+    }
+
+    // Independent per-axis (LA) moves. Each axis starts its next queued move
+    // as soon as its last one is done, no matter what the other axes are
+    // doing. Nothing but more LA commands come out of the FIFO while any of
+    // these are running, so they never step at the same time as
+    // CurrentCommand does.
+    if (AxisBusy)
+    {
+      FOR_EACH_AXIS(ISR_AXIS_LOAD)
+      OutByte = AxisDirBits;
+
+      FOR_EACH_AXIS(ISR_AXIS_STEP)
+
+      // Checked here, after this tick's steps, so that the next FIFO command
+      // can be loaded right away once the last axis finishes
+      AxisBusy = (FOR_EACH_AXIS(ISR_AXIS_BUSY) FALSE);
+    }
+
+    // Put out this tick's step pulses, from either kind of move. The DIR bits
+    // come along in OutByte too.
+		if (TookStep)
+		{
+      if (DriverConfiguration == PIC_CONTROLS_DRIVERS)
       {
-        // Set RB3 to low by setting PWM duty cycle to zero
-        CCPR1L = 0;
-        CCP1CON = (CCP1CON & 0b11001111);
+        FOR_EACH_AXIS(ISR_DIR_OUT)
+        FOR_EACH_AXIS(ISR_STEP_OUT)
       }
-      AllDone = TRUE;
-    }
+      else if (DriverConfiguration == PIC_CONTROLS_EXTERNAL)
+      {
+        FOR_EACH_AXIS(ISR_DIR_ALT_OUT)
+        FOR_EACH_AXIS(ISR_STEP_ALT_OUT)
+			}
+
+      // This next section not only counts the step(s) we are taking, but
+      // also acts as a delay to keep the step bit set for a little while.
+      // The code paths though here are approximately constant time.
+      FOR_EACH_AXIS(ISR_COUNT_STEP)
+
+			if (DriverConfiguration == PIC_CONTROLS_DRIVERS)
+			{
+        FOR_EACH_AXIS(ISR_STEP_CLEAR)
+			}
+      else if (DriverConfiguration == PIC_CONTROLS_EXTERNAL)
+			{
+        FOR_EACH_AXIS(ISR_STEP_ALT_CLEAR)
+			}
+		}
 
 		// If we're done with our current command, load in the next one
 		if (AllDone && CurrentCommand.DelayCounter == 0)
 		{
 			CurrentCommand.Command = COMMAND_NONE;
-			if (!FIFOEmpty)
+      // While LA moves are running, anything other than another LA move
+      // waits for both axes to finish: every other command is a sync barrier
+			if (
+        (gFIFOIn != gFIFOOut)
+        &&
+        (!AxisBusy || CommandFIFO[gFIFOOut].Command == COMMAND_AXIS_MOVE)
+      )
 			{
 #if defined(GPIO_DEBUG)
         TRISDbits.TRISD0 = 0;
         LATDbits.LATD0 = 1;
 #endif
-        CurrentCommand = CommandFIFO[0];
+        CurrentCommand = CommandFIFO[gFIFOOut];
         // Zero out command in FIFO
-        CommandFIFO[0].Command = COMMAND_NONE;
-        CommandFIFO[0].Rate[0].value = 0;
-        CommandFIFO[0].Rate[1].value = 0;
-        CommandFIFO[0].Steps[0] = 0;
-        CommandFIFO[0].Steps[1] = 0;
-        CommandFIFO[0].DirBits = 0;
-        CommandFIFO[0].DelayCounter = 0;
-        CommandFIFO[0].ServoPosition = 0;
-        CommandFIFO[0].ServoRPn = 0;
-        CommandFIFO[0].ServoChannel = 0;
-        CommandFIFO[0].ServoRate = 0;
-        CommandFIFO[0].SEState = 0;
-        CommandFIFO[0].SEPower = 0;
-        CommandFIFO[0].Active[0] = FALSE;
-        CommandFIFO[0].Active[1] = FALSE;
+        CommandFIFO[gFIFOOut].Command = COMMAND_NONE;
+        CommandFIFO[gFIFOOut].Rate[0].value = 0;
+        CommandFIFO[gFIFOOut].Rate[1].value = 0;
+        CommandFIFO[gFIFOOut].Steps[0] = 0;
+        CommandFIFO[gFIFOOut].Steps[1] = 0;
+        CommandFIFO[gFIFOOut].DirBits = 0;
+        CommandFIFO[gFIFOOut].DelayCounter = 0;
+        CommandFIFO[gFIFOOut].ServoPosition = 0;
+        CommandFIFO[gFIFOOut].ServoRPn = 0;
+        CommandFIFO[gFIFOOut].ServoChannel = 0;
+        CommandFIFO[gFIFOOut].ServoRate = 0;
+        CommandFIFO[gFIFOOut].SEState = 0;
+        CommandFIFO[gFIFOOut].SEPower = 0;
+        CommandFIFO[gFIFOOut].Active[0] = FALSE;
+        CommandFIFO[gFIFOOut].Active[1] = FALSE;
         
         // Take care of clearing the step accumulators for the next move if
         // it's a motor move
@@ -726,6 +1126,8 @@ void high_ISR(void)
           (CurrentCommand.Command == COMMAND_MOTOR_MOVE)
           ||
           (CurrentCommand.Command == COMMAND_MOTOR_MOVE_TIMED)
+          ||
+          (CurrentCommand.Command == COMMAND_STEP_RUN)
         )
         {
           // Use the SEState to determine which accumulators to clear.
@@ -755,7 +1157,8 @@ void high_ISR(void)
             CurrentCommand.Active[1] = FALSE;
           }
         }
-				FIFOEmpty = TRUE;
+        // Hand this FIFO element back to the main loop
+        gFIFOOut = (gFIFOOut + 1) & COMMAND_FIFO_MASK;
 			}
       else 
       {
@@ -779,7 +1182,66 @@ void high_ISR(void)
 		)
 		{
 			ButtonPushed = TRUE;
+			if (ButtonReleaseTicks == 0)
+			{
+				ButtonEvent = TRUE;
+			}
+			ButtonReleaseTicks = BUTTON_RELEASE_TICKS;
 		}
+		else if (ButtonReleaseTicks)
+		{
+			ButtonReleaseTicks--;
+		}
+
+    if (ISRTimingEnable)
+    {
+      ISRTimingExit = TMR1L;
+      ISRTimingExit |= ((UINT16)TMR1H << 8);
+      // Cycles from TMR1 rolling over to here. TMR1 was reloaded along the
+      // way, so count from the reload value for the second part.
+      ISRTimingDuration = ISRTimingEntry + (ISRTimingExit - TIMER1_RELOAD);
+
+      if (ISRTimingType < ISR_TIMING_TYPES)
+      {
+        if (ISRTimingDuration < ISRDurationMin[ISRTimingType])
+        {
+          ISRDurationMin[ISRTimingType] = ISRTimingDuration;
+        }
+        if (ISRTimingDuration > ISRDurationMax[ISRTimingType])
+        {
+          ISRDurationMax[ISRTimingType] = ISRTimingDuration;
+        }
+        if (ISRTimingEntry < ISRLatencyMin[ISRTimingType])
+        {
+          ISRLatencyMin[ISRTimingType] = ISRTimingEntry;
+        }
+        if (ISRTimingEntry > ISRLatencyMax[ISRTimingType])
+        {
+          ISRLatencyMax[ISRTimingType] = ISRTimingEntry;
+        }
+
+        if (ISRTimingDuration >= (ISR_TIMING_BINS << ISR_TIMING_DURATION_SHIFT))
+        {
+          ISRTimingBin = ISR_TIMING_BINS - 1;
+        }
+        else
+        {
+          ISRTimingBin = ISRTimingDuration >> ISR_TIMING_DURATION_SHIFT;
+        }
+        ISRDurationHist[ISRTimingType][ISRTimingBin]++;
+
+        if (ISRTimingEntry >= (ISR_TIMING_BINS << ISR_TIMING_LATENCY_SHIFT))
+        {
+          ISRTimingBin = ISR_TIMING_BINS - 1;
+        }
+        else
+        {
+          ISRTimingBin = ISRTimingEntry >> ISR_TIMING_LATENCY_SHIFT;
+        }
+        ISRLatencyHist[ISRTimingType][ISRTimingBin]++;
+      }
+      ISRTickCount++;
+    }
 	}
 #if defined(GPIO_DEBUG)
   LATAbits.LATA1 = 0;
@@ -792,6 +1254,7 @@ void high_ISR(void)
 void EBB_Init(void)
 {
     char i;
+    char j;
 
     // Initialize all Current Command values
     for (i = 0; i < NUMBER_OF_STEPPERS; i++)
@@ -808,7 +1271,48 @@ void EBB_Init(void)
     CurrentCommand.ServoChannel = 0;
     CurrentCommand.ServoRate = 0;
 
-    FIFOEmpty = TRUE;
+    // Start with every FIFO element zeroed out, as the ISR expects
+    for (i = 0; i < COMMAND_FIFO_LENGTH; i++)
+    {
+        CommandFIFO[i].Command = COMMAND_NONE;
+        for (j = 0; j < NUMBER_OF_STEPPERS; j++)
+        {
+            CommandFIFO[i].Rate[j].value = 0;
+            CommandFIFO[i].Accel[j] = 0;
+            CommandFIFO[i].Steps[j] = 0;
+            CommandFIFO[i].Active[j] = FALSE;
+        }
+        CommandFIFO[i].DirBits = 0;
+        CommandFIFO[i].DelayCounter = 0;
+        CommandFIFO[i].ServoPosition = 0;
+        CommandFIFO[i].ServoRPn = 0;
+        CommandFIFO[i].ServoChannel = 0;
+        CommandFIFO[i].ServoRate = 0;
+        CommandFIFO[i].SEState = 0;
+        CommandFIFO[i].SEPower = 0;
+    }
+    gFIFOIn = 0;
+    gFIFOOut = 0;
+
+    for (i = 0; i < NUMBER_OF_STEPPERS; i++)
+    {
+        AxisMove[i].Steps = 0;
+        AxisQueueIn[i] = 0;
+        AxisQueueOut[i] = 0;
+    }
+    AxisDirBits = 0;
+    AxisBusy = FALSE;
+
+    ISRTimingEnable = FALSE;
+    clear_ISRTiming();
+
+    gCommandStaged = FALSE;
+
+    PlannerOut = 0;
+    PlannerCount = 0;
+    PlannerPrevValid = FALSE;
+    gPlannerEnable = FALSE;
+    planner_setup();
 
 	// Set up TMR1 for our 25KHz High ISR for stepping
 	T1CONbits.RD16 = 1; 	// Set 16 bit mode
@@ -900,6 +1404,10 @@ void EBB_Init(void)
 	#endif
     gUseSolenoid = TRUE;
     gUseRCPenServo = TRUE;
+#if defined(STEPPER3_ON_SERVO_PIN)
+    // The third axis' STEP output is on the pen servo pin
+    gUseRCPenServo = FALSE;
+#endif
 
     // Set up pen up/down direction as output
 	PenUpDownIO = 0;
@@ -911,10 +1419,22 @@ void EBB_Init(void)
 
 	SolenoidState = SOLENOID_ON;
 	DriverConfiguration = PIC_CONTROLS_DRIVERS;
+
+    // Axes past the second start out disabled, like the first two
+#if NUMBER_OF_STEPPERS >= 3
+    Step3IO = 0;
+    Dir3IO = 0;
+    Enable3IO = DISABLE_MOTOR;
+#endif
+    extra_axis_pins();
 	PenState = PEN_UP;
 	Layer = 0;
 	NodeCount = 0;
 	ButtonPushed = FALSE;
+	ButtonEvent = FALSE;
+	ButtonReleaseTicks = 0;
+	gEventsEnable = FALSE;
+	gEventLowWater = 0;
 	// Default RB0 to be an input, with the pull-up enabled, for use as alternate
 	// PAUSE button (just like PRG)
 	// Except for v1.1 hardware, use RB2
@@ -929,6 +1449,61 @@ void EBB_Init(void)
     parse_CS_packet();
 }
 
+// Set up the pins for the axes past the second to match DriverConfiguration.
+// Their normal and Alt pins can be the same ones (see the HardwareProfile
+// files), so the set that isn't being used is turned into inputs first.
+static void extra_axis_pins(void)
+{
+#if NUMBER_OF_STEPPERS >= 3
+    if (DriverConfiguration == PIC_CONTROLS_DRIVERS)
+    {
+        Step3AltIO_TRIS = INPUT_PIN;
+        Dir3AltIO_TRIS = INPUT_PIN;
+        Enable3AltIO_TRIS = INPUT_PIN;
+        Step3IO_TRIS = OUTPUT_PIN;
+        Dir3IO_TRIS = OUTPUT_PIN;
+        Enable3IO_TRIS = OUTPUT_PIN;
+    }
+    else if (DriverConfiguration == PIC_CONTROLS_EXTERNAL)
+    {
+        Step3IO_TRIS = INPUT_PIN;
+        Dir3IO_TRIS = INPUT_PIN;
+        Enable3IO_TRIS = INPUT_PIN;
+        Step3AltIO_TRIS = OUTPUT_PIN;
+        Dir3AltIO_TRIS = OUTPUT_PIN;
+        Enable3AltIO_TRIS = OUTPUT_PIN;
+    }
+    else
+    {
+        Step3IO_TRIS = INPUT_PIN;
+        Dir3IO_TRIS = INPUT_PIN;
+        Enable3IO_TRIS = INPUT_PIN;
+        Step3AltIO_TRIS = INPUT_PIN;
+        Dir3AltIO_TRIS = INPUT_PIN;
+        Enable3AltIO_TRIS = INPUT_PIN;
+    }
+#endif
+}
+
+// Set the enable pin (ENABLE_MOTOR or DISABLE_MOTOR) of one of the axes
+// past the second, on whichever set of pins DriverConfiguration is using
+static void enable_extra_axis(UINT8 Axis, UINT8 EnableState)
+{
+#if NUMBER_OF_STEPPERS >= 3
+    if (Axis == 3)
+    {
+        if (DriverConfiguration == PIC_CONTROLS_DRIVERS)
+        {
+            Enable3IO = EnableState;
+        }
+        else if (DriverConfiguration == PIC_CONTROLS_EXTERNAL)
+        {
+            Enable3AltIO = EnableState;
+        }
+    }
+#endif
+}
+
 // Stepper (mode) Configure command
 // SC,1,0<CR> will use just solenoid output for pen up/down
 // SC,1,1<CR> will use servo on RB1 for pen up/down
@@ -953,6 +1528,10 @@ void EBB_Init(void)
 // SC,12,<servo2_rate><CR> sets the pen down speed
 // SC,13,1<CR> enables RB3 as parallel input to PRG button for pause detection
 // SC,13,0<CR> disables RB3 as parallel input to PRG button for pause detection
+// SC,14,<profile><CR> sets the motion profile for the servo (both up and down)
+//   0 = linear (default), 1 = S-curve, 2 = ease out (see RC2_PROFILE_LINEAR)
+// SC,15,<profile><CR> sets the pen up motion profile
+// SC,16,<profile><CR> sets the pen down motion profile
 void parse_SC_packet (void)
 {
 	unsigned char Para1 = 0;
@@ -977,7 +1556,7 @@ void parse_SC_packet (void)
             gUseSolenoid = TRUE;
             gUseRCPenServo = FALSE;
             // Turn off RC signal on Pen Servo output
-            RCServo2_Move(0, g_servo2_RPn, 0, 0);
+            RCServo2_Move(0, g_servo2_RPn, 0, 0, RC2_PROFILE_LINEAR);
         }
         // Use just RC servo
 		else if (Para2 == 1)
@@ -991,6 +1570,11 @@ void parse_SC_packet (void)
             gUseSolenoid = TRUE;
             gUseRCPenServo = TRUE;
 		}
+#if defined(STEPPER3_ON_SERVO_PIN)
+        // The third axis' STEP output is on the pen servo pin, so the RC
+        // servo output can never be turned back on
+        gUseRCPenServo = FALSE;
+#endif
         // Send a new command to set the state of the servo/solenoid
 		process_SP(PenState, 0);
 	}
@@ -1014,6 +1598,7 @@ void parse_SC_packet (void)
 			Step2AltIO_TRIS = INPUT_PIN;
 			Enable1AltIO_TRIS = INPUT_PIN;
 			Enable2AltIO_TRIS = INPUT_PIN;
+            extra_axis_pins();
 		}
 		else if (Para2 == 1)
 		{
@@ -1032,6 +1617,7 @@ void parse_SC_packet (void)
 			Step2AltIO_TRIS = OUTPUT_PIN;
 			Enable1AltIO_TRIS = OUTPUT_PIN;
 			Enable2AltIO_TRIS = OUTPUT_PIN;
+            extra_axis_pins();
 		}
         else if (Para2 == 2)
         {
@@ -1050,6 +1636,7 @@ void parse_SC_packet (void)
 			Step2AltIO_TRIS = INPUT_PIN;
 			Enable1AltIO_TRIS = INPUT_PIN;
 			Enable2AltIO_TRIS = INPUT_PIN;
+            extra_axis_pins();
      }
 	}
 	// Set <min_servo> for Servo2 method
@@ -1103,6 +1690,21 @@ void parse_SC_packet (void)
 			UseAltPause = FALSE;
 		}			
 	}
+	else if (Para1 >= 14 && Para1 <= 16)
+	{
+		if (Para2 > RC2_PROFILE_LAST)
+		{
+			Para2 = RC2_PROFILE_LINEAR;
+		}
+		if (Para1 != 16)
+		{
+			g_servo2_profile_up = Para2;
+		}
+		if (Para1 != 15)
+		{
+			g_servo2_profile_down = Para2;
+		}
+	}
     print_ack();
 }
 
@@ -1161,13 +1763,7 @@ void parse_LM_packet (void)
   INT32 Steps2 = 0;
   INT32 Accel1 = 0;
   INT32 Accel2 = 0;
-  MoveCommandType move;
   UINT8 ClearAccs = 0;
-#if defined(DEBUG_VALUE_PRINT)
-  INT32 LocalTestStepAdd = 0;
-  INT32 LocalRate1 = 0;
-  INT32 LocalRate2 = 0;
-#endif
   
   // Extract each of the values.
   extract_number (kULONG, &Rate1,     kREQUIRED);
@@ -1184,6 +1780,40 @@ void parse_LM_packet (void)
     return;
   }
 
+  process_LM(Rate1, Steps1, Accel1, Rate2, Steps2, Accel2, ClearAccs);
+
+  // Bail if the move was rejected
+  if (error_byte)
+  {
+    return;
+  }
+
+  if (g_ack_enable)
+  {
+    print_ack();
+  }
+}
+
+// Do the work of the LM command once its parameters have been gathered up,
+// so that binary LM frames can share all of the same checks and math.
+// Sets a bit in error_byte (and queues nothing) if the parameters are bad.
+static void process_LM(
+  UINT32 Rate1,
+  INT32 Steps1,
+  INT32 Accel1,
+  UINT32 Rate2,
+  INT32 Steps2,
+  INT32 Accel2,
+  UINT8 ClearAccs
+)
+{
+  MoveCommandType move;
+#if defined(DEBUG_VALUE_PRINT)
+  INT32 LocalTestStepAdd = 0;
+  INT32 LocalRate1 = 0;
+  INT32 LocalRate2 = 0;
+#endif
+
   // Limit Rates to 0x7FFFFFFF
   if (Rate1 >= 0x7FFFFFFF)
   {
@@ -1269,31 +1899,33 @@ void parse_LM_packet (void)
   move.Accel[1] = Accel2;
   move.Command = COMMAND_MOTOR_MOVE;
 
-  // Spin here until there's space in the fifo
-  while(!FIFOEmpty)
-  ;
+  // Anything in the planner has to go first (unless this move is coming
+  // from the planner)
+  if (!PlannerPushing)
+  {
+    planner_flush();
+  }
 
-  CommandFIFO[0] = move;
 #if defined(DEBUG_VALUE_PRINT)
   // For debugging step motion , uncomment the next line
   printf((far rom char *)"R1=%lu S1=%lu A1=%ld R2=%lu S2=%lu A2=%ld\n\r",
-          CommandFIFO[0].Rate[0].value,  // Rate1 unsigned 31 bit
-          CommandFIFO[0].Steps[0], // Steps1 (now) unsigned 31 bit
-          CommandFIFO[0].Accel[0], // Accel1 signed 32 bit
-          CommandFIFO[0].Rate[1].value,  // Rate2 unsigned 31 bit
-          CommandFIFO[0].Steps[1], // Steps2 (now) unsigned 31 bit
-          CommandFIFO[0].Accel[1]  // Accel2 signed 32 bit
+          move.Rate[0].value,  // Rate1 unsigned 31 bit
+          move.Steps[0], // Steps1 (now) unsigned 31 bit
+          move.Accel[0], // Accel1 signed 32 bit
+          move.Rate[1].value,  // Rate2 unsigned 31 bit
+          move.Steps[1], // Steps2 (now) unsigned 31 bit
+          move.Accel[1]  // Accel2 signed 32 bit
       );
   
   // To test that our Rate = Rate + ((-Accel) >> 1) math works properly, we can
   // also print out what happens after the first ISR tick, which we will
   // simulate here.
-  LocalTestStepAdd = CommandFIFO[0].Rate[0].value + CommandFIFO[0].Accel[0];
+  LocalTestStepAdd = move.Rate[0].value + move.Accel[0];
   if (LocalTestStepAdd > 0)
   {
     LocalRate1 = LocalTestStepAdd;
   }
-  LocalTestStepAdd = CommandFIFO[0].Rate[1].value + CommandFIFO[0].Accel[1];
+  LocalTestStepAdd = move.Rate[1].value + move.Accel[1];
   if (LocalTestStepAdd > 0)
   {
     LocalRate2 = LocalTestStepAdd;
@@ -1301,20 +1933,15 @@ void parse_LM_packet (void)
 
   printf((far rom char *)"R1=%lu S1=%lu A1=%ld R2=%lu S2=%lu A2=%ld\n\r",
           LocalRate1,              // Rate1 unsigned 31 bit into 32 bit signed
-          CommandFIFO[0].Steps[0], // Steps1 (now) unsigned 31 bit
-          CommandFIFO[0].Accel[0], // Accel1 signed 32 bit
+          move.Steps[0], // Steps1 (now) unsigned 31 bit
+          move.Accel[0], // Accel1 signed 32 bit
           LocalRate2,              // Rate2 unsigned 31 bit into 32 bit signed
-          CommandFIFO[0].Steps[1], // Steps2 (now) unsigned 31 bit
-          CommandFIFO[0].Accel[1]  // Accel2 signed 32 bit
+          move.Steps[1], // Steps2 (now) unsigned 31 bit
+          move.Accel[1]  // Accel2 signed 32 bit
       );
 #endif
   
-  FIFOEmpty = FALSE;
-
-  if (g_ack_enable)
-  {
-    print_ack();
-  }
+  queue_command(&move);
 }
 
 // Low Level Timed Move command
@@ -1337,7 +1964,6 @@ void parse_LT_packet (void)
 {
   UINT32 Intervals = 0;
   INT32 Rate1, Rate2, Accel1, Accel2 = 0;
-  MoveCommandType move;
   UINT8 ClearAccs = 0;
 
   // Extract each of the values.
@@ -1354,6 +1980,34 @@ void parse_LT_packet (void)
     return;
   }
 
+  process_LT(Intervals, Rate1, Accel1, Rate2, Accel2, ClearAccs);
+
+  // Bail if the move was rejected
+  if (error_byte)
+  {
+    return;
+  }
+
+  if (g_ack_enable)
+  {
+    print_ack();
+  }
+}
+
+// Do the work of the LT command once its parameters have been gathered up,
+// so that binary LT frames can share all of the same checks and math.
+// Sets a bit in error_byte (and queues nothing) if the parameters are bad.
+static void process_LT(
+  UINT32 Intervals,
+  INT32 Rate1,
+  INT32 Accel1,
+  INT32 Rate2,
+  INT32 Accel2,
+  UINT8 ClearAccs
+)
+{
+  MoveCommandType move;
+
   /* Eliminate obvious invalid parameter combinations,
    * like LT,0,X,X,X,X,X. Or LT,X,0,X,0,X,X 
    */
@@ -1426,250 +2080,828 @@ void parse_LT_packet (void)
   move.Accel[1] = Accel2;
   move.Command = COMMAND_MOTOR_MOVE_TIMED;
 
-  // Spin here until there's space in the fifo
-  while(!FIFOEmpty)
-  ;
-
-  CommandFIFO[0] = move;
+  // Anything in the planner has to go first
+  planner_flush();
 
   /* For debugging step motion , uncomment the next line */
 #if defined(DEBUG_VALUE_PRINT)
    printf((far rom char *)"R1=%lu S1=%lu R2=%lu S2=%lu\n\r",
-          CommandFIFO[0].Rate[0],
-          CommandFIFO[0].Steps[0],
-          CommandFIFO[0].Rate[1],
-          CommandFIFO[0].Steps[1]
+          move.Rate[0],
+          move.Steps[0],
+          move.Rate[1],
+          move.Steps[1]
     );
 #endif
 
-  FIFOEmpty = FALSE;
-
-  if (g_ack_enable)
-  {
-    print_ack();
-  }
+  queue_command(&move);
 }
 
-// The Stepper Motor command
-// Usage: SM,<move_duration>,<axis1_steps>,<axis2_steps>,<CleaAccs><CR>
-// <move_duration> is a number from 1 to 16777215, indicating the number of milliseconds this move should take
-// <axisX_steps> is a signed 24 bit number indicating how many steps (and what direction) the axis should take
-// NOTE1: <axis2_steps> is optional and can be left off
-// If the EBB can not make the move in the specified time, it will take as long as it needs to at max speed
-// i.e. SM,1,1000 will not produce 1000steps in 1ms. Instead, it will take 40ms (25KHz max step rate)
-// NOTE2: If you specify zero steps for the axis, then you effectively create a delay. Use for small
-// pauses before raising or lowering the pen, for example.
-void parse_SM_packet (void)
+// Low level Step run command
+// Usage: LS,<Interval1>,<Count1>,<Add1>,<Interval2>,<Count2>,<Add2><CR>
+//
+// Gives each axis a run of steps with its own timing, worked out ahead of
+// time by the PC (like the step compression in Klipper style controllers).
+// <Interval1> and <Interval2> are unsigned 16 bit ints: the number of ISR
+// ticks from the start of the command to that axis' first step (1 means the
+// first tick of the command).
+// <Count1> and <Count2> are signed 32 bit ints: how many steps the axis
+// takes, with the sign giving the direction. 0 leaves that axis still.
+// <Add1> and <Add2> are signed 16 bit ints, added to the axis' interval after
+// each step. So the steps on an axis come at intervals of Interval,
+// Interval+Add, Interval+2*Add and so on, and every one of those intervals
+// has to be from 1 to 65535.
+// The command is complete once both axes have taken all of their steps.
+void parse_LS_packet(void)
 {
-	UINT32 Duration = 0;
-	INT32 A1Steps = 0, A2Steps = 0;
-  INT32 Steps = 0;
-  UINT8 ClearAccs = 0;
-
-	// Extract each of the values.
-	extract_number (kULONG, &Duration, kREQUIRED);
-	extract_number (kLONG,  &A1Steps,  kREQUIRED);
-	extract_number (kLONG,  &A2Steps,  kOPTIONAL);
-  extract_number (kUCHAR, &ClearAccs, kOPTIONAL);
-
-    if (gLimitChecks)
-    {
-        // Check for invalid duration
-        if (Duration == 0) {
-            bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
-        }
-        // Bail if we got a conversion error
-        if (error_byte)
-        {
-            return;
-        }
-        // Limit each parameter to just 3 bytes
-        if (Duration > 0xFFFFFF) {
-           printf((far rom char *)"!0 Err: <move_duration> larger than 16777215 ms.\n\r");
-           return;
-        }
-        // Check for too-fast step request (>25KHz)
-        // First get absolute value of steps, then check if it's asking for >25KHz
-        if (A1Steps > 0) {
-            Steps = A1Steps;
-        }
-        else {
-            Steps = -A1Steps;
-        }
-        if (Steps > 0xFFFFFF) {
-           printf((far rom char *)"!0 Err: <axis1> larger than 16777215 steps.\n\r");
-           return;
-        }
-        // Check for too fast
-        if ((Steps/Duration) > HIGH_ISR_TICKS_PER_MS) {
-           printf((far rom char *)"!0 Err: <axis1> step rate > 25K steps/second.\n\r");
-           return;
-        }
-        // And check for too slow
-        if ((Duration/1311) >= Steps && Steps != 0) {
-           printf((far rom char *)"!0 Err: <axis1> step rate < 1.31Hz.\n\r");
-           return;
-        }
-                
-        if (A2Steps > 0) {
-            Steps = A2Steps;
-        }
-        else {
-            Steps = -A2Steps;
-        }    
-
-        if (Steps > 0xFFFFFF) {
-           printf((far rom char *)"!0 Err: <axis2> larger than 16777215 steps.\n\r");
-           return;
-        }
-        if ((Steps/Duration) > HIGH_ISR_TICKS_PER_MS) {
-           printf((far rom char *)"!0 Err: <axis2> step rate > 25K steps/second.\n\r");
-           return;
-        }
-        if ((Duration/1311) >= Steps && Steps != 0) {
-           printf((far rom char *)"!0 Err: <axis2> step rate < 1.31Hz.\n\r");
-           return;
-        }
-        if (ClearAccs > 3)
-        {
-          ClearAccs = 0;
-        }
-    }
-
-    // If we get here, we know that step rate for both A1 and A2 is
-    // between 25KHz and 1.31Hz which are the limits of what EBB can do.
-  	process_SM(Duration, A1Steps, A2Steps, ClearAccs);
+  UINT16 Interval1 = 0;
+  INT32 Count1 = 0;
+  INT16 Add1 = 0;
+  UINT16 Interval2 = 0;
+  INT32 Count2 = 0;
+  INT16 Add2 = 0;
 
-    if (g_ack_enable)
-    {
-    	print_ack();
-    }
-}
+  // Extract each of the values.
+  extract_number (kUINT, &Interval1, kREQUIRED);
+  extract_number (kLONG, &Count1,    kREQUIRED);
+  extract_number (kINT,  &Add1,      kREQUIRED);
+  extract_number (kUINT, &Interval2, kREQUIRED);
+  extract_number (kLONG, &Count2,    kREQUIRED);
+  extract_number (kINT,  &Add2,      kREQUIRED);
 
-// Home the motors
-// "HM,<StepRate>,<Pos1>,<Pos2><CR>"
-// <StepRate> is the desired rate of the primary (larger) axis in steps/s.
-// <Pos1> and <Pos2> are both optional. If <Pos1> is present, <Pos2> must
-// also be present. If not present they are both assumed to be 0 (i.e.
-// a true 'home' move). If present, they will instruct the EBB to perform
-// a move to the absolute position <Pos1>,<Pos2>.
-// <Pos1> and <Pos2> are both signed 32 bit integers.
-//
-// This command uses the current global step counts compute the number of
-// steps necessary to reach the target position. (either 0,0 or Pos1,Pos2)
-//
-// To figure out what the duration of the move should be, look at the axis
-// with more steps to move (the 'primary' axis).
-// There are a couple of special cases to consider:
-// 1) If <step_rate> causes a step rate that's too high on the primary axis, 
-//    then just use a duration which is slow enough.
-// 2) If the <step_rate> causes the non-primary axis to need to move too slowly,
-//    break the move into two parts. (i.e. "dog-leg" it) First move will move
-//    with a duration such that the minor axis moves at the minimum step rate.
-//    Second move will move at <step_rate> but with minor axis moving zero steps.
-// If the step rate is too high or too low, don't error out, just use a legal value
-// May need to make 2 moves if one of the axis has few steps to go and the other has
-// lots.
-// When parsing this command, always wait until both the FIFO is empty and the motion 
-// commands are finished. That way two SM commands can be issued back to back to take 
-// care of both moves (or just one if a 'dog leg' move is needed)
-// By waiting until both the FIFO (queue) and motion commands are empty, we also
-// get a true picture of where the global step
-//
-// TODO: This code can't handle steps counts above 4,294,967 in either axis. Is
-// there a way to allow it to handle steps counts up to 16,777,215 easily?
-void parse_HM_packet (void)
-{
-	UINT32 StepRate = 0;
-  INT32  Pos1 = 0;
-  INT32  Pos2 = 0;
-	INT32  Steps1 = 0;
-  INT32  Steps2 = 0;
-  INT32  AbsSteps1 = 0;
-  INT32  AbsSteps2 = 0;
-  UINT32 Duration = 0;
-  BOOL   CommandExecuting = TRUE;
-  INT32  XSteps = 0;
+  // Bail if we got a conversion error
+  if (error_byte)
+  {
+    return;
+  }
 
-	// Extract the step rate.
-	extract_number (kULONG, &StepRate, kREQUIRED);
-	extract_number (kLONG,  &Pos1,     kOPTIONAL);
-	extract_number (kLONG,  &Pos2,     kOPTIONAL);
+  process_LS(Interval1, Count1, Add1, Interval2, Count2, Add2);
 
-  // StepRate can't be zero
-  if (StepRate == 0)
+  // Bail if the move was rejected
+  if (error_byte)
   {
-    bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
     return;
   }
-  
-  // Wait until FIFO is empty
-	while(!FIFOEmpty)
-	;
 
-  // Then wait for motion command to finish (if one's running)
-  while(CommandExecuting == TRUE)
+  if (g_ack_enable)
   {
-    // Need to turn off high priority interrupts breifly here to read out value that ISR uses
-    INTCONbits.GIEH = 0;	// Turn high priority interrupts off
+    print_ack();
+  }
+}
 
-    // Create our output values to print back to the PC
-    if ((CurrentCommand.DelayCounter == 0) && (CurrentCommand.Command == COMMAND_NONE))
-    {
-      CommandExecuting = FALSE;
-    }
+// Returns TRUE if every interval in one axis' LS step run (Interval, then
+// changing by Add after each of Count steps) is from 1 to 65535. Since the
+// intervals change linearly, only the first and last need checking.
+static BOOL step_run_valid(UINT16 Interval, INT32 Count, INT16 Add)
+{
+  INT32 Last;
 
-    // Re-enable interrupts
-    INTCONbits.GIEH = 1;	// Turn high priority interrupts on
+  if (Count == 0)
+  {
+    return TRUE;
   }
-    
-  // Make a local copy of the things we care about. This is how far we need to move.
-  Steps1 = -globalStepCounter1 + Pos1;
-  Steps2 = -globalStepCounter2 + Pos2;
-
-  // Compute absolute value versions of steps for computation
-  if (Steps1 < 0)
+  if (Count < 0)
   {
-    AbsSteps1 = -Steps1;
+    Count = -Count;
   }
-  else
+  if (Interval == 0)
   {
-    AbsSteps1 = Steps1;
+    return FALSE;
   }
-  if (Steps2 < 0)
+  if (Add == 0)
   {
-    AbsSteps2 = -Steps2;
+    return TRUE;
   }
-  else
+  // Past this many steps, even an Add of 1 takes the interval out of range
+  // (and Count * Add could overflow)
+  if (Count > 65535)
   {
-    AbsSteps2 = Steps2;
+    return FALSE;
   }
-    
-  // Check for too many steps to step
-  if ((AbsSteps1 > 0xFFFFFF) || (AbsSteps2 > 0xFFFFFF))
+  Last = (INT32)Interval + ((Count - 1) * (INT32)Add);
+  return (Last >= 1 && Last <= 65535);
+}
+
+// Do the work of the LS command once its parameters have been gathered up,
+// so that binary LS frames can share all of the same checks.
+// Sets a bit in error_byte (and queues nothing) if the parameters are bad.
+static void process_LS(
+  UINT16 Interval1,
+  INT32 Count1,
+  INT16 Add1,
+  UINT16 Interval2,
+  INT32 Count2,
+  INT16 Add2
+)
+{
+  MoveCommandType move;
+
+  if (
+    ((Count1 == 0) && (Count2 == 0))
+    ||
+    !step_run_valid(Interval1, Count1, Add1)
+    ||
+    !step_run_valid(Interval2, Count2, Add2)
+  )
   {
-    printf((far rom char *)"!0 Err: steps to home larger than 16,777,215.\n\r");
+    bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
     return;
   }
-  
-  // Compute duration based on step rate user requested. Take bigger step count to use for calculation
-  if (AbsSteps1 > AbsSteps2)
-  {
-    Duration = (AbsSteps1 * 1000) / StepRate;
-    // Axis1 is primary
+
+  // Step runs never clear the (unused) accumulators
+  move.SEState = 0;
+
+  move.DelayCounter = 0; // No delay for motor moves
+  move.DirBits = 0;
+
+  // Always enable both motors when we want to move them
+  Enable1IO = ENABLE_MOTOR;
+  Enable2IO = ENABLE_MOTOR;
+
+  // First, set the direction bits
+  if (Count1 < 0)
+  {
+    move.DirBits = move.DirBits | DIR1_BIT;
+    Count1 = -Count1;
+  }
+  if (Count2 < 0)
+  {
+    move.DirBits = move.DirBits | DIR2_BIT;
+    Count2 = -Count2;
+  }
+
+  // Both the countdown and the interval start out at Interval
+  move.Rate[0].words.w1 = Interval1;
+  move.Rate[0].words.w2 = Interval1;
+  move.Steps[0] = Count1;
+  move.Accel[0] = Add1;
+  move.Rate[1].words.w1 = Interval2;
+  move.Rate[1].words.w2 = Interval2;
+  move.Steps[1] = Count2;
+  move.Accel[1] = Add2;
+  move.Command = COMMAND_STEP_RUN;
+
+  // Anything in the planner has to go first
+  planner_flush();
+
+  queue_command(&move);
+}
+
+// Low level Axis move command
+// Usage: LA,<Axis>,<Rate>,<Steps>,<Accel>,<ClearAcc><CR>
+//
+// Queues a move for a single axis, which runs independently of the other
+// axis. <Axis> is 1 or 2. <Rate>, <Steps> and <Accel> work just like they do
+// for that axis in the LM command. <ClearAcc> is optional, and a value of 1
+// clears the axis' accumulator before the move starts.
+//
+// Each axis has its own queue of LA moves, and starts its next one as soon
+// as the last one is done, so a long move on one axis doesn't hold up a
+// string of short moves on the other. Every command other than LA (SM, LM,
+// SP, LB and so on) is a sync barrier: it doesn't start until both axes have
+// finished all of the LA moves queued before it. Since LA moves still come
+// through the one FIFO, an LA move for an axis whose queue is full waits at
+// the head of the FIFO, holding up whatever is behind it. So it's best to
+// send LA moves for the two axes in about the order that they will start.
+void parse_LA_packet(void)
+{
+  UINT8 Axis = 0;
+  UINT32 Rate = 0;
+  INT32 Steps = 0;
+  INT32 Accel = 0;
+  UINT8 ClearAcc = 0;
+  MoveCommandType move;
+  UINT8 j;
+
+  // Extract each of the values.
+  extract_number (kUCHAR, &Axis,     kREQUIRED);
+  extract_number (kULONG, &Rate,     kREQUIRED);
+  extract_number (kLONG,  &Steps,    kREQUIRED);
+  extract_number (kLONG,  &Accel,    kREQUIRED);
+  extract_number (kUCHAR, &ClearAcc, kOPTIONAL);
+
+  // Bail if we got a conversion error
+  if (error_byte)
+  {
+    return;
+  }
+
+  // Limit Rate to 0x7FFFFFFF
+  if (Rate >= 0x7FFFFFFF)
+  {
+    Rate = 0x7FFFFFFF;
+  }
+
+  // The ISR tells which axis an LA move is for by which one has steps, so
+  // a move has to have some (and a way to take them)
+  if (
+    (Axis < 1)
+    ||
+    (Axis > NUMBER_OF_STEPPERS)
+    ||
+    (Steps == 0)
+    ||
+    ((Rate == 0) && (Accel == 0))
+  )
+  {
+    bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+    return;
+  }
+
+  if (ClearAcc > 1)
+  {
+    ClearAcc = 1;
+  }
+
+  // Same half Accel adjustment as LM
+  if (Accel < 0)
+  {
+    Rate = Rate + ((-Accel) >> 1);
+  }
+  else
+  {
+    Rate = Rate - (Accel >> 1);
+  }
+
+  move.Command = COMMAND_AXIS_MOVE;
+  move.DelayCounter = 0; // No delay for motor moves
+  move.DirBits = 0;
+  for (j = 0; j < NUMBER_OF_STEPPERS; j++)
+  {
+    move.Rate[j].value = 0;
+    move.Steps[j] = 0;
+    move.Accel[j] = 0;
+  }
+  // We are going to reuse SEState to hold the clear accumulator flag
+  move.SEState = ClearAcc;
+
+  // Always enable the motor when we want to move it
+  if (Axis == 1)
+  {
+    Enable1IO = ENABLE_MOTOR;
+  }
+  else if (Axis == 2)
+  {
+    Enable2IO = ENABLE_MOTOR;
+  }
+  else
+  {
+    enable_extra_axis(Axis, ENABLE_MOTOR);
+  }
+
+  // Each axis' DIR bit is two bits above the last one's (see ebb.h)
+  if (Steps < 0)
+  {
+    move.DirBits = DIR1_BIT << ((Axis - 1) * 2);
+    Steps = -Steps;
+  }
+
+  move.Rate[Axis - 1].value = Rate;
+  move.Steps[Axis - 1] = Steps;
+  move.Accel[Axis - 1] = Accel;
+
+  // Anything in the planner has to go first
+  planner_flush();
+
+  queue_command(&move);
+
+  if (g_ack_enable)
+  {
+    print_ack();
+  }
+}
+
+// Low level Barrier command
+// Usage: LB<CR>
+//
+// Queues a sync barrier for LA moves: nothing after it in the FIFO starts
+// until both axes have finished every LA move queued before it. Any command
+// other than LA does this too; LB is for when there's nothing else to send.
+// It queues an empty command, which takes one ISR tick once it starts.
+void parse_LB_packet(void)
+{
+  MoveCommandType move;
+
+  move.Command = COMMAND_NONE;
+  move.DelayCounter = 0;
+  move.DirBits = 0;
+  move.Steps[0] = 0;
+  move.Steps[1] = 0;
+  move.SEState = 0;
+
+  // Anything in the planner has to go first
+  planner_flush();
+
+  queue_command(&move);
+
+  if (g_ack_enable)
+  {
+    print_ack();
+  }
+}
+
+// Pull a little-endian 16 bit value out of a binary frame payload
+static UINT16 frame_get_u16(UINT8 * Data)
+{
+  return ((UINT16)Data[1] << 8) | Data[0];
+}
+
+// Pull a little-endian 32 bit value out of a binary frame payload
+static UINT32 frame_get_u32(UINT8 * Data)
+{
+  u32b4_t temp;
+
+  temp.bytes.b1 = Data[0];
+  temp.bytes.b2 = Data[1];
+  temp.bytes.b3 = Data[2];
+  temp.bytes.b4 = Data[3];
+
+  return temp.value;
+}
+
+// Binary motion frames
+// When turned on with CU,3,1, ProcessIO() pulls binary frames out of the USB
+// data stream, checks them over, and hands us the frame type and payload.
+// All multi-byte payload values are little-endian.
+//
+// Type 1 : LM frame, 25 byte payload
+//   <Rate1:4><Steps1:4><Accel1:4><Rate2:4><Steps2:4><Accel2:4><ClearAccs:1>
+// Type 2 : LT frame, 21 byte payload
+//   <Intervals:4><Rate1:4><Accel1:4><Rate2:4><Accel2:4><ClearAccs:1>
+// Type 3 : Block move frame, 1 + (25 * <Count>) byte payload
+//   <Count:1> followed by <Count> LM frame payloads
+// Type 4 : LS frame, 16 byte payload
+//   <Interval1:2><Count1:4><Add1:2><Interval2:2><Count2:4><Add2:2>
+//
+// Each value means exactly the same thing as it does in the LM, LT or LS command.
+// A block move frame queues up to BINARY_FRAME_BLOCK_MAX_COUNT LM moves, one
+// after the other, and gets only one ack for the lot. If one of the moves has
+// bad parameters, the moves before it stay queued and the rest are dropped.
+// Returns FALSE if the frame type is unknown or the payload is the wrong size.
+BOOL process_binary_frame(UINT8 Type, UINT8 * Payload, UINT8 Length)
+{
+  UINT8 Count;
+
+  if (Type == BINARY_FRAME_LM && Length == BINARY_FRAME_LM_LENGTH)
+  {
+    process_LM(
+      frame_get_u32(&Payload[0]),           // Rate1
+      (INT32)frame_get_u32(&Payload[4]),    // Steps1
+      (INT32)frame_get_u32(&Payload[8]),    // Accel1
+      frame_get_u32(&Payload[12]),          // Rate2
+      (INT32)frame_get_u32(&Payload[16]),   // Steps2
+      (INT32)frame_get_u32(&Payload[20]),   // Accel2
+      Payload[24]                           // ClearAccs
+    );
+    return TRUE;
+  }
+  if (Type == BINARY_FRAME_LT && Length == BINARY_FRAME_LT_LENGTH)
+  {
+    process_LT(
+      frame_get_u32(&Payload[0]),           // Intervals
+      (INT32)frame_get_u32(&Payload[4]),    // Rate1
+      (INT32)frame_get_u32(&Payload[8]),    // Accel1
+      (INT32)frame_get_u32(&Payload[12]),   // Rate2
+      (INT32)frame_get_u32(&Payload[16]),   // Accel2
+      Payload[20]                           // ClearAccs
+    );
+    return TRUE;
+  }
+  if (Type == BINARY_FRAME_LS && Length == BINARY_FRAME_LS_LENGTH)
+  {
+    process_LS(
+      frame_get_u16(&Payload[0]),           // Interval1
+      (INT32)frame_get_u32(&Payload[2]),    // Count1
+      (INT16)frame_get_u16(&Payload[6]),    // Add1
+      frame_get_u16(&Payload[8]),           // Interval2
+      (INT32)frame_get_u32(&Payload[10]),   // Count2
+      (INT16)frame_get_u16(&Payload[14])    // Add2
+    );
+    return TRUE;
+  }
+  if (
+    Type == BINARY_FRAME_BLOCK
+    &&
+    Length > 1
+    &&
+    Payload[0] != 0
+    &&
+    Payload[0] <= BINARY_FRAME_BLOCK_MAX_COUNT
+    &&
+    Length == 1 + (Payload[0] * BINARY_FRAME_LM_LENGTH)
+  )
+  {
+    Count = Payload[0];
+    Payload++;
+    while (Count && !error_byte)
+    {
+      process_LM(
+        frame_get_u32(&Payload[0]),
+        (INT32)frame_get_u32(&Payload[4]),
+        (INT32)frame_get_u32(&Payload[8]),
+        frame_get_u32(&Payload[12]),
+        (INT32)frame_get_u32(&Payload[16]),
+        (INT32)frame_get_u32(&Payload[20]),
+        Payload[24]
+      );
+      Payload += BINARY_FRAME_LM_LENGTH;
+      Count--;
+    }
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// Reciprocal engine
+//
+// The PIC has an 8x8 hardware multiply but has to divide one bit at a time,
+// so a 32 bit division is many times slower than a 32 bit multiply. Instead
+// of dividing, reciprocal_setup() works out 1/Divisor once (from a table and
+// two Newton-Raphson steps, all multiplies), and then reciprocal_divide()
+// gets each quotient with one multiply and at most a few correction steps.
+// The results are exact, the same as a real division would give.
+
+// Seed values for 1/D: entry n is 2^24/(257 + n), where n is the 8 bits
+// after the top bit of D. Each one is a little under 1/D, good to 8 bits.
+static const rom UINT16 ReciprocalSeed[256] =
+{
+  65280, 65027, 64776, 64527, 64280, 64035, 63791, 63550,
+  63310, 63072, 62836, 62601, 62368, 62137, 61908, 61680,
+  61455, 61230, 61008, 60787, 60567, 60349, 60133, 59918,
+  59705, 59493, 59283, 59074, 58867, 58661, 58457, 58254,
+  58052, 57852, 57653, 57456, 57260, 57065, 56871, 56679,
+  56488, 56299, 56111, 55924, 55738, 55553, 55370, 55188,
+  55007, 54827, 54648, 54471, 54295, 54120, 53946, 53773,
+  53601, 53430, 53261, 53092, 52924, 52758, 52593, 52428,
+  52265, 52103, 51941, 51781, 51622, 51463, 51306, 51150,
+  50994, 50840, 50686, 50533, 50382, 50231, 50081, 49932,
+  49784, 49636, 49490, 49344, 49200, 49056, 48913, 48770,
+  48629, 48489, 48349, 48210, 48072, 47934, 47798, 47662,
+  47527, 47393, 47259, 47127, 46995, 46863, 46733, 46603,
+  46474, 46345, 46218, 46091, 45964, 45839, 45714, 45590,
+  45466, 45343, 45221, 45100, 44979, 44858, 44739, 44620,
+  44501, 44384, 44267, 44150, 44034, 43919, 43804, 43690,
+  43577, 43464, 43351, 43240, 43129, 43018, 42908, 42799,
+  42690, 42581, 42473, 42366, 42259, 42153, 42048, 41943,
+  41838, 41734, 41630, 41527, 41425, 41323, 41221, 41120,
+  41020, 40920, 40820, 40721, 40622, 40524, 40427, 40329,
+  40233, 40136, 40041, 39945, 39850, 39756, 39662, 39568,
+  39475, 39383, 39290, 39199, 39107, 39016, 38926, 38836,
+  38746, 38657, 38568, 38479, 38391, 38304, 38216, 38130,
+  38043, 37957, 37871, 37786, 37701, 37617, 37532, 37449,
+  37365, 37282, 37200, 37117, 37035, 36954, 36873, 36792,
+  36711, 36631, 36551, 36472, 36393, 36314, 36235, 36157,
+  36080, 36002, 35925, 35848, 35772, 35696, 35620, 35544,
+  35469, 35394, 35320, 35246, 35172, 35098, 35025, 34952,
+  34879, 34807, 34735, 34663, 34592, 34521, 34450, 34379,
+  34309, 34239, 34169, 34100, 34030, 33961, 33893, 33825,
+  33756, 33689, 33621, 33554, 33487, 33420, 33354, 33288,
+  33222, 33156, 33091, 33026, 32961, 32896, 32832, 32768
+};
+
+// Multiply two 32 bit values into a 64 bit result (in two halves)
+static void mul_u32(UINT32 A, UINT32 B, UINT32 * Hi, UINT32 * Lo)
+{
+  UINT32 LL = (A & 0xFFFF) * (B & 0xFFFF);
+  UINT32 LH = (A & 0xFFFF) * (B >> 16);
+  UINT32 HL = (A >> 16) * (B & 0xFFFF);
+  UINT32 Mid = (LL >> 16) + (LH & 0xFFFF) + (HL & 0xFFFF);
+
+  *Lo = (Mid << 16) | (LL & 0xFFFF);
+  *Hi = ((A >> 16) * (B >> 16)) + (LH >> 16) + (HL >> 16) + (Mid >> 16);
+}
+
+// Work out the reciprocal of Divisor, for use with reciprocal_divide().
+// Divisor must be less than 0x20000000.
+static void reciprocal_setup(ReciprocalType * Recip, UINT32 Divisor)
+{
+  UINT32 D = Divisor;
+  UINT32 X;
+  UINT32 Hi;
+  UINT32 Lo;
+  UINT8 Shift = 0;
+  UINT8 n;
+
+  Recip->Divisor = Divisor;
+  Recip->Inverse = 0;
+  Recip->Shift = 0;
+  if (Divisor == 0)
+  {
+    return;
+  }
+
+  // Shift D up until its top bit is set, so D/2^32 is from 0.5 to 1
+  while (!(D & 0xFF000000))
+  {
+    D <<= 8;
+    Shift += 8;
+  }
+  while (!(D & 0x80000000))
+  {
+    D <<= 1;
+    Shift++;
+  }
+
+  // X is 2^63/D, from 2^31 to 2^32. Start with the table value, then
+  // each Newton-Raphson step X = X + X * (1 - D * X) doubles the number of
+  // good bits. X always stays a little under the real value.
+  X = (UINT32)ReciprocalSeed[(UINT8)(D >> 23)] << 16;
+  for (n = 0; n < 2; n++)
+  {
+    // (1 - D * X) as a 64 bit fraction, of which we only need the top half
+    mul_u32(D, X, &Hi, &Lo);
+    Hi = (Hi << 1) | (Lo >> 31);
+    Lo <<= 1;
+    Hi = ~Hi;
+    if (Lo == 0)
+    {
+      Hi++;
+    }
+    mul_u32(X, Hi, &Hi, &Lo);
+    X += Hi;
+  }
+
+  Recip->Inverse = X;
+  Recip->Shift = Shift;
+}
+
+// Returns (Value * 2^Scale) / Divisor, rounded down, where Divisor was given
+// to reciprocal_setup(). Scale can be 0 to 31. Returns 0xFFFFFFFF if the
+// answer doesn't fit in 32 bits.
+static UINT32 reciprocal_divide(ReciprocalType * Recip, UINT32 Value, UINT8 Scale)
+{
+  UINT32 Hi;
+  UINT32 Lo;
+  UINT32 Quotient;
+  UINT32 Remainder;
+  UINT8 Shift;
+
+  if (Recip->Divisor == 0)
+  {
+    return 0xFFFFFFFF;
+  }
+
+  // Value * 2^Scale / Divisor = (Value * Inverse) >> (63 - Scale - Shift)
+  mul_u32(Value, Recip->Inverse, &Hi, &Lo);
+  Shift = 63 - Scale - Recip->Shift;
+  if (Shift >= 32)
+  {
+    Quotient = Hi >> (Shift - 32);
+  }
+  else if ((Hi >> Shift) != 0)
+  {
+    return 0xFFFFFFFF;
+  }
+  else
+  {
+    Quotient = (Hi << (32 - Shift)) | (Lo >> Shift);
+  }
+
+  // Since Inverse is a little low, Quotient can be a few too low. The
+  // remainder is small, so only its low 32 bits are needed to fix that.
+  Remainder = (Value << Scale) - (Quotient * Recip->Divisor);
+  while (Remainder >= Recip->Divisor && Quotient != 0xFFFFFFFF)
+  {
+    Quotient++;
+    Remainder -= Recip->Divisor;
+  }
+  return Quotient;
+}
+
+// The Stepper Motor command
+// Usage: SM,<move_duration>,<axis1_steps>,<axis2_steps>,<CleaAccs><CR>
+// <move_duration> is a number from 1 to 16777215, indicating the number of milliseconds this move should take
+// <axisX_steps> is a signed 24 bit number indicating how many steps (and what direction) the axis should take
+// NOTE1: <axis2_steps> is optional and can be left off
+// If the EBB can not make the move in the specified time, it will take as long as it needs to at max speed
+// i.e. SM,1,1000 will not produce 1000steps in 1ms. Instead, it will take 40ms (25KHz max step rate)
+// NOTE2: If you specify zero steps for the axis, then you effectively create a delay. Use for small
+// pauses before raising or lowering the pen, for example.
+void parse_SM_packet (void)
+{
+	UINT32 Duration = 0;
+	INT32 A1Steps = 0, A2Steps = 0;
+  INT32 Steps = 0;
+  UINT8 ClearAccs = 0;
+
+	// Extract each of the values.
+	extract_number (kULONG, &Duration, kREQUIRED);
+	extract_number (kLONG,  &A1Steps,  kREQUIRED);
+	extract_number (kLONG,  &A2Steps,  kOPTIONAL);
+  extract_number (kUCHAR, &ClearAccs, kOPTIONAL);
+
+    if (gLimitChecks)
+    {
+        // Check for invalid duration
+        if (Duration == 0) {
+            bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+        }
+        // Bail if we got a conversion error
+        if (error_byte)
+        {
+            return;
+        }
+        // Limit each parameter to just 3 bytes
+        if (Duration > 0xFFFFFF) {
+           printf((far rom char *)"!0 Err: <move_duration> larger than 16777215 ms.\n\r");
+           return;
+        }
+        // Check for too-fast step request (>25KHz)
+        // First get absolute value of steps, then check if it's asking for >25KHz
+        if (A1Steps > 0) {
+            Steps = A1Steps;
+        }
+        else {
+            Steps = -A1Steps;
+        }
+        if (Steps > 0xFFFFFF) {
+           printf((far rom char *)"!0 Err: <axis1> larger than 16777215 steps.\n\r");
+           return;
+        }
+        // Check for too fast
+        if (STEP_RATE_TOO_FAST(Steps, Duration)) {
+           printf((far rom char *)"!0 Err: <axis1> step rate > 25K steps/second.\n\r");
+           return;
+        }
+        // And check for too slow
+        if (STEP_RATE_TOO_SLOW(Steps, Duration)) {
+           printf((far rom char *)"!0 Err: <axis1> step rate < 1.31Hz.\n\r");
+           return;
+        }
+                
+        if (A2Steps > 0) {
+            Steps = A2Steps;
+        }
+        else {
+            Steps = -A2Steps;
+        }    
+
+        if (Steps > 0xFFFFFF) {
+           printf((far rom char *)"!0 Err: <axis2> larger than 16777215 steps.\n\r");
+           return;
+        }
+        if (STEP_RATE_TOO_FAST(Steps, Duration)) {
+           printf((far rom char *)"!0 Err: <axis2> step rate > 25K steps/second.\n\r");
+           return;
+        }
+        if (STEP_RATE_TOO_SLOW(Steps, Duration)) {
+           printf((far rom char *)"!0 Err: <axis2> step rate < 1.31Hz.\n\r");
+           return;
+        }
+        if (ClearAccs > 3)
+        {
+          ClearAccs = 0;
+        }
+    }
+
+    // If we get here, we know that step rate for both A1 and A2 is
+    // between 25KHz and 1.31Hz which are the limits of what EBB can do.
+  	process_SM(Duration, A1Steps, A2Steps, ClearAccs);
+
+    if (g_ack_enable)
+    {
+    	print_ack();
+    }
+}
+
+// Home the motors
+// "HM,<StepRate>,<Pos1>,<Pos2><CR>"
+// <StepRate> is the desired rate of the primary (larger) axis in steps/s.
+// <Pos1> and <Pos2> are both optional. If <Pos1> is present, <Pos2> must
+// also be present. If not present they are both assumed to be 0 (i.e.
+// a true 'home' move). If present, they will instruct the EBB to perform
+// a move to the absolute position <Pos1>,<Pos2>.
+// <Pos1> and <Pos2> are both signed 32 bit integers.
+//
+// This command uses the current global step counts compute the number of
+// steps necessary to reach the target position. (either 0,0 or Pos1,Pos2)
+//
+// To figure out what the duration of the move should be, look at the axis
+// with more steps to move (the 'primary' axis).
+// There are a couple of special cases to consider:
+// 1) If <step_rate> causes a step rate that's too high on the primary axis, 
+//    then just use a duration which is slow enough.
+// 2) If the <step_rate> causes the non-primary axis to need to move too slowly,
+//    break the move into two parts. (i.e. "dog-leg" it) First move will move
+//    with a duration such that the minor axis moves at the minimum step rate.
+//    Second move will move at <step_rate> but with minor axis moving zero steps.
+// If the step rate is too high or too low, don't error out, just use a legal value
+// May need to make 2 moves if one of the axis has few steps to go and the other has
+// lots.
+// When parsing this command, always wait until both the FIFO is empty and the motion 
+// commands are finished. That way two SM commands can be issued back to back to take 
+// care of both moves (or just one if a 'dog leg' move is needed)
+// By waiting until both the FIFO (queue) and motion commands are empty, we also
+// get a true picture of where the global step
+//
+// Step counts up to 16,777,215 (0xFFFFFF) in either axis are handled: the
+// durations are worked out as Steps * 125 * 2^3 / StepRate (see
+// reciprocal_divide()), and Steps * 125 still fits in 32 bits.
+void parse_HM_packet (void)
+{
+	UINT32 StepRate = 0;
+  INT32  Pos1 = 0;
+  INT32  Pos2 = 0;
+	INT32  Steps1 = 0;
+  INT32  Steps2 = 0;
+  INT32  AbsSteps1 = 0;
+  INT32  AbsSteps2 = 0;
+  UINT32 Duration = 0;
+  BOOL   CommandExecuting = TRUE;
+  INT32  XSteps = 0;
+  ReciprocalType Reciprocal;
+
+	// Extract the step rate.
+	extract_number (kULONG, &StepRate, kREQUIRED);
+	extract_number (kLONG,  &Pos1,     kOPTIONAL);
+	extract_number (kLONG,  &Pos2,     kOPTIONAL);
+
+  // StepRate can't be zero
+  if (StepRate == 0)
+  {
+    bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+    return;
+  }
+  
+  // Anything in the planner has to go first
+  planner_flush();
+
+  // Including anything that ended up in the staging slot
+  if (gCommandStaged)
+  {
+    WAIT_FOR_FIFO_SPACE();
+    staging_service();
+  }
+
+  // Wait until FIFO is empty
+	while(!FIFO_EMPTY())
+	;
+
+  // Then wait for motion command to finish (if one's running)
+  while(CommandExecuting == TRUE)
+  {
+    // Need to turn off high priority interrupts breifly here to read out value that ISR uses
+    INTCONbits.GIEH = 0;	// Turn high priority interrupts off
+
+    // Create our output values to print back to the PC
+    if ((CurrentCommand.DelayCounter == 0) && (CurrentCommand.Command == COMMAND_NONE) && !AxisBusy)
+    {
+      CommandExecuting = FALSE;
+    }
+
+    // Re-enable interrupts
+    INTCONbits.GIEH = 1;	// Turn high priority interrupts on
+  }
+  parse_timing_restart();
+    
+  // Make a local copy of the things we care about. This is how far we need to move.
+  Steps1 = -globalStepCounter[0] + Pos1;
+  Steps2 = -globalStepCounter[1] + Pos2;
+
+  // Compute absolute value versions of steps for computation
+  if (Steps1 < 0)
+  {
+    AbsSteps1 = -Steps1;
+  }
+  else
+  {
+    AbsSteps1 = Steps1;
+  }
+  if (Steps2 < 0)
+  {
+    AbsSteps2 = -Steps2;
+  }
+  else
+  {
+    AbsSteps2 = Steps2;
+  }
+    
+  // Check for too many steps to step
+  if ((AbsSteps1 > 0xFFFFFF) || (AbsSteps2 > 0xFFFFFF))
+  {
+    printf((far rom char *)"!0 Err: steps to home larger than 16,777,215.\n\r");
+    return;
+  }
+  
+  // Compute duration based on step rate user requested. Take bigger step count to use for calculation
+  // (Duration = Steps * 1000 / StepRate, done as Steps * 125 * 2^3 / StepRate)
+  reciprocal_setup(&Reciprocal, StepRate);
+  if (AbsSteps1 > AbsSteps2)
+  {
+    Duration = reciprocal_divide(&Reciprocal, AbsSteps1 * 125, 3);
+    // Axis1 is primary
     // Check for too fast 
-    if ((StepRate/1000) > HIGH_ISR_TICKS_PER_MS)
+    if (StepRate >= ((HIGH_ISR_TICKS_PER_MS + 1) * 1000UL))
     {
       printf((far rom char *)"!0 Err: HM <axis1> step rate > 25K steps/second.\n\r");
       return;
     }
     // Check for too slow, on the non-primary axis
-    if ((Duration/1311) >= AbsSteps2 && AbsSteps2 != 0)
+    if (STEP_RATE_TOO_SLOW(AbsSteps2, Duration))
     {
       // We need to break apart the home into two moves.
       // The first will be to get the non-primary axis down to zero.
       // Recompute duration for the first move
-      Duration = (AbsSteps2 * 1000) / StepRate;
+      Duration = reciprocal_divide(&Reciprocal, AbsSteps2 * 125, 3);
       if (Steps1 > 0 && Steps2 > 0)       // C
       {
         XSteps = Steps2;
@@ -1691,394 +2923,1105 @@ void parse_HM_packet (void)
       Steps1 = Steps1 - XSteps;
       Steps2 = 0;
       // Recompute duration
-      Duration = (AbsSteps1 * 1000) / StepRate;
+      Duration = reciprocal_divide(&Reciprocal, AbsSteps1 * 125, 3);
+    }
+  }
+  else
+  {
+    Duration = reciprocal_divide(&Reciprocal, AbsSteps2 * 125, 3);        
+    // Axis2 is primary
+    // Check for too fast 
+    if (StepRate >= ((HIGH_ISR_TICKS_PER_MS + 1) * 1000UL))
+    {
+      printf((far rom char *)"!0 Err: HM <axis2> step rate > 25K steps/second.\n\r");
+      return;
+    }
+    // Check for too slow, on the non-primary axis
+    if (STEP_RATE_TOO_SLOW(AbsSteps1, Duration))
+    {
+      // We need to break apart the home into two moves.
+      // The first will be to get the non-primary axis down to zero.
+      // Recompute duration for the first move
+      Duration = reciprocal_divide(&Reciprocal, AbsSteps1 * 125, 3);
+      if (Steps2 > 0 && Steps1 > 0)       // C
+      {
+        XSteps = Steps1;
+      }
+      else if (Steps2 < 0 && Steps1 > 0)  // B
+      {
+        XSteps = -Steps1;
+      }
+      else if (Steps2 > 0 && Steps1 < 0)  // D
+      {
+        XSteps = -Steps1;
+      }
+      else if (Steps2 < 0 && Steps1 < 0)  // A
+      {
+        XSteps = Steps1;
+      }
+      process_SM(Duration, Steps1, XSteps, 3);
+      // Update both steps count for final move
+      Steps2 = Steps2 - XSteps;
+      Steps1 = 0;
+      // Recompute duration
+      Duration = reciprocal_divide(&Reciprocal, AbsSteps2 * 125, 3);
+    }
+  }
+
+  if (Duration < 10)
+  {
+    Duration = 10;
+  }
+
+#if defined(DEBUG_VALUE_PRINT)
+  printf((far rom char *)"HM Duration=%lu SA1=%li SA2=%li\n\r",
+    Duration,
+    Steps1,
+    Steps2
+  );
+#endif
+  // If we get here, we know that step rate for both A1 and A2 is
+  // between 25KHz and 1.31Hz which are the limits of what EBB can do.
+  process_SM(Duration, Steps1, Steps2, 3);
+
+  if (g_ack_enable)
+  {
+    print_ack();
+  }
+}
+
+// The X Stepper Motor command
+// Usage: XM,<move_duration>,<axisA_steps>,<axisB_steps><CR>
+// <move_duration> is a number from 1 to 16777215, indicating the number of milliseconds this move should take
+// <axisA_steps> and <axisB_stetsp> are signed 24 bit numbers.
+// This command differs from the normal "SM" command in that it is designed to drive 'mixed-axis' geometry
+// machines like H-Bot and CoreXY. Using XM will effectively call SM with Axis1 = <axisA_steps> + <axisB_steps> and
+// Axis2 = <axisA_steps> - <axisB_steps>.
+void parse_XM_packet (void)
+{
+	UINT32 Duration = 0;
+	INT32 A1Steps = 0, A2Steps = 0;
+  INT32 ASteps = 0, BSteps = 0;
+  INT32 Steps = 0;
+  UINT8 ClearAccs = 0;
+
+	// Extract each of the values.
+	extract_number (kULONG, &Duration, kREQUIRED);
+	extract_number (kLONG, &ASteps, kREQUIRED);
+	extract_number (kLONG, &BSteps, kREQUIRED);
+  extract_number (kUCHAR, &ClearAccs, kOPTIONAL);
+  
+  if (ClearAccs > 3)
+  {
+    ClearAccs = 3;
+  }
+
+    // Check for invalid duration
+    if (Duration == 0) {
+    	bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+    }
+
+    // Do the math to convert to Axis1 and Axis2
+    A1Steps = ASteps + BSteps;
+    A2Steps = ASteps - BSteps;
+    
+    // Check for too-fast step request (>25KHz)
+    // First get absolute value of steps, then check if it's asking for >25KHz
+    if (A1Steps > 0) {
+        Steps = A1Steps;
+    }
+    else {
+        Steps = -A1Steps;
+    }
+    // Limit each parameter to just 3 bytes
+    if (Duration > 0xFFFFFF) {
+       printf((far rom char *)"!0 Err: <move_duration> larger than 16777215 ms.\n\r");
+       return;
+    }
+    if (Steps > 0xFFFFFF) {
+       printf((far rom char *)"!0 Err: <axis1> larger than 16777215 steps.\n\r");
+       return;
+    }
+    // Check for too fast
+    if (STEP_RATE_TOO_FAST(Steps, Duration)) {
+       printf((far rom char *)"!0 Err: <axis1> step rate > 25K steps/second.\n\r");
+       return;
+    }
+    // And check for too slow
+    if (STEP_RATE_TOO_SLOW(Steps, Duration)) {
+       printf((far rom char *)"!0 Err: <axis1> step rate < 1.31Hz.\n\r");
+       return;
+    }
+
+    if (A2Steps > 0) {
+        Steps = A2Steps;
     }
+    else {
+        Steps = -A2Steps;
+    }    
+    if (Steps > 0xFFFFFF) {
+       printf((far rom char *)"!0 Err: <axis2> larger than 16777215 steps.\n\r");
+       return;
+    }
+    if (STEP_RATE_TOO_FAST(Steps, Duration)) {
+       printf((far rom char *)"!0 Err: <axis2> step rate > 25K steps/second.\n\r");
+       return;
+    }
+    if (STEP_RATE_TOO_SLOW(Steps, Duration)) {
+       printf((far rom char *)"!0 Err: <axis2> step rate < 1.31Hz.\n\r");
+       return;
+    }
+
+    // Bail if we got a conversion error
+	if (error_byte)
+	{
+		return;
+	}
+
+    // If we get here, we know that step rate for both A1 and A2 is
+    // between 25KHz and 1.31Hz which are the limits of what EBB can do.
+  	process_SM(Duration, A1Steps, A2Steps, ClearAccs);
+
+	print_ack();
+}
+
+// Main stepper move function. This is the reason EBB exists.
+// <Duration> is a 3 byte unsigned int, the number of mS that the move should take
+// <A1Stp> and <A2Stp> are the Axis 1 and Axis 2 number of steps to take in
+//  <Duration> mS, as 3 byte signed values, where the sign determines the motor
+//  direction.
+// <ClearAccs> clears the accumulators (both if 3, none if 0)
+// This function waits until there is room in the FIFO before placing
+// the data in the FIFO. The ISR then sees this data when it is done with its
+// current move, and starts this new move.
+// If the lookahead planner is on (see PL command), the move goes into the
+// planner instead, and the planner puts it into the FIFO later on.
+//
+// Note that a Rate value of 0x8000000 is not allowed. The function will
+// subtract one if this value for Rate is seen due to step counts and duration.
+//
+static void process_SM(
+  UINT32 Duration,
+  INT32 A1Stp,
+  INT32 A2Stp,
+  UINT8 ClearAccs
+)
+{
+  UINT32 temp = 0;
+  ReciprocalType Reciprocal;
+  MoveCommandType move;
+
+  // Uncomment the following printf() for debugging
+#if defined(DEBUG_VALUE_PRINT)
+  printf((far rom char *)"Duration=%lu SA1=%li SA2=%li\n\r",
+          Duration,
+          A1Stp,
+          A2Stp
+      );
+#endif
+  
+  if (ClearAccs > 3)
+  {
+    ClearAccs = 3;
+  }
+  move.SEState = ClearAccs;
+
+  // With the planner on, moves go into the planner instead of the FIFO
+  if ((A1Stp != 0 || A2Stp != 0) && planner_add(Duration, A1Stp, A2Stp, ClearAccs))
+  {
+    return;
+  }
+
+  // Check for delay
+  if (A1Stp == 0 && A2Stp == 0)
+  {
+    move.Command = COMMAND_DELAY;
+    // This is OK because we only need to multiply the 3 byte Duration by
+    // 25, so it fits in 4 bytes OK.
+    move.DelayCounter = HIGH_ISR_TICKS_PER_MS * Duration;
   }
   else
   {
-    Duration = (AbsSteps2 * 1000) / StepRate;        
-    // Axis2 is primary
-    // Check for too fast 
-    if ((StepRate/1000) > HIGH_ISR_TICKS_PER_MS)
+    move.DelayCounter = 0; // No delay for motor moves
+    move.DirBits = 0;
+
+    // Always enable both motors when we want to move them
+    Enable1IO = ENABLE_MOTOR;
+    Enable2IO = ENABLE_MOTOR;
+
+    // First, set the direction bits
+    if (A1Stp < 0)
+    {
+      move.DirBits = move.DirBits | DIR1_BIT;
+      A1Stp = -A1Stp;
+    }
+    if (A2Stp < 0)
+    {
+      move.DirBits = move.DirBits | DIR2_BIT;
+      A2Stp = -A2Stp;
+    }
+    // To compute Rate values from Duration.
+    // A1Stp and A2Stp are from 0x000001 to 0xFFFFFF.
+    // HIGH_ISR_TICKS_PER_MS = 25
+    // Duration is from 0x000001 to 0xFFFFFF.
+    // Rate is added to the accumulator every 25KHz, and a step is taken each
+    // time it goes over 0x80000000. So Rate = Steps * 2^31 / (25 * Duration).
+    // Both axes move for the same time, so the reciprocal of (25 * Duration)
+    // is worked out once, and then each Rate is one multiply. This gives the
+    // full precision rate for every move, long or short.
+#if defined(DEBUG_VALUE_PRINT)
+  // First check for duration to large.
+  if (A1Stp < (0xFFFFFF/763)) 
+  {
+    if (Duration > (A1Stp * 763)) 
     {
-      printf((far rom char *)"!0 Err: HM <axis2> step rate > 25K steps/second.\n\r");
-      return;
+      printf((far rom char *)"Major malfunction Axis1 duration too long : %lu\n\r", Duration);
+      temp = 0;
+      A1Stp = 0;
     }
-    // Check for too slow, on the non-primary axis
-    if ((Duration/1311) >= AbsSteps1 && AbsSteps1 != 0)
+  }
+#endif
+    reciprocal_setup(&Reciprocal, HIGH_ISR_TICKS_PER_MS * Duration);
+
+    if (A1Stp != 0) 
     {
-      // We need to break apart the home into two moves.
-      // The first will be to get the non-primary axis down to zero.
-      // Recompute duration for the first move
-      Duration = (AbsSteps1 * 1000) / StepRate;
-      if (Steps2 > 0 && Steps1 > 0)       // C
+      temp = reciprocal_divide(&Reciprocal, A1Stp, 31);
+      if (temp > 0x80000000) 
       {
-        XSteps = Steps1;
+        printf((far rom char *)"Major malfunction Axis1 StepCounter too high : %lu\n\r", temp);
       }
-      else if (Steps2 < 0 && Steps1 > 0)  // B
+      if (temp == 0) 
       {
-        XSteps = -Steps1;
+        printf((far rom char *)"Major malfunction Axis1 StepCounter zero\n\r");
+        temp = 1;
       }
-      else if (Steps2 > 0 && Steps1 < 0)  // D
+    }
+    else
+    {
+      temp = 0;
+    }
+
+    if (temp >= 0x7FFFFFFF)
+    {
+      temp = 0x7FFFFFFF;
+    }
+    move.Rate[0].value = temp;
+    move.Steps[0] = A1Stp;
+    move.Accel[0] = 0;
+
+    if (A2Stp != 0) 
+    {
+      temp = reciprocal_divide(&Reciprocal, A2Stp, 31);
+      if (temp > 0x80000000) 
       {
-        XSteps = -Steps1;
+        printf((far rom char *)"Major malfunction Axis2 StepCounter too high : %lu\n\r", temp);
       }
-      else if (Steps2 < 0 && Steps1 < 0)  // A
+      if (temp == 0) 
       {
-        XSteps = Steps1;
+        printf((far rom char *)"Major malfunction Axis2 StepCounter zero\n\r");
+        temp = 1;
       }
-      process_SM(Duration, Steps1, XSteps, 3);
-      // Update both steps count for final move
-      Steps2 = Steps2 - XSteps;
-      Steps1 = 0;
-      // Recompute duration
-      Duration = (AbsSteps2 * 1000) / StepRate;
     }
+    else
+    {
+      temp = 0;
+    }
+
+    if (temp >= 0x7FFFFFFF)
+    {
+      temp = 0x7FFFFFFF;
+    }
+    move.Rate[1].value = temp;
+    move.Steps[1] = A2Stp;
+    move.Accel[1] = 0;
+    move.Command = COMMAND_MOTOR_MOVE;
+
+    /* For debugging step motion , uncomment the next line */
+#if defined(DEBUG_VALUE_PRINT)
+    printf((far rom char *)"R1=%lu S1=%lu R2=%lu S2=%lu\n\r",
+            move.Rate[0],
+            move.Steps[0],
+            move.Rate[1],
+            move.Steps[1]
+        );
+#endif
   }
+  
+  // Anything in the planner has to go first
+  planner_flush();
 
-  if (Duration < 10)
+  // Now, quick copy over the computed command data to the command fifo
+  queue_command(&move);
+}
+
+// Command staging
+//
+// The command parsers used to spin waiting for room in the FIFO, and while
+// they spun nothing else got done: no USB data came in, and no replies went
+// out. Now when the FIFO is full, queue_command() parks the command in a
+// single staging slot and returns, so the command can be acked right away.
+// staging_service() (called from the main loop) moves it into the FIFO as soon
+// as there's room. While a command is staged, ProcessIO() only runs commands
+// that never touch the FIFO (queries and ES, see command_intake_ready()) and
+// leaves the rest waiting in the USB buffers.
+
+// Add a command to the end of the FIFO, or to the staging slot if the FIFO
+// is full. command_intake_ready() holds back block move frames and planner
+// flushes until the FIFO has room for them, so the only thing that can still
+// find the staging slot full is an SM or XM move the planner won't take
+// (see planner_add()) flushing a planner that holds more moves than the FIFO
+// has room for. That has to wait here for the ISR to make room.
+void queue_command(MoveCommandType * Command)
+{
+  if (gCommandStaged)
   {
-    Duration = 10;
+    WAIT_FOR_FIFO_SPACE();
+    staging_service();
   }
 
-#if defined(DEBUG_VALUE_PRINT)
-  printf((far rom char *)"HM Duration=%lu SA1=%li SA2=%li\n\r",
-    Duration,
-    Steps1,
-    Steps2
-  );
-#endif
-  // If we get here, we know that step rate for both A1 and A2 is
-  // between 25KHz and 1.31Hz which are the limits of what EBB can do.
-  process_SM(Duration, Steps1, Steps2, 3);
+  // Only servo commands come with a servo move; SP attaches one to a motor
+  // move (see attach_pen_move()) after it has been queued
+  if (Command->Command != COMMAND_SERVO_MOVE)
+  {
+    Command->ServoRPn = 0;
+  }
 
-  if (g_ack_enable)
+  if (FIFO_FULL())
   {
-    print_ack();
+    StagedCommand = *Command;
+    gCommandStaged = TRUE;
+    return;
   }
+
+  CommandFIFO[gFIFOIn] = *Command;
+  gFIFOIn = (gFIFOIn + 1) & COMMAND_FIFO_MASK;
 }
 
-// The X Stepper Motor command
-// Usage: XM,<move_duration>,<axisA_steps>,<axisB_steps><CR>
-// <move_duration> is a number from 1 to 16777215, indicating the number of milliseconds this move should take
-// <axisA_steps> and <axisB_stetsp> are signed 24 bit numbers.
-// This command differs from the normal "SM" command in that it is designed to drive 'mixed-axis' geometry
-// machines like H-Bot and CoreXY. Using XM will effectively call SM with Axis1 = <axisA_steps> + <axisB_steps> and
-// Axis2 = <axisA_steps> - <axisB_steps>.
-void parse_XM_packet (void)
+// Called from the main loop. Moves the staged command (if any) into the FIFO
+// once there is room for it.
+void staging_service(void)
 {
-	UINT32 Duration = 0;
-	INT32 A1Steps = 0, A2Steps = 0;
-  INT32 ASteps = 0, BSteps = 0;
-  INT32 Steps = 0;
-  UINT8 ClearAccs = 0;
+  if (gCommandStaged && !FIFO_FULL())
+  {
+    CommandFIFO[gFIFOIn] = StagedCommand;
+    gFIFOIn = (gFIFOIn + 1) & COMMAND_FIFO_MASK;
+    gCommandStaged = FALSE;
+  }
+}
 
-	// Extract each of the values.
-	extract_number (kULONG, &Duration, kREQUIRED);
-	extract_number (kLONG, &ASteps, kREQUIRED);
-	extract_number (kLONG, &BSteps, kREQUIRED);
-  extract_number (kUCHAR, &ClearAccs, kOPTIONAL);
-  
-  if (ClearAccs > 3)
+// Returns TRUE if the command starting with <cmd1> and <cmd2> (as upper case
+// letters, with cmd2 zero for one letter commands, or both zero for a binary
+// frame) can be run now without waiting on the FIFO. <Entries> is how many
+// commands it can put in the FIFO at once: the move count of a block move
+// frame, otherwise 1.
+BOOL command_intake_ready(UINT8 cmd1, UINT8 cmd2, UINT8 Entries)
+{
+  // These never add anything to the FIFO, so they can always run
+  if (
+    (cmd1 == 'Q' && cmd2 != 0)
+    ||
+    (cmd1 == 'V' && cmd2 == 0)
+    ||
+    (cmd1 == 'E' && cmd2 == 'S')
+  )
   {
-    ClearAccs = 3;
+    return TRUE;
   }
 
-    // Check for invalid duration
-    if (Duration == 0) {
-    	bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
-    }
+  if (gCommandStaged)
+  {
+    return FALSE;
+  }
 
-    // Do the math to convert to Axis1 and Axis2
-    A1Steps = ASteps + BSteps;
-    A2Steps = ASteps - BSteps;
-    
-    // Check for too-fast step request (>25KHz)
-    // First get absolute value of steps, then check if it's asking for >25KHz
-    if (A1Steps > 0) {
-        Steps = A1Steps;
-    }
-    else {
-        Steps = -A1Steps;
-    }
-    // Limit each parameter to just 3 bytes
-    if (Duration > 0xFFFFFF) {
-       printf((far rom char *)"!0 Err: <move_duration> larger than 16777215 ms.\n\r");
-       return;
+  // Commands that empty the planner into the FIFO (see planner_flush()) wait
+  // here while planner_service() hands the moves over as room comes free,
+  // instead of waiting in their parsers for room for all of them at once
+  if (
+    PlannerCount
+    &&
+    (
+      0 == cmd1
+      ||
+      'L' == cmd1
+      ||
+      ('H' == cmd1 && 'M' == cmd2)
+      ||
+      ('P' == cmd1 && 'L' == cmd2)
+      ||
+      ('T' == cmd1 && 'P' == cmd2)
+      ||
+      ('S' == cmd1 && ('P' == cmd2 || '2' == cmd2 || 'E' == cmd2 || 'C' == cmd2))
+    )
+  )
+  {
+    PlannerDraining = TRUE;
+    return FALSE;
+  }
+
+  // A block move frame's moves all have to fit, apart from the last one,
+  // which can go in the staging slot
+  if (FIFO_DEPTH() + Entries - 1 > COMMAND_FIFO_MASK)
+  {
+    return FALSE;
+  }
+
+  // A full planner has to push a move (up to 3 FIFO entries) before it can
+  // take another one
+  if (
+    PlannerCount == PLANNER_LENGTH
+    &&
+    FIFO_DEPTH() > (COMMAND_FIFO_LENGTH - 1 - 3)
+  )
+  {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+// Event reports
+//
+// With events turned on (CU,4,1) the main loop sends a short packet to the PC
+// whenever one of these things happens, so the host doesn't have to keep
+// asking with QB or QM:
+//   EV,B<CR><LF>  PRG (or alternate pause) button was pressed
+//   EV,L<CR><LF>  FIFO drained down to the low-water mark set with CU,5
+//   EV,E<CR><LF>  all queued motion (FIFO, staged and planner) has been taken
+//                 by the ISR
+//   EV,D<CR><LF>  last motion command has finished, motors are idle
+// Events are only ever sent between replies, never in the middle of one.
+void events_service(void)
+{
+  static BOOL WasQueued = FALSE;
+  static BOOL WasBusy = FALSE;
+  static BOOL WasAboveLowWater = FALSE;
+  UINT8 Status;
+  BOOL AboveLowWater;
+
+  Status = process_QM();
+  AboveLowWater = (FIFO_DEPTH() > gEventLowWater);
+
+  if (gEventsEnable)
+  {
+    if (ButtonEvent)
+    {
+      ButtonEvent = FALSE;
+      printf((far rom char *)"EV,B\r\n");
     }
-    if (Steps > 0xFFFFFF) {
-       printf((far rom char *)"!0 Err: <axis1> larger than 16777215 steps.\n\r");
-       return;
+    if (gEventLowWater && WasAboveLowWater && !AboveLowWater)
+    {
+      printf((far rom char *)"EV,L\r\n");
     }
-    // Check for too fast
-    if ((Steps/Duration) > HIGH_ISR_TICKS_PER_MS) {
-       printf((far rom char *)"!0 Err: <axis1> step rate > 25K steps/second.\n\r");
-       return;
+    if (WasQueued && !(Status & 0x01))
+    {
+      printf((far rom char *)"EV,E\r\n");
     }
-    // And check for too slow
-    if ((Duration/1311) >= Steps && Steps != 0) {
-       printf((far rom char *)"!0 Err: <axis1> step rate < 1.31Hz.\n\r");
-       return;
+    if (WasBusy && !(Status & 0x08))
+    {
+      printf((far rom char *)"EV,D\r\n");
     }
+  }
+  else
+  {
+    // Don't report a stale press when events get turned on later
+    ButtonEvent = FALSE;
+  }
 
-    if (A2Steps > 0) {
-        Steps = A2Steps;
-    }
-    else {
-        Steps = -A2Steps;
-    }    
-    if (Steps > 0xFFFFFF) {
-       printf((far rom char *)"!0 Err: <axis2> larger than 16777215 steps.\n\r");
-       return;
-    }
-    if ((Steps/Duration) > HIGH_ISR_TICKS_PER_MS) {
-       printf((far rom char *)"!0 Err: <axis2> step rate > 25K steps/second.\n\r");
-       return;
+  WasQueued = ((Status & 0x01) != 0);
+  WasBusy = ((Status & 0x08) != 0);
+  WasAboveLowWater = AboveLowWater;
+}
+
+// Lookahead planner
+//
+// Normally every SM move runs at one constant speed from start to finish, so
+// the motors jump straight from one move's speed to the next. With the planner
+// turned on (PL command), SM moves are held in a small buffer (PlannerBlock[])
+// before they go into the FIFO. Each time a move comes in, the planner works
+// out how fast the machine can go through each corner (the junction deviation
+// method) and then how fast each move can start and end without ever
+// accelerating harder than PlannerAccel, always leaving room to come to a stop
+// at the end of the last move it knows about. The SM <Duration> only sets the
+// top speed of the move.
+//
+// A move only leaves the planner when the FIFO is running low (see
+// planner_service()) or when something that isn't a planned move needs to go
+// into the FIFO (see planner_flush()). It is then turned into up to three
+// LM style commands: accelerate, cruise, and decelerate.
+//
+// All speeds are kept squared, in (steps/s)^2, so that the passes through the
+// buffer are just adds and compares. Lengths are in steps, measured as if
+// both axes were at right angles to each other with the same step size.
+
+// Square root of a 32 bit value, rounded down
+static UINT32 isqrt32(UINT32 Value)
+{
+  UINT32 Root = 0;
+  UINT32 Bit = 0x40000000;
+
+  while (Bit > Value)
+  {
+    Bit >>= 2;
+  }
+  while (Bit != 0)
+  {
+    if (Value >= Root + Bit)
+    {
+      Value -= Root + Bit;
+      Root = (Root >> 1) + Bit;
     }
-    if ((Duration/1311) >= Steps && Steps != 0) {
-       printf((far rom char *)"!0 Err: <axis2> step rate < 1.31Hz.\n\r");
-       return;
+    else
+    {
+      Root >>= 1;
     }
+    Bit >>= 2;
+  }
+  return Root;
+}
 
-    // Bail if we got a conversion error
-	if (error_byte)
-	{
-		return;
-	}
+// Returns Value * Num / Den without overflowing, for Num <= Den. This is
+// exact as long as Den fits in 16 bits, and very close otherwise.
+static UINT32 scale_u32(UINT32 Value, UINT32 Num, UINT32 Den)
+{
+  UINT32 Hi;
+  UINT32 Lo;
+  UINT32 Result;
+  UINT32 Rem1;
+  UINT32 Rem2;
+
+  if (Den == 0)
+  {
+    return 0;
+  }
+  if (Num > Den)
+  {
+    Num = Den;
+  }
+  while (Den > 0xFFFF)
+  {
+    Num >>= 1;
+    Den >>= 1;
+  }
+  Hi = (Value >> 16) * Num;
+  Lo = (Value & 0xFFFF) * Num;
+  Result = (Hi / Den) << 16;
+  Rem1 = (Hi % Den) << 16;
+  Result += Rem1 / Den;
+  Result += Lo / Den;
+  Result += ((Rem1 % Den) + (Lo % Den)) / Den;
+  return Result;
+}
+
+// Add two squared speeds, stopping at the largest value rather than wrapping
+static UINT32 planner_add_sq(UINT32 A, UINT32 B)
+{
+  if (A > 0xFFFFFFFF - B)
+  {
+    return 0xFFFFFFFF;
+  }
+  return A + B;
+}
+
+// Work out the values that only change when the PL settings change
+static void planner_setup(void)
+{
+  PlannerTwoA = PlannerAccel << 1;
+  PlannerMinSq = (UINT32)PlannerMinRate * PlannerMinRate;
+  // A move that slows down to a rate R takes the last step a little late,
+  // and keeps slowing down until it does. R^2 >= 2 * Accel makes sure the
+  // rate can never get all the way down to zero before that last step.
+  if (PlannerMinSq < PlannerTwoA)
+  {
+    PlannerMinSq = PlannerTwoA;
+  }
+  // Anything longer than this can accelerate from any speed to any other
+  PlannerTwoADLimit = 0xFFFFFFFF / PlannerTwoA;
+  if (PlannerAccel > 0xFFFFFFFF / PlannerJunctionDeviation)
+  {
+    PlannerJunctionK = (PlannerAccel / 100) * PlannerJunctionDeviation;
+  }
+  else
+  {
+    PlannerJunctionK = (PlannerAccel * PlannerJunctionDeviation) / 100;
+  }
+  PlannerExitSq = PlannerMinSq;
+}
 
-    // If we get here, we know that step rate for both A1 and A2 is
-    // between 25KHz and 1.31Hz which are the limits of what EBB can do.
-  	process_SM(Duration, A1Steps, A2Steps, ClearAccs);
+// Length of the move, in steps, to about one part in 32768
+static UINT32 planner_length(UINT32 Steps1, UINT32 Steps2)
+{
+  UINT8 Shift = 0;
 
-	print_ack();
+  while (Steps1 > 0x7FFF || Steps2 > 0x7FFF)
+  {
+    Steps1 >>= 1;
+    Steps2 >>= 1;
+    Shift++;
+  }
+  return isqrt32((Steps1 * Steps1) + (Steps2 * Steps2)) << Shift;
 }
 
-// Main stepper move function. This is the reason EBB exists.
-// <Duration> is a 3 byte unsigned int, the number of mS that the move should take
-// <A1Stp> and <A2Stp> are the Axis 1 and Axis 2 number of steps to take in
-//  <Duration> mS, as 3 byte signed values, where the sign determines the motor
-//  direction.
-// <ClearAccs> clears the accumulators (both if 3, none if 0)
-// This function waits until there is room in the 1-deep FIFO before placing
-// the data in the FIFO. The ISR then sees this data when it is done with its
-// current move, and starts this new move.
-//
-// Note that a Rate value of 0x8000000 is not allowed. The function will
-// subtract one if this value for Rate is seen due to step counts and duration.
-//
-// In the future, making the FIFO more elements deep may be cool.
-// 
-static void process_SM(
-  UINT32 Duration,
-  INT32 A1Stp,
-  INT32 A2Stp,
-  UINT8 ClearAccs
-)
+// Fastest speed (squared) the machine can go through the corner between the
+// previous move and one in direction Unit[]. This is the junction deviation
+// method: the speed at which a circle that just touches both moves, and
+// comes no closer than PlannerJunctionDeviation to the corner, would have a
+// centripetal acceleration of PlannerAccel.
+static UINT32 planner_junction_sq(INT16 * Unit)
 {
-  UINT32 temp = 0;
-  UINT32 temp1 = 0;
-  UINT32 temp2 = 0;
-  UINT32 remainder = 0;
-  MoveCommandType move;
+  INT32 Dot;
+  UINT32 SinSq;
+  UINT32 Sin;
+
+  // Dot product of the two directions is the cosine of the angle between
+  // them. sin^2(theta/2) = (1 + cos)/2 where theta is the angle of the corner
+  // itself (180 degrees when going straight on).
+  Dot = ((INT32)PlannerPrevUnit[0] * Unit[0]) + ((INT32)PlannerPrevUnit[1] * Unit[1]);
+  SinSq = (UINT32)(Dot + ((INT32)PLANNER_UNIT * PLANNER_UNIT)) >> 15;
+  if (SinSq > PLANNER_UNIT)
+  {
+    SinSq = PLANNER_UNIT;
+  }
+  Sin = isqrt32(SinSq * PLANNER_UNIT);
+  if (Sin >= PLANNER_UNIT)
+  {
+    // Straight on, there's no corner to slow down for
+    return 0xFFFFFFFF;
+  }
 
-  // Uncomment the following printf() for debugging
-#if defined(DEBUG_VALUE_PRINT)
-  printf((far rom char *)"Duration=%lu SA1=%li SA2=%li\n\r",
-          Duration,
-          A1Stp,
-          A2Stp
-      );
-#endif
-  
-  if (ClearAccs > 3)
+  // v^2 = a * deviation * sin / (1 - sin)
+  if (PlannerJunctionK <= 0xFFFFFFFF / PLANNER_UNIT)
   {
-    ClearAccs = 3;
+    return (PlannerJunctionK * Sin) / (PLANNER_UNIT - Sin);
   }
-  move.SEState = ClearAccs;
+  Dot = PlannerJunctionK / (PLANNER_UNIT - Sin);
+  if ((UINT32)Dot > 0xFFFFFFFF / PLANNER_UNIT)
+  {
+    return 0xFFFFFFFF;
+  }
+  return (UINT32)Dot * Sin;
+}
 
-  // Check for delay
-  if (A1Stp == 0 && A2Stp == 0)
+// Go back over every move in the planner and work out the speed each one
+// should start at, now that there is a new move at the end.
+static void planner_recalculate(void)
+{
+  UINT8 n;
+  UINT8 Index;
+  UINT8 Next;
+  UINT32 ExitSq;
+  UINT32 LimitSq;
+
+  // Backward pass: the last move has to be able to stop (at PlannerMinSq),
+  // and every move has to be able to slow down to the start speed of the
+  // one after it. The first move's start speed is already fixed.
+  Index = (PlannerOut + PlannerCount - 1) & PLANNER_MASK;
+  ExitSq = PlannerMinSq;
+  for (n = PlannerCount; n > 1; n--)
   {
-    move.Command = COMMAND_DELAY;
-    // This is OK because we only need to multiply the 3 byte Duration by
-    // 25, so it fits in 4 bytes OK.
-    move.DelayCounter = HIGH_ISR_TICKS_PER_MS * Duration;
+    LimitSq = planner_add_sq(ExitSq, PlannerBlock[Index].TwoAD);
+    if (LimitSq > PlannerBlock[Index].MaxEntrySq)
+    {
+      LimitSq = PlannerBlock[Index].MaxEntrySq;
+    }
+    PlannerBlock[Index].EntrySq = LimitSq;
+    ExitSq = LimitSq;
+    Index = (Index - 1) & PLANNER_MASK;
+  }
+
+  // Forward pass: no move can start faster than the one before it could
+  // speed up to.
+  Index = PlannerOut;
+  PlannerBlock[Index].EntrySq = PlannerExitSq;
+  for (n = 1; n < PlannerCount; n++)
+  {
+    Next = (Index + 1) & PLANNER_MASK;
+    LimitSq = planner_add_sq(PlannerBlock[Index].EntrySq, PlannerBlock[Index].TwoAD);
+    if (PlannerBlock[Next].EntrySq > LimitSq)
+    {
+      PlannerBlock[Next].EntrySq = LimitSq;
+    }
+    Index = Next;
+  }
+}
+
+// Add an SM move to the planner. Returns FALSE if the planner is off, or the
+// move can't be planned (in which case it should be queued up as normal).
+static BOOL planner_add(UINT32 Duration, INT32 Steps1, INT32 Steps2, UINT8 ClearAccs)
+{
+  UINT32 Abs1;
+  UINT32 Abs2;
+  UINT32 Length;
+  UINT32 Nominal;
+  UINT32 NominalSq;
+  UINT32 MaxEntrySq;
+  INT16 Unit[NUMBER_OF_STEPPERS];
+  UINT8 Index;
+
+  if (!gPlannerEnable || Duration == 0)
+  {
+    return FALSE;
+  }
+
+  Abs1 = (Steps1 < 0) ? -Steps1 : Steps1;
+  Abs2 = (Steps2 < 0) ? -Steps2 : Steps2;
+  Length = planner_length(Abs1, Abs2);
+
+  // The speed the PC asked for becomes the top speed of this move
+  if (Length < 4294967)
+  {
+    Nominal = (Length * 1000) / Duration;
   }
   else
   {
-    move.DelayCounter = 0; // No delay for motor moves
-    move.DirBits = 0;
+    Nominal = (Length / Duration) * 1000;
+  }
+  if (Nominal > PLANNER_MAX_RATE)
+  {
+    Nominal = PLANNER_MAX_RATE;
+  }
+  NominalSq = Nominal * Nominal;
 
-    // Always enable both motors when we want to move them
-    Enable1IO = ENABLE_MOTOR;
-    Enable2IO = ENABLE_MOTOR;
+  // Moves slower than the minimum rate just run the old way, after the
+  // planner has brought everything down to the minimum rate.
+  if (NominalSq < PlannerMinSq)
+  {
+    return FALSE;
+  }
 
-    // First, set the direction bits
-    if (A1Stp < 0)
+  Unit[0] = scale_u32(PLANNER_UNIT, Abs1, Length);
+  if (Steps1 < 0)
+  {
+    Unit[0] = -Unit[0];
+  }
+  Unit[1] = scale_u32(PLANNER_UNIT, Abs2, Length);
+  if (Steps2 < 0)
+  {
+    Unit[1] = -Unit[1];
+  }
+
+  // How fast can we go through the corner from the last move into this one?
+  if (PlannerPrevValid)
+  {
+    MaxEntrySq = planner_junction_sq(Unit);
+    if (MaxEntrySq > NominalSq)
     {
-      move.DirBits = move.DirBits | DIR1_BIT;
-      A1Stp = -A1Stp;
+      MaxEntrySq = NominalSq;
     }
-    if (A2Stp < 0)
+    if (MaxEntrySq > PlannerPrevNominalSq)
     {
-      move.DirBits = move.DirBits | DIR2_BIT;
-      A2Stp = -A2Stp;
+      MaxEntrySq = PlannerPrevNominalSq;
     }
-    // To compute StepAdd values from Duration.
-    // A1Stp is from 0x000001 to 0xFFFFFF.
-    // HIGH_ISR_TICKS_PER_MS = 25
-    // Duration is from 0x000001 to 0xFFFFFF.
-    // temp needs to be from 0x0001 to 0x7FFF.
-    // Temp is added to accumulator every 25KHz. So slowest step rate
-    // we can do is 1 step every 25KHz / 0x7FFF or 1 every 763mS. 
-    // Fastest step rate is obviously 25KHz.
-    // If A1Stp is 1, then duration must be 763 or less.
-    // If A1Stp is 2, then duration must be 763 * 2 or less.
-    // If A1Stp is 0xFFFFFF, then duration must be at least 671088.
-#if defined(DEBUG_VALUE_PRINT)
-  // First check for duration to large.
-  if (A1Stp < (0xFFFFFF/763)) 
-  {
-    if (Duration > (A1Stp * 763)) 
+    if (MaxEntrySq < PlannerMinSq)
     {
-      printf((far rom char *)"Major malfunction Axis1 duration too long : %lu\n\r", Duration);
-      temp = 0;
-      A1Stp = 0;
+      MaxEntrySq = PlannerMinSq;
     }
   }
-#endif
-    if (A1Stp != 0) 
+  else
+  {
+    MaxEntrySq = PlannerMinSq;
+  }
+
+  // Make room if we need to
+  if (PlannerCount == PLANNER_LENGTH)
+  {
+    planner_push();
+  }
+
+  Index = (PlannerOut + PlannerCount) & PLANNER_MASK;
+  PlannerBlock[Index].Steps[0] = Steps1;
+  PlannerBlock[Index].Steps[1] = Steps2;
+  PlannerBlock[Index].Length = Length;
+  PlannerBlock[Index].NominalSq = NominalSq;
+  PlannerBlock[Index].MaxEntrySq = MaxEntrySq;
+  PlannerBlock[Index].EntrySq = MaxEntrySq;
+  if (Length >= PlannerTwoADLimit)
+  {
+    PlannerBlock[Index].TwoAD = 0xFFFFFFFF;
+  }
+  else
+  {
+    PlannerBlock[Index].TwoAD = PlannerTwoA * Length;
+  }
+  PlannerBlock[Index].ClearAccs = ClearAccs;
+  PlannerCount++;
+
+  PlannerPrevUnit[0] = Unit[0];
+  PlannerPrevUnit[1] = Unit[1];
+  PlannerPrevNominalSq = NominalSq;
+  PlannerPrevValid = TRUE;
+
+  planner_recalculate();
+  return TRUE;
+}
+
+// Queue up the part of a planned move from From to To steps along it, going
+// from a speed of StartSq to EndSq with a constant acceleration.
+static void planner_queue_piece(
+  UINT8 Index,
+  UINT32 From,
+  UINT32 To,
+  UINT32 StartSq,
+  UINT32 EndSq,
+  UINT8 ClearAccs
+)
+{
+  UINT32 Start;
+  UINT32 Sum;
+  UINT32 Distance;
+  UINT32 Ticks;
+  UINT32 AbsSteps;
+  UINT32 Count[NUMBER_OF_STEPPERS];
+  INT32 Steps[NUMBER_OF_STEPPERS];
+  UINT32 Rate[NUMBER_OF_STEPPERS];
+  INT32 Accel[NUMBER_OF_STEPPERS];
+  UINT32 RateAvg;
+  UINT32 RateEnd;
+  UINT8 i;
+
+  for (i = 0; i < NUMBER_OF_STEPPERS; i++)
+  {
+    Steps[i] = PlannerBlock[Index].Steps[i];
+    AbsSteps = (Steps[i] < 0) ? -Steps[i] : Steps[i];
+    Count[i] = scale_u32(AbsSteps, To, PlannerBlock[Index].Length)
+      - scale_u32(AbsSteps, From, PlannerBlock[Index].Length);
+  }
+  if (Count[0] == 0 && Count[1] == 0)
+  {
+    return;
+  }
+
+  // Time this piece takes, in ISR ticks, at the average of the two speeds
+  Start = isqrt32(StartSq);
+  Sum = Start + isqrt32(EndSq);
+  Distance = To - From;
+  Ticks = ((Distance / Sum) * (2 * 25000UL)) + (((Distance % Sum) * (2 * 25000UL)) / Sum);
+  if (Ticks == 0)
+  {
+    Ticks = 1;
+  }
+
+  // Each axis gets its share of the speed, in accumulator units (0x80000000
+  // is one step every ISR tick)
+  for (i = 0; i < NUMBER_OF_STEPPERS; i++)
+  {
+    Rate[i] = 0;
+    Accel[i] = 0;
+    if (Count[i] != 0)
     {
-      if (A1Stp < 0x1FFFF) 
-      {
-        temp1 = HIGH_ISR_TICKS_PER_MS * Duration;
-        temp = (A1Stp << 15)/temp1;
-        temp2 = (A1Stp << 15) % temp1;
-        /* Because it takes us about 5ms extra time to do this division,
-         * we only perform this extra step if our move is long enough to
-         * warrant it. That way, for really short moves (where the extra
-         * precision isn't necessary) we don't take up extra time. Without
-         * this optimization, our minimum move time is 20ms. With it, it
-         * drops down to about 15ms.
-         */
-        if (Duration > 30)
-        {
-          remainder = (temp2 << 16) / temp1;
-        }
-      }
-      else 
-      {
-        temp = (((A1Stp/Duration) * (UINT32)0x8000)/(UINT32)HIGH_ISR_TICKS_PER_MS);
-        remainder = 0;
-      }
-      if (temp > 0x8000) 
-      {
-        printf((far rom char *)"Major malfunction Axis1 StepCounter too high : %lu\n\r", temp);
-        temp = 0x8000;
-      }
-      if (temp == 0 && A1Stp != 0) 
-      {
-        printf((far rom char *)"Major malfunction Axis1 StepCounter zero\n\r");
-        temp = 1;
-      }
-      if (Duration > 30)
+      RateAvg = scale_u32(0x80000000, Count[i], Ticks);
+      Rate[i] = scale_u32(RateAvg, Start, Sum) << 1;
+      RateEnd = (RateAvg << 1) - Rate[i];
+      if (Rate[i] > 0x7FFFFFFF)
       {
-        temp = (temp << 16) + remainder;
+        Rate[i] = 0x7FFFFFFF;
       }
-      else
+      if (RateEnd > 0x7FFFFFFF)
       {
-        temp = (temp << 16);
+        RateEnd = 0x7FFFFFFF;
       }
+      Accel[i] = ((INT32)RateEnd - (INT32)Rate[i]) / (INT32)Ticks;
+    }
+    if (Steps[i] < 0)
+    {
+      Steps[i] = -(INT32)Count[i];
     }
     else
     {
-      temp = 0;
+      Steps[i] = Count[i];
     }
+  }
 
-    if (temp >= 0x7FFFFFFF)
+  process_LM(Rate[0], Steps[0], Accel[0], Rate[1], Steps[1], Accel[1], ClearAccs);
+}
+
+// Hand the oldest move in the planner over to the FIFO
+static void planner_push(void)
+{
+  UINT8 Index = PlannerOut;
+  UINT32 Length = PlannerBlock[Index].Length;
+  UINT32 EntrySq = PlannerBlock[Index].EntrySq;
+  UINT32 ExitSq;
+  UINT32 PeakSq;
+  UINT32 AccelDist;
+  UINT32 DecelDist;
+
+  if (PlannerCount > 1)
+  {
+    ExitSq = PlannerBlock[(Index + 1) & PLANNER_MASK].EntrySq;
+  }
+  else
+  {
+    ExitSq = PlannerMinSq;
+  }
+
+  // Speed up to the top speed, cruise, then slow down to the exit speed
+  PeakSq = PlannerBlock[Index].NominalSq;
+  if (PeakSq < EntrySq)
+  {
+    PeakSq = EntrySq;
+  }
+  if (PeakSq < ExitSq)
+  {
+    PeakSq = ExitSq;
+  }
+  AccelDist = (PeakSq - EntrySq) / PlannerTwoA;
+  DecelDist = (PeakSq - ExitSq) / PlannerTwoA;
+  if (AccelDist + DecelDist > Length)
+  {
+    // Not enough room to get to the top speed, so go as fast as we can:
+    // the peak is where the speed up and slow down curves meet.
+    PeakSq = (PlannerBlock[Index].TwoAD >> 1) + (EntrySq >> 1) + (ExitSq >> 1);
+    if (PeakSq < EntrySq)
     {
-      temp = 0x7FFFFFFF;
+      PeakSq = EntrySq;
     }
-    move.Rate[0].value = temp;
-    move.Steps[0] = A1Stp;
-    move.Accel[0] = 0;
-
-    if (A2Stp != 0) 
+    if (PeakSq < ExitSq)
     {
-      if (A2Stp < 0x1FFFF) 
-      {
-        temp1 = HIGH_ISR_TICKS_PER_MS * Duration;
-        temp = (A2Stp << 15)/temp1;
-        temp2 = (A2Stp << 15) % temp1; 
-        if (Duration > 30)
-        {
-          remainder = (temp2 << 16) / temp1;
-        }
-      }
-      else 
-      {
-        temp = (((A2Stp/Duration) * (UINT32)0x8000)/(UINT32)HIGH_ISR_TICKS_PER_MS);
-        remainder = 0;
-      }
-      if (temp > 0x8000) 
-      {
-        printf((far rom char *)"Major malfunction Axis2 StepCounter too high : %lu\n\r", temp);
-        temp = 0x8000;
-      }
-      if (temp == 0 && A2Stp != 0) 
-      {
-        printf((far rom char *)"Major malfunction Axis2 StepCounter zero\n\r");
-        temp = 1;
-      }
-      if (Duration > 30)
-      {
-        temp = (temp << 16) + remainder;
-      }
-      else
-      {
-        temp = (temp << 16);
-      }
+      PeakSq = ExitSq;
     }
-
-    if (temp >= 0x7FFFFFFF)
+    AccelDist = (PeakSq - EntrySq) / PlannerTwoA;
+    if (AccelDist > Length)
     {
-      temp = 0x7FFFFFFF;
+      AccelDist = Length;
     }
-    move.Rate[1].value = temp;
-    move.Steps[1] = A2Stp;
-    move.Accel[1] = 0;
-    move.Command = COMMAND_MOTOR_MOVE;
+    DecelDist = Length - AccelDist;
+  }
 
-    /* For debugging step motion , uncomment the next line */
-#if defined(DEBUG_VALUE_PRINT)
-    printf((far rom char *)"R1=%lu S1=%lu R2=%lu S2=%lu\n\r",
-            move.Rate[0],
-            move.Steps[0],
-            move.Rate[1],
-            move.Steps[1]
-        );
-#endif
+  PlannerPushing = TRUE;
+  planner_queue_piece(Index, 0, AccelDist, EntrySq, PeakSq, PlannerBlock[Index].ClearAccs);
+  planner_queue_piece(Index, AccelDist, Length - DecelDist, PeakSq, PeakSq, 0);
+  planner_queue_piece(Index, Length - DecelDist, Length, PeakSq, ExitSq, 0);
+  PlannerPushing = FALSE;
+
+  PlannerExitSq = ExitSq;
+  PlannerOut = (PlannerOut + 1) & PLANNER_MASK;
+  PlannerCount--;
+}
+
+// Move everything the planner is holding into the FIFO, ending at a stop.
+// Called before anything that isn't a planned move goes into the FIFO, so
+// that everything still happens in the order it was sent.
+void planner_flush(void)
+{
+  while (PlannerCount)
+  {
+    planner_push();
+  }
+  PlannerPrevValid = FALSE;
+  PlannerExitSq = PlannerMinSq;
+}
+
+// Called from the main loop. Keeps the FIFO from running dry while the
+// planner holds on to moves for as long as it can, or empties the planner
+// as fast as the FIFO will take the moves if a command is waiting for that
+// (see command_intake_ready()).
+void planner_service(void)
+{
+  while (
+    PlannerCount
+    &&
+    !gCommandStaged
+    &&
+    (
+      FIFO_DEPTH() < PLANNER_FIFO_LOW_WATER
+      ||
+      (PlannerDraining && FIFO_DEPTH() <= COMMAND_FIFO_MASK - 3)
+    )
+  )
+  {
+    planner_push();
+  }
+  if (0 == PlannerCount)
+  {
+    PlannerDraining = FALSE;
+  }
+}
+
+// PL command
+// For PLanner - turns the lookahead motion planner on or off, and sets it up
+// Usage: PL,<Enable>[,<Accel>[,<JunctionDeviation>[,<MinRate>]]]<CR>
+//        PL<CR>
+// Returns: OK<CR>
+//          or for PL with no parameters,
+//          PL,<Enable>,<Accel>,<JunctionDeviation>,<MinRate><CR>OK<CR>
+// <Enable> is 1 to turn the planner on, 0 to turn it off (the default). Any
+//   moves it is holding are sent on to the FIFO first.
+// <Accel> is the most the planner will accelerate or decelerate along the
+//   path, in steps/s/s, from 1 to 1000000. Default is 10000.
+// <JunctionDeviation> sets how fast corners are taken, in 1/100ths of a step,
+//   from 1 to 65535. Larger values take corners faster. Default is 100.
+// <MinRate> is the slowest speed the planner will slow down to, in steps/s,
+//   from 1 to 25000. The machine has to be able to start and stop instantly at
+//   this speed. The planner never goes lower than sqrt(2 * <Accel>). SM moves
+//   slower than this are run as normal (not planned). Default is 200.
+// While the planner is on, the <Duration> of each SM (and XM and HM) move
+// only sets the top speed for the move, so moves take a little longer than
+// <Duration> when the planner has to slow down or speed up.
+void parse_PL_packet(void)
+{
+  UINT8 Enable;
+  UINT32 Accel = PlannerAccel;
+  UINT16 JunctionDeviation = PlannerJunctionDeviation;
+  UINT16 MinRate = PlannerMinRate;
+  ExtractReturnType GotEnable;
+
+  GotEnable = extract_number(kUCHAR, &Enable, kOPTIONAL);
+  extract_number(kULONG, &Accel, kOPTIONAL);
+  extract_number(kUINT, &JunctionDeviation, kOPTIONAL);
+  extract_number(kUINT, &MinRate, kOPTIONAL);
+
+  // Bail if we got a conversion error
+  if (error_byte)
+  {
+    return;
+  }
+
+  if (GotEnable != kEXTRACT_OK)
+  {
+    printf((far ROM char *)"PL,%i,%lu,%u,%u\n\r",
+      gPlannerEnable,
+      PlannerAccel,
+      PlannerJunctionDeviation,
+      PlannerMinRate
+    );
+    print_ack();
+    return;
+  }
+
+  if (
+    Enable > 1
+    ||
+    Accel == 0 || Accel > 1000000
+    ||
+    JunctionDeviation == 0
+    ||
+    MinRate == 0 || MinRate > 25000
+  )
+  {
+    bitset(error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+    return;
   }
-  
-  // Spin here until there's space in the fifo
-  while(!FIFOEmpty)
-  ;
 
-  // Now, quick copy over the computed command data to the command fifo
-  CommandFIFO[0] = move;
+  // Anything already planned was planned with the old settings
+  planner_flush();
 
-  FIFOEmpty = FALSE;
+  gPlannerEnable = Enable;
+  PlannerAccel = Accel;
+  PlannerJunctionDeviation = JunctionDeviation;
+  PlannerMinRate = MinRate;
+  planner_setup();
+
+  print_ack();
 }
 
 // E-Stop
 // Usage: ES<CR>
 // Returns: <command_interrupted>,<fifo_steps1>,<fifo_steps2>,<steps_remaining1>,<steps_remaining2><CR>OK<CR>
-// This command will abort any in-progress motor move (SM) command.
-// It will also clear out any pending command(s) in the FIFO.
+// This command will abort any in-progress motor move (SM) command, or LS
+// step run. It will also clear out any pending ones in the FIFO.
 // <command_interrupted> = 0 if no FIFO or in-progress move commands were interrupted,
 //                         1 if a motor move command was in progress or in the FIFO
-// <fifo_steps1> and <fifo_steps1> = 24 bit unsigned integers with the number of steps
-//                         in any SM command sitting in the fifo for axis1 and axis2.
+// <fifo_steps1> and <fifo_steps1> = 24 bit unsigned integers with the total number of
+//                         steps in all SM commands sitting in the fifo for axis1 and axis2.
 // <steps_remaining1> and <steps_remaining2> = 24 bit unsigned integers with the number of
 //                         steps left in the currently executing SM command (if any) for
 //                         axis1 and axis2.
@@ -2091,34 +4034,125 @@ void parse_ES_packet(void)
     UINT32 remaining_steps2 = 0;
     UINT32 fifo_steps1 = 0;
     UINT32 fifo_steps2 = 0;
-   
-    
-    // If there is a command waiting in the FIFO and it is a move command
-    // or the current command is a move command, then remember that for later.
+    UINT8 j;
+
+    // Moves still waiting in the planner never made it to the FIFO, so just
+    // count them and throw them away
+    for (j = 0; j < PlannerCount; j++)
+    {
+        command_interrupted = 1;
+        if (PlannerBlock[(PlannerOut + j) & PLANNER_MASK].Steps[0] < 0)
+        {
+            fifo_steps1 -= PlannerBlock[(PlannerOut + j) & PLANNER_MASK].Steps[0];
+        }
+        else
+        {
+            fifo_steps1 += PlannerBlock[(PlannerOut + j) & PLANNER_MASK].Steps[0];
+        }
+        if (PlannerBlock[(PlannerOut + j) & PLANNER_MASK].Steps[1] < 0)
+        {
+            fifo_steps2 -= PlannerBlock[(PlannerOut + j) & PLANNER_MASK].Steps[1];
+        }
+        else
+        {
+            fifo_steps2 += PlannerBlock[(PlannerOut + j) & PLANNER_MASK].Steps[1];
+        }
+    }
+    PlannerCount = 0;
+    PlannerPrevValid = FALSE;
+    PlannerExitSq = PlannerMinSq;
+
+    // Same for a move in the staging slot
     if (
-        (!FIFOEmpty && CommandFIFO[0].Command == COMMAND_MOTOR_MOVE)
-        || 
-        CurrentCommand.Command == COMMAND_MOTOR_MOVE
+      gCommandStaged
+      &&
+      (
+        (StagedCommand.Command == COMMAND_MOTOR_MOVE)
+        ||
+        (StagedCommand.Command == COMMAND_STEP_RUN)
+        ||
+        (StagedCommand.Command == COMMAND_AXIS_MOVE)
+      )
     )
     {
         command_interrupted = 1;
+        fifo_steps1 += StagedCommand.Steps[0];
+        fifo_steps2 += StagedCommand.Steps[1];
+        // A pen move attached to it stays staged, as a pen move on its own
+        // (the same as for a move in the FIFO, below)
+        if (StagedCommand.ServoRPn)
+        {
+            StagedCommand.Command = COMMAND_SERVO_MOVE;
+            StagedCommand.Steps[0] = 0;
+            StagedCommand.Steps[1] = 0;
+            StagedCommand.Accel[0] = 0;
+            StagedCommand.Accel[1] = 0;
+            StagedCommand.DelayCounter -= StagedCommand.ServoDelay;
+        }
+        else
+        {
+            gCommandStaged = FALSE;
+        }
     }
-    
-    // If the FIFO has a move command in it, remove it.
-    if (CommandFIFO[0].Command == COMMAND_MOTOR_MOVE)
+
+    // The ISR must not pull anything out of the FIFO while we walk through it
+    INTCONbits.GIEH = 0;	// Turn high priority interrupts off
+
+    // If the current command is a move command, remember that for later.
+    if (
+      (CurrentCommand.Command == COMMAND_MOTOR_MOVE)
+      ||
+      (CurrentCommand.Command == COMMAND_STEP_RUN)
+      ||
+      (CurrentCommand.Command == COMMAND_AXIS_MOVE)
+    )
+    {
+        command_interrupted = 1;
+    }
+
+    // Any move commands waiting in the FIFO get turned into empty commands
+    // (which the ISR skips right over). Other queued commands (like servo
+    // moves) are left alone, as before.
+    for (j = gFIFOOut; j != gFIFOIn; j = (j + 1) & COMMAND_FIFO_MASK)
     {
-        CommandFIFO[0].Command = COMMAND_NONE;
-        fifo_steps1 = CommandFIFO[0].Steps[0];
-        fifo_steps2 = CommandFIFO[0].Steps[1];
-        CommandFIFO[0].Steps[0] = 0;
-        CommandFIFO[0].Steps[1] = 0;
-        CommandFIFO[0].Accel[0] = 0;
-        CommandFIFO[0].Accel[1] = 0;
-        FIFOEmpty = TRUE;
+        if (
+          (CommandFIFO[j].Command == COMMAND_MOTOR_MOVE)
+          ||
+          (CommandFIFO[j].Command == COMMAND_STEP_RUN)
+          ||
+          (CommandFIFO[j].Command == COMMAND_AXIS_MOVE)
+        )
+        {
+            command_interrupted = 1;
+            CommandFIFO[j].Command = COMMAND_NONE;
+            fifo_steps1 += CommandFIFO[j].Steps[0];
+            fifo_steps2 += CommandFIFO[j].Steps[1];
+            CommandFIFO[j].Steps[0] = 0;
+            CommandFIFO[j].Steps[1] = 0;
+            CommandFIFO[j].Accel[0] = 0;
+            CommandFIFO[j].Accel[1] = 0;
+            // A pen move attached to the move still happens, the same as
+            // one queued on its own, with just its SP duration left to wait
+            if (CommandFIFO[j].ServoRPn)
+            {
+                CommandFIFO[j].Command = COMMAND_SERVO_MOVE;
+                CommandFIFO[j].DelayCounter -= CommandFIFO[j].ServoDelay;
+            }
+            else
+            {
+                CommandFIFO[j].DelayCounter = 0;
+            }
+        }
     }
 
     // If the current command is a move command, then stop the move.
-    if (CurrentCommand.Command == COMMAND_MOTOR_MOVE)
+    if (
+      (CurrentCommand.Command == COMMAND_MOTOR_MOVE)
+      ||
+      (CurrentCommand.Command == COMMAND_STEP_RUN)
+      ||
+      (CurrentCommand.Command == COMMAND_AXIS_MOVE)
+    )
     {
     	CurrentCommand.Command = COMMAND_NONE;
         remaining_steps1 = CurrentCommand.Steps[0];
@@ -2127,8 +4161,47 @@ void parse_ES_packet(void)
         CurrentCommand.Steps[1] = 0;
         CurrentCommand.Accel[0] = 0;
         CurrentCommand.Accel[1] = 0;
+        // Same for a pen move attached to this move that hasn't started yet
+        if (CurrentCommand.ServoRPn)
+        {
+            CurrentCommand.Command = COMMAND_SERVO_MOVE;
+            if (CurrentCommand.DelayCounter > CurrentCommand.ServoDelay)
+            {
+                CurrentCommand.DelayCounter -= CurrentCommand.ServoDelay;
+            }
+            else
+            {
+                CurrentCommand.DelayCounter = 0;
+            }
+        }
+    }
+
+    // And the same for LA moves, both running and waiting in the axis queues
+    // (steps on axes past the second aren't part of the reply)
+    if (AxisBusy)
+    {
+        command_interrupted = 1;
+        remaining_steps1 += AxisMove[0].Steps;
+        remaining_steps2 += AxisMove[1].Steps;
+        for (j = AxisQueueOut[0]; j != AxisQueueIn[0]; j = (j + 1) & AXIS_QUEUE_MASK)
+        {
+            fifo_steps1 += AxisQueue[0][j].Steps;
+        }
+        for (j = AxisQueueOut[1]; j != AxisQueueIn[1]; j = (j + 1) & AXIS_QUEUE_MASK)
+        {
+            fifo_steps2 += AxisQueue[1][j].Steps;
+        }
+        for (j = 0; j < NUMBER_OF_STEPPERS; j++)
+        {
+            AxisMove[j].Steps = 0;
+            AxisQueueOut[j] = AxisQueueIn[j];
+        }
+        AxisBusy = FALSE;
     }
 
+    // Re-enable interrupts
+    INTCONbits.GIEH = 1;	// Turn high priority interrupts on
+
 #if defined(DEBUG_VALUE_PRINT)
     printf((far rom char *)"%d,%lu,%lu,%lu,%lu\n\r", 
             command_interrupted,
@@ -2183,13 +4256,16 @@ void parse_TP_packet(void)
 }
 
 // Set Pen
-// Usage: SP,<State>,<Duration>,<PortB_Pin><CR>
+// Usage: SP,<State>,<Duration>,<PortB_Pin>,<Lead><CR>
 // <State> is 0 (for goto servo_max) or 1 (for goto servo_min)
 // <Duration> is how long to wait before the next command in the motion control 
 //      FIFO should start. (defaults to 0mS)
 //      Note that the units of this parameter is either 1ms
 // <PortB_Pin> Is a value from 0 to 7 and allows you to re-assign the Pen
 //      RC Servo output to different PortB pins.
+// <Lead> (optional, in ISR ticks) attaches the pen move to the motor move
+//      sent before it, to start <Lead> ticks before that move ends (see
+//      attach_pen_move())
 // This is a command that the user can send from the PC to set the pen state.
 // Note that there is only one pen RC servo output - if you use the <PortB_Pin>
 // parameter, then that new pin becomes the pen RC servo output. This command
@@ -2208,12 +4284,15 @@ void parse_SP_packet(void)
 	UINT8 State = 0;
 	UINT16 CommandDuration = 0;
 	UINT8 Pin = DEFAULT_EBB_SERVO_PORTB_PIN;
+	UINT32 Lead = 0;
     ExtractReturnType Ret;
+    ExtractReturnType LeadRet;
 
 	// Extract each of the values.
 	extract_number (kUCHAR, &State, kREQUIRED);
 	extract_number (kUINT, &CommandDuration, kOPTIONAL);
 	Ret = extract_number (kUCHAR, &Pin, kOPTIONAL);
+	LeadRet = extract_number (kULONG, &Lead, kOPTIONAL);
 
 	// Bail if we got a conversion error
 	if (error_byte)
@@ -2221,6 +4300,12 @@ void parse_SP_packet(void)
 		return;
 	}
 
+	if (kEXTRACT_OK == LeadRet)
+	{
+		PenAttach = TRUE;
+		PenAttachLead = Lead;
+	}
+
     // Error check
 	if (Pin > 7)
 	{
@@ -2238,13 +4323,14 @@ void parse_SP_packet(void)
     {
         // if we are changing which pin the pen servo is on, we need to cancel
         // the servo output on the old channel first
-        RCServo2_Move(0, g_servo2_RPn, 0, 0);
+        RCServo2_Move(0, g_servo2_RPn, 0, 0, RC2_PROFILE_LINEAR);
         // Now record the new RPn
         g_servo2_RPn = Pin + 3;
     }
 
     // Execute the servo state change
 	process_SP(State, CommandDuration);
+	PenAttach = FALSE;
     
 	print_ack();
 }
@@ -2255,30 +4341,189 @@ void parse_SP_packet(void)
 // <CommandDuration> is the number of milliseconds to wait before executing the
 //      next command in the motion control FIFO
 //
-// This function uses the g_servo2_min, max, rate_up, rate_down variables
-// to schedule an RC Servo change with the RCServo2_Move() function.
+// This function uses the g_servo2_min, max, rate_up, rate_down, profile_up
+// and profile_down variables to schedule an RC Servo change with the
+// RCServo2_Move() function.
 //
 void process_SP(PenStateType NewState, UINT16 CommandDuration)
 {
   UINT16 Position;
   UINT16 Rate;
+  UINT8 Profile;
 
   if (NewState == PEN_UP)
   {
     Position = g_servo2_min;
     Rate = g_servo2_rate_up;
+    Profile = g_servo2_profile_up;
   }
   else
   {
     Position = g_servo2_max;
     Rate = g_servo2_rate_down;
+    Profile = g_servo2_profile_down;
   }
 
+#if !defined(STEPPER3_ON_SERVO_PIN)
   RCServoPowerIO = RCSERVO_POWER_ON;
   gRCServoPoweroffCounterMS = gRCServoPoweroffCounterReloadMS;
+#endif
 
   // Now schedule the movement with the RCServo2 function
-  RCServo2_Move(Position, g_servo2_RPn, Rate, CommandDuration);
+  RCServo2_Move(Position, g_servo2_RPn, Rate, CommandDuration, Profile);
+}
+
+// Called by RCServo2_Move() with the servo command it is about to queue.
+// If SP was given a <Lead> (PenAttach), and the command before it is a motor
+// move that hasn't started yet, the pen move is attached to that motor move
+// instead: the ISR starts it <Lead> ticks before the move's last step, and
+// the command after the move waits for the pen move's <Duration> as usual.
+// Returns TRUE if the pen move was attached, in which case it must not be
+// queued as well. Otherwise (nothing to attach to, the move has already
+// started, or the move's DelayCounter would go past the ISR's limit of
+// 0x10000 ms), the pen move is queued on its own and happens after the move.
+BOOL attach_pen_move(MoveCommandType * Command)
+{
+  MoveCommandType * Move;
+  UINT32 Ticks;
+  BOOL Attached = FALSE;
+
+  if (!PenAttach || Command->ServoRPn != g_servo2_RPn)
+  {
+    return FALSE;
+  }
+  PenAttach = FALSE;
+
+  // RCServo2_Move() has already flushed the planner, so the last command sent
+  // is in the staging slot if there's anything there, or else at the end of
+  // the FIFO
+  if (gCommandStaged)
+  {
+    Move = &StagedCommand;
+  }
+  else if (!FIFO_EMPTY())
+  {
+    Move = &CommandFIFO[(gFIFOIn - 1) & COMMAND_FIFO_MASK];
+  }
+  else
+  {
+    return FALSE;
+  }
+
+  if (
+    (
+      (Move->Command != COMMAND_MOTOR_MOVE)
+      &&
+      (Move->Command != COMMAND_MOTOR_MOVE_TIMED)
+      &&
+      (Move->Command != COMMAND_STEP_RUN)
+    )
+    ||
+    Move->ServoRPn
+  )
+  {
+    return FALSE;
+  }
+
+  // This takes a while, so it is done with interrupts on. If the ISR takes
+  // the move out of the FIFO in the meantime, the FIFO ends up empty (nothing
+  // else gets added to it here), and we find that out below.
+  Ticks = move_ticks_left(Move);
+  if (Ticks > PenAttachLead)
+  {
+    Ticks = Ticks - PenAttachLead;
+  }
+  else
+  {
+    Ticks = 0;
+  }
+
+  // The ISR throws away any DelayCounter over this (as a sanity check), which
+  // would skip the pen move's <Duration> entirely
+  if (Ticks > HIGH_ISR_TICKS_PER_MS * (UINT32)0x10000 - Command->DelayCounter)
+  {
+    return FALSE;
+  }
+
+  INTCONbits.GIEH = 0;	// Turn high priority interrupts off
+  if (Move == &StagedCommand || !FIFO_EMPTY())
+  {
+    Move->ServoPosition = Command->ServoPosition;
+    Move->ServoChannel = Command->ServoChannel;
+    Move->ServoRate = Command->ServoRate;
+    Move->ServoProfile = Command->ServoProfile;
+    Move->ServoDelay = Ticks;
+    Move->DelayCounter = Ticks + Command->DelayCounter;
+    // Setting ServoRPn last is what hands the pen move to the ISR
+    Move->ServoRPn = Command->ServoRPn;
+    Attached = TRUE;
+  }
+  INTCONbits.GIEH = 1;	// Turn high priority interrupts on
+
+  return Attached;
+}
+
+// How many ISR ticks a queued motor move takes, from when it starts until its
+// last step. For LM type moves (where the ISR adds Accel to Rate, then Rate
+// to the accumulator, once a tick) this solves
+//   Rate * t + Accel * t * (t + 1) / 2 = Steps * 2^31
+// for each axis in floating point, ignoring whatever is left in the
+// accumulator. That can be a tick or so off, which is fine for a pen move.
+static UINT32 move_ticks_left(MoveCommandType * Move)
+{
+  float Need;
+  float Half;
+  float Disc;
+  float AxisTicks;
+  UINT32 Ticks = 0;
+  UINT8 j;
+
+  if (Move->Command == COMMAND_MOTOR_MOVE_TIMED)
+  {
+    // Steps[0] counts the intervals
+    return Move->Steps[0];
+  }
+
+  for (j = 0; j < 2; j++)
+  {
+    if (Move->Steps[j] == 0)
+    {
+      continue;
+    }
+    if (Move->Command == COMMAND_STEP_RUN)
+    {
+      // The first countdown, then one more interval per step, each one Add
+      // (Accel) longer than the one before
+      AxisTicks = (float)Move->Rate[j].words.w1
+        + (float)(Move->Steps[j] - 1) * (float)Move->Rate[j].words.w2
+        + (float)(INT16)Move->Accel[j] * (float)(Move->Steps[j] - 1) * (float)Move->Steps[j] / 2.0;
+    }
+    else
+    {
+      Need = (float)Move->Steps[j] * 2147483648.0;
+      Half = (float)Move->Rate[j].value + (float)Move->Accel[j] / 2.0;
+      if (Move->Accel[j] == 0)
+      {
+        AxisTicks = (Half > 0) ? (Need / Half) : 0;
+      }
+      else
+      {
+        Disc = Half * Half + 2.0 * (float)Move->Accel[j] * Need;
+        // A move that slows down to a stop before it gets there never ends,
+        // so start the pen move right away
+        AxisTicks = (Disc >= 0) ? ((sqrt(Disc) - Half) / (float)Move->Accel[j]) : 0;
+      }
+    }
+    if (AxisTicks > 4294967295.0)
+    {
+      AxisTicks = 4294967295.0;
+    }
+    if (AxisTicks > Ticks)
+    {
+      Ticks = (UINT32)AxisTicks;
+    }
+  }
+  return Ticks;
 }
 
 // Enable Motor
@@ -2310,6 +4555,10 @@ void process_SP(PenStateType NewState, UINT16 CommandDuration)
 void parse_EM_packet(void)
 {
   unsigned char EA1, EA2;
+#if NUMBER_OF_STEPPERS >= 3
+  unsigned char EAx;
+  UINT8 Axis;
+#endif
   ExtractReturnType RetVal;
 
   // Extract each of the values.
@@ -2417,6 +4666,32 @@ void parse_EM_packet(void)
     }
   }
 
+#if NUMBER_OF_STEPPERS >= 3
+  // Extra axes each take one more (optional) parameter, 0 for off or any
+  // other value for on. They have external drivers, so no step modes.
+  for (Axis = 3; Axis <= NUMBER_OF_STEPPERS; Axis++)
+  {
+    RetVal = extract_number (kUCHAR, &EAx, kOPTIONAL);
+    if (kEXTRACT_OK != RetVal)
+    {
+      break;
+    }
+    // Bail if we got a conversion error
+    if (error_byte)
+    {
+      return;
+    }
+    if (EAx > 0)
+    {
+      enable_extra_axis(Axis, ENABLE_MOTOR);
+    }
+    else
+    {
+      enable_extra_axis(Axis, DISABLE_MOTOR);
+    }
+  }
+#endif
+
   // Always clear the step counts if motors are enabled/disabled or 
   // resolution is changed.
   clear_StepCounters();
@@ -2606,6 +4881,7 @@ void parse_SE_packet(void)
 	UINT16 Power = 0;
     UINT8 SEUseMotionQueue = FALSE;
     ExtractReturnType PowerExtract;
+    MoveCommandType move;
 	
 	// Extract each of the values.
 	extract_number (kUCHAR, &State, kREQUIRED);
@@ -2691,17 +4967,18 @@ void parse_SE_packet(void)
     }
     else
     {
-        // Trial: Spin here until there's space in the fifo
-    	while(!FIFOEmpty)
-        ;
-        
+        // Anything in the planner has to go first
+        planner_flush();
+
         // Set up the motion queue command
-        CommandFIFO[0].SEPower = StoredEngraverPower;
-    	CommandFIFO[0].DelayCounter = 0;
-        CommandFIFO[0].SEState = State;
-        CommandFIFO[0].Command = COMMAND_SE;
-        	
-        FIFOEmpty = FALSE;
+        move.SEPower = StoredEngraverPower;
+    	move.DelayCounter = 0;
+        move.SEState = State;
+        move.Command = COMMAND_SE;
+        move.Steps[0] = 0;
+        move.Steps[1] = 0;
+
+        queue_command(&move);
     }
     
 	print_ack();
@@ -2734,14 +5011,17 @@ UINT8 process_QM(void)
     if (CurrentCommand.Command != COMMAND_NONE) {
         CommandExecuting = 1;
     }
-    if (FIFOEmpty == FALSE) {
+    if (!FIFO_EMPTY() || PlannerCount || gCommandStaged) {
         CommandExecuting = 1;
         FIFOStatus = 1;
     }
-    if (CommandExecuting && CurrentCommand.Steps[0] != 0) {
+    if (AxisBusy) {
+        CommandExecuting = 1;
+    }
+    if (CommandExecuting && (CurrentCommand.Steps[0] != 0 || AxisMove[0].Steps != 0)) {
         Motor1Running = 1;
     }
-    if (CommandExecuting && CurrentCommand.Steps[1] != 0) {
+    if (CommandExecuting && (CurrentCommand.Steps[1] != 0 || AxisMove[1].Steps != 0)) {
         Motor2Running = 1;
     }
 
@@ -2792,6 +5072,255 @@ void parse_QM_packet(void)
 	printf((far ROM char *)"QM,%i,%i,%i,%i\n\r", CommandExecuting, Motor1Running, Motor2Running, FIFOStatus);
 }
 
+// QF command
+// For Query FIFO - returns how full the motion command FIFO is
+// QF takes no parameters, so usage is just QF<CR>
+// QF returns:
+// QF,<FIFODepth>,<FIFOSize><CR>
+// where:
+//   <FIFODepth>: number of motion commands waiting in the FIFO (not counting
+//                the one currently executing)
+//   <FIFOSize>: maximum number of motion commands the FIFO can hold
+// A PC can use these two values to keep the FIFO topped up without ever
+// blocking on a full FIFO.
+void parse_QF_packet(void)
+{
+	printf((far ROM char *)"QF,%i,%i\n\r", FIFO_DEPTH(), COMMAND_FIFO_LENGTH - 1);
+}
+
+// Zero out all of the ISR timing statistics
+static void clear_ISRTiming(void)
+{
+    UINT8 Type;
+    UINT8 Bin;
+    BOOL WasEnabled = ISRTimingEnable;
+
+    // Stop the ISR from updating anything while we clear it all out
+    ISRTimingEnable = FALSE;
+
+    for (Type = 0; Type < ISR_TIMING_TYPES; Type++)
+    {
+        ISRDurationMin[Type] = 0xFFFF;
+        ISRDurationMax[Type] = 0;
+        ISRLatencyMin[Type] = 0xFFFF;
+        ISRLatencyMax[Type] = 0;
+        for (Bin = 0; Bin < ISR_TIMING_BINS; Bin++)
+        {
+            ISRDurationHist[Type][Bin] = 0;
+            ISRLatencyHist[Type][Bin] = 0;
+        }
+    }
+    for (Type = 0; Type < PARSE_TIMING_TYPES; Type++)
+    {
+        ParseTimingCount[Type] = 0;
+        ParseTimingMin[Type] = 0xFFFFFFFF;
+        ParseTimingMax[Type] = 0;
+    }
+
+    ISRTimingEnable = WasEnabled;
+}
+
+// QI command
+// For Query ISR timing - reports how much of each 25KHz tick the stepper ISR
+// takes up, so we know how much headroom there is.
+// Usage: QI[,<Mode>]<CR>
+//   With no <Mode>, report the statistics collected so far (see below)
+//   <Mode> = 0 : stop collecting statistics (this is the default at boot)
+//   <Mode> = 1 : clear out the statistics and start collecting them
+// QI with no <Mode> returns one line for each type of command:
+// QI,<Type>,<Count>,<DurMin>,<DurMax>,<LatMin>,<LatMax>,<DurHist0>,...,<DurHist7>,<LatHist0>,...,<LatHist7><CR>
+// followed by OK<CR>
+// where:
+//   <Type>: the command executing when the ISR fired. 0 = none (idle),
+//           1 = motor move (SM, XM, HM, LM), 2 = delay, 3 = servo move,
+//           4 = SE, 5 = timed motor move (LT), 6 = step run (LS),
+//           7 = independent axis moves (LA, while any is running or queued)
+//   <Count>: number of ISR ticks measured for that type
+//   <DurMin>,<DurMax>: shortest and longest time from TIMER1 rolling over to
+//           the end of the ISR, in instruction cycles (83.3ns). There are
+//           480 cycles in each tick.
+//   <LatMin>,<LatMax>: shortest and longest time from TIMER1 rolling over to
+//           the start of the ISR, in cycles. Entry jitter is LatMax - LatMin.
+//   <DurHist0> - <DurHist7>: number of ticks that took 0-63 cycles, 64-127
+//           cycles, and so on. The last one counts everything 448 and up.
+//   <LatHist0> - <LatHist7>: number of ticks with a latency of 0-7 cycles,
+//           8-15 cycles, and so on. The last one counts everything 56 and up.
+// After those come three lines with how long SM, XM and HM commands took to
+// parse (see parse_timing_start()):
+// QI,<Cmd>,<Count>,<Min>,<Max><CR>
+// where:
+//   <Cmd>: SM, XM or HM
+//   <Count>: number of those commands timed
+//   <Min>,<Max>: shortest and longest time, in instruction cycles (83.3ns)
+// Note that while collecting statistics the ISR runs a little longer (the
+// bookkeeping happens after the exit time is taken), and TIMER1 gets reloaded
+// a few cycles later, which stretches each tick slightly.
+void parse_QI_packet(void)
+{
+    UINT8 Mode;
+    UINT8 Type;
+    UINT8 Bin;
+    UINT32 Count;
+    BOOL WasEnabled;
+    ExtractReturnType GotMode;
+
+    GotMode = extract_number(kUCHAR, &Mode, kOPTIONAL);
+
+    // Bail if we got a conversion error
+    if (error_byte)
+    {
+        return;
+    }
+
+    if (GotMode == kEXTRACT_OK)
+    {
+        if (Mode > 1)
+        {
+            printf((far rom char *)"!0 Err: <Mode> larger than 1.\n\r");
+            return;
+        }
+        ISRTimingEnable = FALSE;
+        if (Mode == 1)
+        {
+            clear_ISRTiming();
+            ISRTimingEnable = TRUE;
+        }
+        print_ack();
+        return;
+    }
+
+    // Hold off the ISR's updates while we print, so each line is consistent
+    WasEnabled = ISRTimingEnable;
+    ISRTimingEnable = FALSE;
+
+    for (Type = 0; Type < ISR_TIMING_TYPES; Type++)
+    {
+        Count = 0;
+        for (Bin = 0; Bin < ISR_TIMING_BINS; Bin++)
+        {
+            Count += ISRDurationHist[Type][Bin];
+        }
+        printf(
+            (far ROM char *)"QI,%i,%lu,%u,%u,%u,%u",
+            Type,
+            Count,
+            Count ? ISRDurationMin[Type] : 0,
+            ISRDurationMax[Type],
+            Count ? ISRLatencyMin[Type] : 0,
+            ISRLatencyMax[Type]
+        );
+        for (Bin = 0; Bin < ISR_TIMING_BINS; Bin++)
+        {
+            printf((far ROM char *)",%lu", ISRDurationHist[Type][Bin]);
+        }
+        for (Bin = 0; Bin < ISR_TIMING_BINS; Bin++)
+        {
+            printf((far ROM char *)",%lu", ISRLatencyHist[Type][Bin]);
+        }
+        printf((far ROM char *)"\n\r");
+    }
+
+    for (Type = 0; Type < PARSE_TIMING_TYPES; Type++)
+    {
+        printf(
+            (far ROM char *)"QI,%cM,%u,%lu,%lu\n\r",
+            ParseTimingLetter[Type],
+            ParseTimingCount[Type],
+            ParseTimingCount[Type] ? ParseTimingMin[Type] : 0,
+            ParseTimingMax[Type]
+        );
+    }
+
+    ISRTimingEnable = WasEnabled;
+    print_ack();
+}
+
+// Command parse timing
+// While QI is collecting statistics, run_command() (in UBW.c) times how long
+// each SM, XM and HM command takes, from the whole command line being there
+// to the end of its parser (ack included). The clock is made up of the ISR's
+// tick count and how far TMR1 is into the current tick, so time spent in
+// the ISRs during the parse is counted as well. Each tick is taken to be 480
+// cycles, so the times are good to within the tick to tick entry jitter (see
+// <LatMin> and <LatMax>) times the number of ticks.
+
+// The parse timing clock, in instruction cycles
+static UINT32 parse_timing_now(void)
+{
+  UINT32 Ticks;
+  UINT16 Phase;
+
+  INTCONbits.GIEH = 0;	// Turn high priority interrupts off
+  Phase = TMR1L;
+  Phase |= ((UINT16)TMR1H << 8);
+  Ticks = ISRTickCount;
+  if (PIR1bits.TMR1IF)
+  {
+    // TMR1 has rolled over and is counting up from zero, but the ISR hasn't
+    // counted the new tick yet
+    Ticks++;
+  }
+  else
+  {
+    // The ISR reloaded TMR1 ISRTimingEntry cycles into this tick
+    Phase = ISRTimingEntry + (Phase - TIMER1_RELOAD);
+  }
+  INTCONbits.GIEH = 1;	// Turn high priority interrupts on
+
+  return (Ticks * HIGH_ISR_CYCLES_PER_TICK) + Phase;
+}
+
+// Called with the first two letters of each command, just before it's parsed
+void parse_timing_start(UINT8 cmd1, UINT8 cmd2)
+{
+  ParseTimingType = PARSE_TIMING_TYPES;
+  if (!ISRTimingEnable || cmd2 != 'M')
+  {
+    return;
+  }
+  for (ParseTimingType = 0; ParseTimingType < PARSE_TIMING_TYPES; ParseTimingType++)
+  {
+    if (ParseTimingLetter[ParseTimingType] == cmd1)
+    {
+      ParseTimingStart = parse_timing_now();
+      return;
+    }
+  }
+}
+
+// HM waits for motion to finish before it works anything out, so it starts
+// the clock over once it's done waiting
+void parse_timing_restart(void)
+{
+  if (ParseTimingType < PARSE_TIMING_TYPES)
+  {
+    ParseTimingStart = parse_timing_now();
+  }
+}
+
+// Called after each command is parsed
+void parse_timing_stop(void)
+{
+  UINT32 Cycles;
+
+  if (ParseTimingType >= PARSE_TIMING_TYPES || !ISRTimingEnable)
+  {
+    ParseTimingType = PARSE_TIMING_TYPES;
+    return;
+  }
+  Cycles = parse_timing_now() - ParseTimingStart;
+  ParseTimingCount[ParseTimingType]++;
+  if (Cycles < ParseTimingMin[ParseTimingType])
+  {
+    ParseTimingMin[ParseTimingType] = Cycles;
+  }
+  if (Cycles > ParseTimingMax[ParseTimingType])
+  {
+    ParseTimingMax[ParseTimingType] = Cycles;
+  }
+  ParseTimingType = PARSE_TIMING_TYPES;
+}
+
 // QS command
 // For Query Step position - returns the current x and y global step positions
 // QS takes no parameters, so usage is just CS<CR>
@@ -2800,37 +5329,48 @@ void parse_QM_packet(void)
 // where:
 //   <global_step1_position>: signed 32 bit value, current global motor 1 step position
 //   <global_step2_position>: signed 32 bit value, current global motor 2 step position
+// When built for more than two axes, the positions of the extra axes follow
+// on the same line.
 void parse_QS_packet(void)
 {
-    INT32 step1, step2;
+    INT32 step[NUMBER_OF_STEPPERS];
+    UINT8 j;
 
     // Need to turn off high priority interrupts breifly here to read out value that ISR uses
     INTCONbits.GIEH = 0;	// Turn high priority interrupts off
 
     // Make a local copy of the things we care about
-    step1 = globalStepCounter1;
-    step2 = globalStepCounter2;
+    for (j = 0; j < NUMBER_OF_STEPPERS; j++)
+    {
+        step[j] = globalStepCounter[j];
+    }
     
     // Re-enable interrupts
     INTCONbits.GIEH = 1;	// Turn high priority interrupts on
 
-	printf((far ROM char *)"%li,%li\n\r", step1, step2);
+	printf((far ROM char *)"%li,%li", step[0], step[1]);
+    for (j = 2; j < NUMBER_OF_STEPPERS; j++)
+    {
+        printf((far ROM char *)",%li", step[j]);
+    }
+	printf((far ROM char *)"\n\r");
 	print_ack();
 }
 
 // Perform the actual clearing of the step counters (used from several places)
 void clear_StepCounters(void)
 {
+    UINT8 j;
+
     // Need to turn off high priority interrupts breifly here to read out value that ISR uses
     INTCONbits.GIEH = 0;	// Turn high priority interrupts off
 
-    // Clear out the global step counters
-    globalStepCounter1 = 0;
-    globalStepCounter2 = 0;
-    
-    // Clear both step accumulators as well
-    acc_union[0].value = 0;
-    acc_union[1].value = 0;
+    // Clear out the global step counters, and the step accumulators as well
+    for (j = 0; j < NUMBER_OF_STEPPERS; j++)
+    {
+        globalStepCounter[j] = 0;
+        acc_union[j].value = 0;
+    }
     
     // Re-enable interrupts
     INTCONbits.GIEH = 1;	// Turn high priority interrupts on
@@ -61,8 +61,18 @@
 #define ENABLE_MOTOR        0
 #define DISABLE_MOTOR       1
 
-// How many stepper motors does this board support? (EBB is always 2)
+// How many stepper motors does the motion engine drive? The EBB itself has
+// two, but modified rigs can add a third on spare pins by building with
+// NUMBER_OF_STEPPERS defined as 3 (-DNUMBER_OF_STEPPERS=3). The pins for the
+// extra axis come from the HardwareProfile file. The two axis
+// commands (SM, LM, LT, LS, HM, XM) only ever move axes 1 and 2; every axis
+// can be moved with LA.
+#if !defined(NUMBER_OF_STEPPERS)
 #define NUMBER_OF_STEPPERS  2
+#endif
+#if (NUMBER_OF_STEPPERS < 2) || (NUMBER_OF_STEPPERS > 3)
+#error "NUMBER_OF_STEPPERS must be 2 or 3"
+#endif
 
 typedef enum
 {
@@ -78,7 +88,9 @@ typedef enum
 	COMMAND_DELAY,
 	COMMAND_SERVO_MOVE,
   COMMAND_SE,
-  COMMAND_MOTOR_MOVE_TIMED
+  COMMAND_MOTOR_MOVE_TIMED,
+  COMMAND_STEP_RUN,
+  COMMAND_AXIS_MOVE
 } CommandType;
 
 // Byte union used for accumulator (unsigned))
@@ -93,13 +105,19 @@ typedef union union32b4 {
 } u32b4_t;
 
 // Byte union used for rate (signed)
-typedef union union32b4 {
-  struct byte_map {
+// LS step runs use the two words instead: w1 counts down the ISR ticks to the
+// next step, and w2 holds the current step interval.
+typedef union unionS32b4 {
+  struct sbyte_map {
       UINT8 b1; // Low byte
       UINT8 b2;
       UINT8 b3;
       UINT8 b4; // High byte
   } bytes;
+  struct sword_map {
+      UINT16 w1; // Low word
+      UINT16 w2; // High word
+  } words;
   INT32 value;
 } uS32b4_t;
 
@@ -117,18 +135,32 @@ typedef struct
   UINT8           ServoRPn;
   UINT8           ServoChannel;
   UINT16          ServoRate;
+  UINT8           ServoProfile;   // RC2_PROFILE_LINEAR etc.
+  UINT32          ServoDelay;     // Motor moves with a pen move attached (see
+                                  // attach_pen_move()): ISR ticks until it starts
   UINT8           SEState;
   UINT16          SEPower;
   UINT8           Active[NUMBER_OF_STEPPERS];
 } MoveCommandType;
 
+// One LA move for a single axis, as kept in that axis' own queue
+typedef struct
+{
+  uS32b4_t        Rate;
+  INT32           Accel;
+  UINT32          Steps;
+  UINT8           DirBits;        // This axis' DIR bit (DIR1_BIT etc.) or 0
+  UINT8           ClearAcc;       // Non-zero to clear this axis' accumulator first
+} AxisMoveType;
+
 // Define global things that depend on the board type
+// STEP and DIR bits for each axis in DirBits (and the ISR's OutByte)
 #define STEP1_BIT	(0x01)
 #define DIR1_BIT	(0x02)
 #define STEP2_BIT	(0x04)
 #define DIR2_BIT	(0x08)
-
-#define NUMBER_OF_STEPPERS  2
+#define STEP3_BIT	(0x10)
+#define DIR3_BIT	(0x20)
 
 // Reload value for TIMER1
 // We need a 25KHz ISR to fire, so we take Fosc (48Mhz), divide by 4
@@ -149,13 +181,99 @@ typedef struct
 
 #define HIGH_ISR_TICKS_PER_MS (25)  // Note: computed by hand, could be formula
 
+// How long the button has to be up before a press counts as a new one (50ms)
+#define BUTTON_RELEASE_TICKS  (HIGH_ISR_TICKS_PER_MS * 50)
+
+// TIMER1 reload as a single 16 bit value, and how many instruction cycles
+// (Fosc/4, 12MHz) there are between 25KHz ISR fires
+#define TIMER1_RELOAD ((((UINT16)TIMER1_H_RELOAD) << 8) | TIMER1_L_RELOAD)
+#define HIGH_ISR_CYCLES_PER_TICK (480)
+
+// ISR timing statistics (see QI command). One set is kept for each
+// CommandType, chosen by the command executing when the ISR fires.
+// Duration histogram bins are 64 cycles wide, latency bins are 8 cycles wide.
+// The last bin of each histogram also counts everything above it.
+#define ISR_TIMING_TYPES            (COMMAND_AXIS_MOVE + 1)
+#define ISR_TIMING_BINS             8
+#define ISR_TIMING_DURATION_SHIFT   6
+#define ISR_TIMING_LATENCY_SHIFT    3
+// Commands whose parse times QI also reports: SM, XM and HM
+#define PARSE_TIMING_TYPES          3
+
+// Number of elements in the motion command FIFO. Must be a power of two.
+// One element is always left unused so that 'full' and 'empty' can be told
+// apart using only the two indexes, so the FIFO holds at most
+// COMMAND_FIFO_LENGTH - 1 commands. The FIFO lives in its own section
+// (CMD_FIFO, see the linker script) because it spans more than one RAM bank.
+#define COMMAND_FIFO_LENGTH     16
+#define COMMAND_FIFO_MASK       (COMMAND_FIFO_LENGTH - 1)
+
+// The FIFO is a single producer (main loop) single consumer (high_ISR) ring.
+// gFIFOIn is only ever written by the main loop and gFIFOOut is only ever
+// written by the ISR. Since both are single bytes, they can be read at any
+// time without turning interrupts off.
+#define FIFO_EMPTY()            (gFIFOIn == gFIFOOut)
+#define FIFO_DEPTH()            ((UINT8)(gFIFOIn - gFIFOOut) & COMMAND_FIFO_MASK)
+#define FIFO_FULL()             (FIFO_DEPTH() == COMMAND_FIFO_MASK)
+
+// Spin until there is room in the FIFO for another command. The simulator
+// (EBB_firmware/sim) has to run the ISR itself while it waits.
+#if defined(EBB_SIM)
+void sim_wait_for_fifo_space(void);
+#define WAIT_FOR_FIFO_SPACE()   sim_wait_for_fifo_space()
+#else
+#define WAIT_FOR_FIFO_SPACE()   while(FIFO_FULL())
+#endif
+
+// Independent per-axis move queues (see LA command). Must be a power of two.
+// As with the FIFO, one element is always left unused, so each axis can have
+// up to AXIS_QUEUE_LENGTH - 1 LA moves waiting behind the one it's running.
+// All of the queues have to fit in one RAM bank together.
+#if NUMBER_OF_STEPPERS > 2
+#define AXIS_QUEUE_LENGTH       4
+#else
+#define AXIS_QUEUE_LENGTH       8
+#endif
+#define AXIS_QUEUE_MASK         (AXIS_QUEUE_LENGTH - 1)
+
+// Lookahead planner (see PL command). Must be a power of two. Each planned
+// move becomes up to three commands (accelerate, cruise, decelerate) in the
+// FIFO when the planner hands it over.
+#define PLANNER_LENGTH          8
+#define PLANNER_MASK            (PLANNER_LENGTH - 1)
+// The planner hands moves over to the FIFO as late as it can, as long as
+// there are at least this many commands left in the FIFO
+#define PLANNER_FIFO_LOW_WATER  6
+// Planner defaults, in steps/s/s, 1/100ths of a step and steps/s
+#define PLANNER_DEFAULT_ACCEL               10000
+#define PLANNER_DEFAULT_JUNCTION_DEVIATION  100
+#define PLANNER_DEFAULT_MIN_RATE            200
+// Fastest path speed (steps/s) the planner deals with: both axes at 25KHz
+#define PLANNER_MAX_RATE        35355
+// Unit vectors are stored with 1.0 as this value
+#define PLANNER_UNIT            16384
+
+// Binary frame types and their payload lengths (see process_binary_frame())
+#define BINARY_FRAME_LM             1
+#define BINARY_FRAME_LM_LENGTH      25
+#define BINARY_FRAME_LT             2
+#define BINARY_FRAME_LT_LENGTH      21
+#define BINARY_FRAME_BLOCK          3
+#define BINARY_FRAME_LS             4
+#define BINARY_FRAME_LS_LENGTH      16
+// As many LM moves as will fit in the longest possible frame
+#define BINARY_FRAME_BLOCK_MAX_COUNT    10
 
 extern MoveCommandType CommandFIFO[];
+extern volatile UINT8 gFIFOIn;
+extern volatile UINT8 gFIFOOut;
+extern BOOL gCommandStaged;
 extern unsigned int DemoModeActive;
-extern BOOL FIFOEmpty;
 extern unsigned int comd_counter;
 extern unsigned char QC_ms_timer;
 extern BOOL gLimitChecks;
+extern BOOL gEventsEnable;
+extern UINT8 gEventLowWater;
 
 // Default to on, comes out on pin RB4 for EBB v1.3 and above
 extern BOOL gUseSolenoid;
@@ -183,7 +301,24 @@ void parse_QS_packet(void);
 void parse_CS_packet(void);
 void parse_LM_packet(void);
 void parse_LT_packet(void);
+void parse_LS_packet(void);
+void parse_LA_packet(void);
+void parse_LB_packet(void);
 void parse_HM_packet(void);
+void parse_QF_packet(void);
+void parse_QI_packet(void);
+void parse_PL_packet(void);
+void planner_flush(void);
+void planner_service(void);
+void queue_command(MoveCommandType * Command);
+void staging_service(void);
+BOOL command_intake_ready(UINT8 cmd1, UINT8 cmd2, UINT8 Entries);
+void parse_timing_start(UINT8 cmd1, UINT8 cmd2);
+void parse_timing_restart(void);
+void parse_timing_stop(void);
+void events_service(void);
+BOOL process_binary_frame(UINT8 Type, UINT8 * Payload, UINT8 Length);
 void EBB_Init(void);
 void process_SP(PenStateType NewState, UINT16 CommandDuration);
+BOOL attach_pen_move(MoveCommandType * Command);
 #endif
\ No newline at end of file
@@ -0,0 +1,710 @@
+/*********************************************************************
+ *
+ *                EiBotBoard Firmware - host simulator
+ *
+ *********************************************************************
+ * FileName:        ebbsim.c
+ *
+ * Runs the real motion engine from ebb.c (parsers, FIFO and high_ISR) on
+ * a PC, one 25KHz ISR tick at a time, and writes out a trace of every
+ * step taken. See readme.txt in this directory for how to use it.
+ *
+ * ebb.c is #included (rather than linked) so that we can see its static
+ * state, like CurrentCommand and the global step counters.
+ *
+ * With -p, it acts as a virtual EBB on a pseudo terminal instead, so that
+ * host software (eggbot.py, plotink) can drive it like a real board.
+ */
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#define SIM_HAS_PTY
+#endif
+
+#include "ebb.c"
+
+#include "sim.h"
+
+// Give up on a script after this many ISR ticks (10 minutes) by default
+#define SIM_DEFAULT_MAX_TICKS   (25000UL * 60UL * 10UL)
+
+// In pty mode, each command takes one USB frame (1ms) of simulated time
+#define SIM_DEFAULT_LATENCY_TICKS   25UL
+
+// What V answers with; keep in step with st_version in UBW.c
+#define SIM_VERSION_STRING  "EBBv13_and_above EB Firmware Version 2.8.0\r\n"
+
+typedef struct
+{
+  char Name[3];
+  void (*Parse)(void);
+} SimCommandType;
+
+static void sim_parse_V(void)
+{
+  printf(SIM_VERSION_STRING);
+}
+
+// The commands from ebb.c that the simulator knows how to run
+static const SimCommandType SimCommands[] =
+{
+  {"SM", parse_SM_packet},
+  {"XM", parse_XM_packet},
+  {"LM", parse_LM_packet},
+  {"LT", parse_LT_packet},
+  {"LS", parse_LS_packet},
+  {"LA", parse_LA_packet},
+  {"LB", parse_LB_packet},
+  {"HM", parse_HM_packet},
+  {"ES", parse_ES_packet},
+  {"EM", parse_EM_packet},
+  {"CS", parse_CS_packet},
+  {"SC", parse_SC_packet},
+  {"SP", parse_SP_packet},
+  {"S2", RCServo2_S2_command},
+  {"TP", parse_TP_packet},
+  {"SE", parse_SE_packet},
+  {"QM", parse_QM_packet},
+  {"QS", parse_QS_packet},
+  {"QF", parse_QF_packet},
+  {"QI", parse_QI_packet},
+  {"PL", parse_PL_packet},
+  {"QP", parse_QP_packet},
+  {"QB", parse_QB_packet},
+  {"V", sim_parse_V},
+};
+
+static UINT32 SimTick;
+static UINT32 SimMaxTicks = SIM_DEFAULT_MAX_TICKS;
+static INT32 SimLastStep[NUMBER_OF_STEPPERS];
+static UINT32 SimStepCount;
+static FILE * SimTrace;
+static FILE * SimGolden;
+static UINT32 SimGoldenLine;
+static UINT32 SimMismatches;
+static BOOL SimPty;
+static BOOL SimRealTime;
+static UINT32 SimLatencyTicks = SIM_DEFAULT_LATENCY_TICKS;
+#if defined(SIM_HAS_PTY)
+static struct timespec SimStartTime;
+static volatile sig_atomic_t SimQuit;
+#endif
+
+// Compare one trace line against the next line of the golden trace
+static void sim_compare(const char * Line)
+{
+  char expected[128];
+
+  if (!SimGolden)
+  {
+    return;
+  }
+  SimGoldenLine++;
+  if (!fgets(expected, sizeof(expected), SimGolden))
+  {
+    expected[0] = 0;
+  }
+  if (strcmp(expected, Line) != 0)
+  {
+    if (SimMismatches == 0)
+    {
+      fprintf(stderr, "ebbsim: trace differs at line %lu\n  expected: %s  got:      %s",
+        (unsigned long)SimGoldenLine,
+        expected[0] ? expected : "(end of trace)\n",
+        Line
+      );
+    }
+    SimMismatches++;
+  }
+}
+
+static void sim_output(const char * Line)
+{
+  if (SimTrace)
+  {
+    fputs(Line, SimTrace);
+  }
+  sim_compare(Line);
+}
+
+#if defined(SIM_HAS_PTY)
+// How many ticks of wall clock time have gone by since we started
+static UINT32 sim_wall_ticks(void)
+{
+  struct timespec Now;
+
+  clock_gettime(CLOCK_MONOTONIC, &Now);
+  return (UINT32)(
+    (Now.tv_sec - SimStartTime.tv_sec) * 25000L
+    +
+    (Now.tv_nsec - SimStartTime.tv_nsec) / 40000L
+  );
+}
+#endif
+
+// The state of axis <Axis>'s DIR pin (the Alt one with external drivers)
+static UINT8 sim_dir_pin(UINT8 Axis)
+{
+  BOOL Alt = (DriverConfiguration == PIC_CONTROLS_EXTERNAL);
+
+  switch (Axis)
+  {
+    case 0:
+      return Alt ? Dir1AltIO : Dir1IO;
+    case 1:
+      return Alt ? Dir2AltIO : Dir2IO;
+#if NUMBER_OF_STEPPERS >= 3
+    case 2:
+      return Alt ? Dir3AltIO : Dir3IO;
+#endif
+  }
+  return 0;
+}
+
+// Run the ISR once, then note any steps it took
+static void sim_tick(void)
+{
+  BOOL Stepped = FALSE;
+  UINT8 Axis;
+  char Line[128];
+
+#if defined(SIM_HAS_PTY)
+  // In real time mode, don't let the ISR get ahead of the clock
+  if (SimRealTime)
+  {
+    fflush(stdout);
+    while (SimTick >= sim_wall_ticks() && !SimQuit)
+    {
+      usleep(500);
+    }
+  }
+#endif
+
+  // TMR1 has just rolled over. It does not count on its own here, so QI
+  // timing in the simulator always comes out as zero.
+  TMR1H = 0;
+  TMR1L = 0;
+  PIR1bits.TMR1IF = 1;
+  high_ISR();
+
+  for (Axis = 0; Axis < NUMBER_OF_STEPPERS; Axis++)
+  {
+    if (globalStepCounter[Axis] != SimLastStep[Axis])
+    {
+      Stepped = TRUE;
+    }
+  }
+  if (Stepped)
+  {
+    // Report the DIR pins the way the ISR left them
+    sprintf(Line, "%lu", (unsigned long)SimTick);
+    for (Axis = 0; Axis < NUMBER_OF_STEPPERS; Axis++)
+    {
+      sprintf(Line + strlen(Line), ",%d,%d",
+        (globalStepCounter[Axis] != SimLastStep[Axis]) ? 1 : 0,
+        sim_dir_pin(Axis)
+      );
+      if (globalStepCounter[Axis] != SimLastStep[Axis])
+      {
+        SimStepCount++;
+      }
+      SimLastStep[Axis] = globalStepCounter[Axis];
+    }
+    strcat(Line, "\n");
+    sim_output(Line);
+  }
+  SimTick++;
+}
+
+// Called by the firmware whenever it spins waiting for room in the FIFO.
+// The EBB's ISR would keep running on its own during the wait; here we have
+// to run it ourselves.
+void sim_wait_for_fifo_space(void)
+{
+  while (FIFO_FULL())
+  {
+    if (SimTick >= SimMaxTicks)
+    {
+      fprintf(stderr, "ebbsim: hit tick limit while waiting for FIFO space\n");
+      exit(1);
+    }
+    sim_tick();
+  }
+}
+
+// One pass through the EBB's main loop: move any staged command into the
+// FIFO, let the planner top up the FIFO, then one tick of time goes by
+static void sim_main_loop_tick(void)
+{
+  staging_service();
+  planner_service();
+  sim_tick();
+}
+
+static BOOL sim_idle(void)
+{
+  return (
+    !gCommandStaged
+    &&
+    PlannerCount == 0
+    &&
+    FIFO_EMPTY()
+    &&
+    CurrentCommand.Command == COMMAND_NONE
+    &&
+    CurrentCommand.DelayCounter == 0
+    &&
+    !AxisBusy
+  );
+}
+
+static void sim_run_until_idle(void)
+{
+  while (!sim_idle() && SimTick < SimMaxTicks)
+  {
+    sim_main_loop_tick();
+  }
+}
+
+// Tell the PC about a bad command, the way ProcessIO() in UBW.c does
+static void sim_print_errors(void)
+{
+  if (bittst(error_byte, kERROR_BYTE_MISSING_PARAMETER))
+  {
+    printf("!4 Err: Missing parameter(s)\r\n");
+  }
+  if (bittst(error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT))
+  {
+    printf("!6 Err: Invalid paramter value\r\n");
+  }
+  if (bittst(error_byte, kERROR_BYTE_EXTRA_CHARACTERS))
+  {
+    printf("!7 Err: Extra parmater\r\n");
+  }
+}
+
+// Run one line of a script. Returns FALSE if the line could not be run.
+static BOOL sim_command(char * Line, UINT32 LineNumber)
+{
+  char Name[3];
+  UINT8 i;
+  UINT32 Ticks;
+
+  if (Line[0] == '@')
+  {
+    // Simulator directives
+    if (strncmp(Line, "@wait,", 6) == 0)
+    {
+      Ticks = strtoul(&Line[6], NULL, 10);
+      while (Ticks-- && SimTick < SimMaxTicks)
+      {
+        sim_main_loop_tick();
+      }
+      return TRUE;
+    }
+    if (strcmp(Line, "@idle") == 0)
+    {
+      sim_run_until_idle();
+      return TRUE;
+    }
+    if (strcmp(Line, "@button") == 0)
+    {
+      // As if the PRG button had just been pressed (see QB and EV,B)
+      ButtonPushed = TRUE;
+      ButtonEvent = TRUE;
+      return TRUE;
+    }
+    fprintf(stderr, "ebbsim: line %lu: unknown directive '%s'\n", (unsigned long)LineNumber, Line);
+    return FALSE;
+  }
+
+  // One letter commands (like V) are followed by a comma or nothing
+  Name[0] = toupper(Line[0]);
+  Name[1] = (Line[0] && Line[1] != ',') ? toupper(Line[1]) : 0;
+  Name[2] = 0;
+  for (i = 0; i < sizeof(SimCommands) / sizeof(SimCommands[0]); i++)
+  {
+    if (strcmp(Name, SimCommands[i].Name) == 0)
+    {
+      break;
+    }
+  }
+  if (i == sizeof(SimCommands) / sizeof(SimCommands[0]))
+  {
+    if (SimPty)
+    {
+      printf("!8 Err: Unknown command '%s'\r\n", Name);
+      return TRUE;
+    }
+    fprintf(stderr, "ebbsim: line %lu: unknown command '%s'\n", (unsigned long)LineNumber, Line);
+    return FALSE;
+  }
+
+  // Like ProcessIO(), hold the command back while the motion queue can't
+  // take it (see command_intake_ready()). HM spins in a few other places
+  // too, so let everything finish before running it.
+  if (strcmp(Name, "HM") == 0)
+  {
+    sim_run_until_idle();
+  }
+  while (!command_intake_ready(Name[0], Name[1], 1) && SimTick < SimMaxTicks)
+  {
+    sim_main_loop_tick();
+  }
+
+  sim_load_parameters(&Line[Name[1] ? 2 : 1]);
+  SimCommands[i].Parse();
+  if (!error_byte && !sim_parameters_done())
+  {
+    bitset(error_byte, kERROR_BYTE_EXTRA_CHARACTERS);
+  }
+  if (error_byte && SimPty)
+  {
+    sim_print_errors();
+    error_byte = 0;
+  }
+  if (error_byte)
+  {
+    fprintf(stderr, "ebbsim: line %lu: '%s' failed (error_byte 0x%02X)\n",
+      (unsigned long)LineNumber, Line, error_byte);
+    error_byte = 0;
+  }
+  return TRUE;
+}
+
+#if defined(SIM_HAS_PTY)
+static void sim_signal(int Signal)
+{
+  SimQuit = 1;
+}
+
+// Open a pseudo terminal for the host software to talk to. Returns the
+// master side, with the firmware's output (stdout) going into it.
+static int sim_open_pty(const char * LinkName)
+{
+  int Master;
+  int Slave;
+  const char * SlaveName;
+  struct termios Settings;
+
+  Master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (Master < 0 || grantpt(Master) != 0 || unlockpt(Master) != 0)
+  {
+    perror("ebbsim: posix_openpt");
+    return -1;
+  }
+  SlaveName = ptsname(Master);
+
+  // Raw mode, so that CRs get through as they are and nothing is echoed.
+  // Keeping our own handle on the slave open means the host can close and
+  // reopen the port (between plots, say) without us seeing a hangup.
+  Slave = open(SlaveName, O_RDWR | O_NOCTTY);
+  if (Slave < 0 || tcgetattr(Slave, &Settings) != 0)
+  {
+    perror(SlaveName);
+    return -1;
+  }
+  cfmakeraw(&Settings);
+  tcsetattr(Slave, TCSANOW, &Settings);
+
+  if (LinkName)
+  {
+    unlink(LinkName);
+    if (symlink(SlaveName, LinkName) != 0)
+    {
+      perror(LinkName);
+      return -1;
+    }
+  }
+  fprintf(stderr, "ebbsim: virtual EBB on %s%s%s\n",
+    SlaveName, LinkName ? " linked from " : "", LinkName ? LinkName : "");
+
+  fflush(stdout);
+  dup2(Master, STDOUT_FILENO);
+  return Master;
+}
+
+// Act as an EBB on the pty until we get SIGINT or SIGTERM. Commands are
+// run as they come in. In simulated time, the clock only moves while a
+// command waits its turn (SimLatencyTicks per command, plus any wait for
+// room in the FIFO), so a run takes the same number of ticks each time no
+// matter how fast the PC is. In real time (-r), the ISR runs at 25KHz of
+// wall clock time, like it does on the EBB.
+static void sim_serve_pty(int Master)
+{
+  char Line[256];
+  char Buffer[256];
+  size_t Length = 0;
+  UINT32 LineNumber = 0;
+  UINT32 Ticks;
+  struct pollfd Poll;
+  ssize_t Count;
+  ssize_t b;
+
+  signal(SIGINT, sim_signal);
+  signal(SIGTERM, sim_signal);
+  clock_gettime(CLOCK_MONOTONIC, &SimStartTime);
+
+  while (!SimQuit && SimTick < SimMaxTicks)
+  {
+    if (SimRealTime)
+    {
+      while (SimTick < sim_wall_ticks() && SimTick < SimMaxTicks)
+      {
+        sim_main_loop_tick();
+      }
+    }
+    fflush(stdout);
+
+    Poll.fd = Master;
+    Poll.events = POLLIN;
+    if (poll(&Poll, 1, SimRealTime ? 1 : -1) <= 0 || !(Poll.revents & POLLIN))
+    {
+      continue;
+    }
+    Count = read(Master, Buffer, sizeof(Buffer));
+    if (Count < 0 && errno != EINTR && errno != EAGAIN)
+    {
+      perror("ebbsim: read");
+      break;
+    }
+    for (b = 0; b < Count; b++)
+    {
+      if (Buffer[b] != '\r' && Buffer[b] != '\n')
+      {
+        if (Length < sizeof(Line) - 1)
+        {
+          Line[Length++] = Buffer[b];
+        }
+        continue;
+      }
+      if (Length == 0)
+      {
+        continue;
+      }
+      Line[Length] = 0;
+      Length = 0;
+      LineNumber++;
+
+      if (!SimRealTime)
+      {
+        for (Ticks = 0; Ticks < SimLatencyTicks && SimTick < SimMaxTicks; Ticks++)
+        {
+          sim_main_loop_tick();
+        }
+      }
+      sim_command(Line, LineNumber);
+      fflush(stdout);
+    }
+  }
+
+  // Don't hold up the rest of the moves (if any) waiting for the clock
+  SimRealTime = FALSE;
+}
+#endif
+
+static void sim_usage(void)
+{
+  fprintf(stderr,
+    "usage: ebbsim [-o trace] [-c golden_trace] [-m max_ticks] [script]\n"
+#if defined(SIM_HAS_PTY)
+    "       ebbsim -p [link] [-r] [-l latency_ticks] [-o trace] [-m max_ticks]\n"
+#endif
+    "  Runs EBB commands from script (or stdin) through the motion engine.\n"
+    "  -o trace         write the step trace to this file\n"
+    "  -c golden_trace  compare the step trace to this file, exit 1 if different\n"
+    "  -m max_ticks     stop after this many 25KHz ISR ticks\n"
+#if defined(SIM_HAS_PTY)
+    "  -p [link]        be a virtual EBB on a pty (symlinked from link, if given)\n"
+    "                   until SIGINT or SIGTERM\n"
+    "  -r               with -p, run in real time instead of simulated time\n"
+    "  -l latency_ticks with -p, simulated ticks each command takes (default 25)\n"
+#endif
+  );
+}
+
+int main(int argc, char * argv[])
+{
+  FILE * Script = stdin;
+  char Line[256];
+  UINT32 LineNumber = 0;
+  int a;
+  int Axis;
+  size_t len;
+  BOOL ok = TRUE;
+  BOOL MaxTicksSet = FALSE;
+#if defined(SIM_HAS_PTY)
+  const char * LinkName = NULL;
+  int Master = -1;
+#endif
+
+  for (a = 1; a < argc; a++)
+  {
+    if (strcmp(argv[a], "-o") == 0 && a + 1 < argc)
+    {
+      SimTrace = fopen(argv[++a], "w");
+      if (!SimTrace)
+      {
+        perror(argv[a]);
+        return 2;
+      }
+    }
+    else if (strcmp(argv[a], "-c") == 0 && a + 1 < argc)
+    {
+      SimGolden = fopen(argv[++a], "r");
+      if (!SimGolden)
+      {
+        perror(argv[a]);
+        return 2;
+      }
+    }
+    else if (strcmp(argv[a], "-m") == 0 && a + 1 < argc)
+    {
+      SimMaxTicks = strtoul(argv[++a], NULL, 10);
+      MaxTicksSet = TRUE;
+    }
+#if defined(SIM_HAS_PTY)
+    else if (strcmp(argv[a], "-p") == 0)
+    {
+      SimPty = TRUE;
+      if (a + 1 < argc && argv[a + 1][0] != '-')
+      {
+        LinkName = argv[++a];
+      }
+    }
+    else if (strcmp(argv[a], "-r") == 0)
+    {
+      SimRealTime = TRUE;
+    }
+    else if (strcmp(argv[a], "-l") == 0 && a + 1 < argc)
+    {
+      SimLatencyTicks = strtoul(argv[++a], NULL, 10);
+    }
+#endif
+    else if (argv[a][0] == '-')
+    {
+      sim_usage();
+      return 2;
+    }
+    else
+    {
+      Script = fopen(argv[a], "r");
+      if (!Script)
+      {
+        perror(argv[a]);
+        return 2;
+      }
+    }
+  }
+
+  // Same order as UserInit() in UBW.c
+  sim_reset_sfrs();
+  EBB_Init();
+  RCServo2_Init();
+
+  // The header goes out as one line, so that -c compares it as one
+  strcpy(Line, "# tick,step1,dir1,step2,dir2");
+  for (Axis = 3; Axis <= NUMBER_OF_STEPPERS; Axis++)
+  {
+    sprintf(Line + strlen(Line), ",step%d,dir%d", Axis, Axis);
+  }
+  strcat(Line, "\n");
+  sim_output(Line);
+
+#if defined(SIM_HAS_PTY)
+  if (SimPty)
+  {
+    if (!MaxTicksSet)
+    {
+      SimMaxTicks = 0xFFFFFFFFUL;
+    }
+    Master = sim_open_pty(LinkName);
+    if (Master < 0)
+    {
+      return 2;
+    }
+    sim_serve_pty(Master);
+    Script = NULL;
+  }
+#endif
+
+  while (Script && fgets(Line, sizeof(Line), Script))
+  {
+    LineNumber++;
+    len = strlen(Line);
+    while (len && (Line[len - 1] == '\n' || Line[len - 1] == '\r' || Line[len - 1] == ' '))
+    {
+      Line[--len] = 0;
+    }
+    if (len == 0 || Line[0] == '#')
+    {
+      continue;
+    }
+    if (!sim_command(Line, LineNumber))
+    {
+      ok = FALSE;
+    }
+  }
+  sim_run_until_idle();
+
+  if (SimGolden)
+  {
+    // Anything left over in the golden trace is a mismatch too
+    while (fgets(Line, sizeof(Line), SimGolden))
+    {
+      if (SimMismatches == 0)
+      {
+        fprintf(stderr, "ebbsim: trace ended early, golden trace continues with: %s", Line);
+      }
+      SimMismatches++;
+    }
+  }
+
+  fprintf(stderr, "ebbsim: %lu ticks (%lu.%03lu s), %lu steps, position %ld,%ld",
+    (unsigned long)SimTick,
+    (unsigned long)(SimTick / 25000UL),
+    (unsigned long)((SimTick % 25000UL) / 25UL),
+    (unsigned long)SimStepCount,
+    (long)globalStepCounter[0],
+    (long)globalStepCounter[1]
+  );
+  for (Axis = 2; Axis < NUMBER_OF_STEPPERS; Axis++)
+  {
+    fprintf(stderr, ",%ld", (long)globalStepCounter[Axis]);
+  }
+  fprintf(stderr, "%s\n", (SimTick >= SimMaxTicks) ? " (hit tick limit)" : "");
+  if (SimGolden)
+  {
+    fprintf(stderr, "ebbsim: %lu trace line(s) differ from golden trace\n", (unsigned long)SimMismatches);
+  }
+
+  if (SimTrace)
+  {
+    fclose(SimTrace);
+  }
+#if defined(SIM_HAS_PTY)
+  if (LinkName)
+  {
+    unlink(LinkName);
+  }
+#endif
+  if (SimMismatches || !ok)
+  {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,15 @@
+/*********************************************************************
+ *
+ *                EiBotBoard Firmware - host simulator
+ *
+ *********************************************************************
+ * FileName:        Compiler.h
+ *
+ * Stand-in for the Microchip Compiler.h when building on a PC.
+ */
+#ifndef SIM_COMPILER_H
+#define SIM_COMPILER_H
+
+#include <p18cxxx.h>
+
+#endif
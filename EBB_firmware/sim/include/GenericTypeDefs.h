@@ -0,0 +1,32 @@
+/*********************************************************************
+ *
+ *                EiBotBoard Firmware - host simulator
+ *
+ *********************************************************************
+ * FileName:        GenericTypeDefs.h
+ *
+ * Stand-in for the Microchip GenericTypeDefs.h when building on a PC.
+ * The Microchip version uses 'long' for the 32 bit types, which is 64
+ * bits wide on most PCs, so we pin every width down with <stdint.h>.
+ */
+#ifndef SIM_GENERIC_TYPE_DEFS_H
+#define SIM_GENERIC_TYPE_DEFS_H
+
+#include <stdint.h>
+
+typedef enum _BOOL { FALSE = 0, TRUE } BOOL;
+
+typedef int16_t             INT;
+typedef int8_t              INT8;
+typedef int16_t             INT16;
+typedef int32_t             INT32;
+typedef uint16_t            UINT;
+typedef uint8_t             UINT8;
+typedef uint16_t            UINT16;
+typedef uint32_t            UINT32;
+
+typedef uint8_t             BYTE;
+typedef uint16_t            WORD;
+typedef uint32_t            DWORD;
+
+#endif
@@ -0,0 +1,11 @@
+/* Host simulator stand-in for the C18 delays.h. Delays take no time here. */
+#ifndef SIM_DELAYS_H
+#define SIM_DELAYS_H
+
+#define Delay1TCY()
+#define Delay10TCYx(x)
+#define Delay100TCYx(x)
+#define Delay1KTCYx(x)
+#define Delay10KTCYx(x)
+
+#endif
@@ -0,0 +1,136 @@
+/*********************************************************************
+ *
+ *                EiBotBoard Firmware - host simulator
+ *
+ *********************************************************************
+ * FileName:        p18cxxx.h
+ *
+ * Stand-in for the C18 device header when building the EBB motion code
+ * on a PC (see ../readme.txt). Each special function register that the
+ * motion code touches is just a plain variable here (see sim_sfr.c), so
+ * the simulator can poke and peek at them between ISR ticks.
+ *
+ * Note that unlike on the real part, a register and its 'bits' union are
+ * two separate variables. The motion code never mixes the two for the
+ * same register, so this does not matter.
+ */
+#ifndef SIM_P18CXXX_H
+#define SIM_P18CXXX_H
+
+// C18 storage qualifiers mean nothing on a PC
+#define rom
+#define ROM
+#define far
+#define near
+#define ram
+
+// C18 printf() '%l' means 32 bits, which is an int on a PC. sim_printf()
+// (in sim_ubw.c) drops the 'l's so the firmware's format strings still work.
+#include <stdio.h>
+int sim_printf(const char * Format, ...);
+#define printf sim_printf
+
+#define Nop()
+#define ClrWdt()
+#define Reset()
+
+#define SIM_PORT_BITS(P, Q)                                                   \
+  typedef struct {                                                            \
+    unsigned R##Q##0:1; unsigned R##Q##1:1; unsigned R##Q##2:1;               \
+    unsigned R##Q##3:1; unsigned R##Q##4:1; unsigned R##Q##5:1;               \
+    unsigned R##Q##6:1; unsigned R##Q##7:1;                                   \
+  } PORT##Q##bits_t;                                                          \
+  typedef struct {                                                            \
+    unsigned LAT##Q##0:1; unsigned LAT##Q##1:1; unsigned LAT##Q##2:1;         \
+    unsigned LAT##Q##3:1; unsigned LAT##Q##4:1; unsigned LAT##Q##5:1;         \
+    unsigned LAT##Q##6:1; unsigned LAT##Q##7:1;                               \
+  } LAT##Q##bits_t;                                                           \
+  typedef struct {                                                            \
+    unsigned TRIS##Q##0:1; unsigned TRIS##Q##1:1; unsigned TRIS##Q##2:1;      \
+    unsigned TRIS##Q##3:1; unsigned TRIS##Q##4:1; unsigned TRIS##Q##5:1;      \
+    unsigned TRIS##Q##6:1; unsigned TRIS##Q##7:1;                             \
+  } TRIS##Q##bits_t;                                                          \
+  extern volatile unsigned char PORT##Q;                                      \
+  extern volatile unsigned char LAT##Q;                                       \
+  extern volatile unsigned char TRIS##Q;                                      \
+  extern volatile PORT##Q##bits_t PORT##Q##bits;                              \
+  extern volatile LAT##Q##bits_t LAT##Q##bits;                                \
+  extern volatile TRIS##Q##bits_t TRIS##Q##bits;
+
+SIM_PORT_BITS(PORTA, A)
+SIM_PORT_BITS(PORTB, B)
+SIM_PORT_BITS(PORTC, C)
+SIM_PORT_BITS(PORTD, D)
+SIM_PORT_BITS(PORTE, E)
+
+typedef struct {
+  unsigned RBIF:1; unsigned INT0IF:1; unsigned TMR0IF:1; unsigned RBIE:1;
+  unsigned INT0IE:1; unsigned TMR0IE:1; unsigned GIEL:1; unsigned GIEH:1;
+} INTCONbits_t;
+typedef struct {
+  unsigned RBIP:1; unsigned :1; unsigned TMR0IP:1; unsigned :1;
+  unsigned INTEDG2:1; unsigned INTEDG1:1; unsigned INTEDG0:1; unsigned RBPU:1;
+} INTCON2bits_t;
+typedef struct {
+  unsigned TMR1IF:1; unsigned TMR2IF:1; unsigned CCP1IF:1; unsigned SSP1IF:1;
+  unsigned TX1IF:1; unsigned RC1IF:1; unsigned ADIF:1; unsigned PMPIF:1;
+} PIR1bits_t;
+typedef struct {
+  unsigned TMR1IE:1; unsigned TMR2IE:1; unsigned CCP1IE:1; unsigned SSP1IE:1;
+  unsigned TX1IE:1; unsigned RC1IE:1; unsigned ADIE:1; unsigned PMPIE:1;
+} PIE1bits_t;
+typedef struct {
+  unsigned TMR1IP:1; unsigned TMR2IP:1; unsigned CCP1IP:1; unsigned SSP1IP:1;
+  unsigned TX1IP:1; unsigned RC1IP:1; unsigned ADIP:1; unsigned PMPIP:1;
+} IPR1bits_t;
+typedef struct {
+  unsigned TMR1ON:1; unsigned RD16:1; unsigned T1SYNC:1; unsigned T1OSCEN:1;
+  unsigned T1CKPS0:1; unsigned T1CKPS1:1; unsigned TMR1CS0:1; unsigned TMR1CS1:1;
+} T1CONbits_t;
+typedef struct {
+  unsigned T2CKPS:2; unsigned TMR2ON:1; unsigned T2OUTPS:4; unsigned :1;
+} T2CONbits_t;
+typedef struct {
+  unsigned TMR3ON:1; unsigned RD16:1; unsigned T3SYNC:1; unsigned T3OSCEN:1;
+  unsigned T3CKPS:2; unsigned TMR3CS:2;
+} T3CONbits_t;
+typedef struct {
+  unsigned T3CCP1:1; unsigned T3CCP2:1; unsigned :6;
+} TCLKCONbits_t;
+typedef struct {
+  unsigned CCP1M:4; unsigned DC1B:2; unsigned P1M:2;
+} CCP1CONbits_t;
+typedef struct {
+  unsigned CCP2M:4; unsigned DC2B:2; unsigned P2M:2;
+} CCP2CONbits_t;
+
+extern volatile INTCONbits_t INTCONbits;
+extern volatile INTCON2bits_t INTCON2bits;
+extern volatile PIR1bits_t PIR1bits;
+extern volatile PIE1bits_t PIE1bits;
+extern volatile IPR1bits_t IPR1bits;
+extern volatile T1CONbits_t T1CONbits;
+extern volatile T2CONbits_t T2CONbits;
+extern volatile T3CONbits_t T3CONbits;
+extern volatile TCLKCONbits_t TCLKCONbits;
+extern volatile CCP1CONbits_t CCP1CONbits;
+extern volatile CCP2CONbits_t CCP2CONbits;
+
+extern volatile unsigned char TMR1H;
+extern volatile unsigned char TMR1L;
+extern volatile unsigned short TMR1;
+extern volatile unsigned char TMR3H;
+extern volatile unsigned char TMR3L;
+extern volatile unsigned short TMR3;
+extern volatile unsigned char PR2;
+extern volatile unsigned char CCP1CON;
+extern volatile unsigned char CCPR1L;
+extern volatile unsigned short CCPR2;
+
+// The RPORx registers are contiguous on the real part, and RCServo2.c
+// indexes off of RPOR0, so keep them in one array here.
+extern volatile unsigned char RPOR[25];
+#define RPOR0   RPOR[0]
+#define RPOR6   RPOR[6]
+
+#endif
@@ -0,0 +1 @@
+/* Nothing from usart.h is needed by the simulator */
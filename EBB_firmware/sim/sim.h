@@ -0,0 +1,19 @@
+/*********************************************************************
+ *
+ *                EiBotBoard Firmware - host simulator
+ *
+ *********************************************************************
+ * FileName:        sim.h
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include "GenericTypeDefs.h"
+
+#define kCR                   0x0D
+
+void sim_load_parameters(const char * Parameters);
+BOOL sim_parameters_done(void);
+void sim_reset_sfrs(void);
+
+#endif
@@ -0,0 +1,61 @@
+/*********************************************************************
+ *
+ *                EiBotBoard Firmware - host simulator
+ *
+ *********************************************************************
+ * FileName:        sim_sfr.c
+ *
+ * Storage for the mock special function registers in include/p18cxxx.h
+ */
+#include <string.h>
+#include "p18cxxx.h"
+#include "sim.h"
+
+#define SIM_PORT(Q)                                                           \
+  volatile unsigned char PORT##Q;                                             \
+  volatile unsigned char LAT##Q;                                              \
+  volatile unsigned char TRIS##Q;                                             \
+  volatile PORT##Q##bits_t PORT##Q##bits;                                     \
+  volatile LAT##Q##bits_t LAT##Q##bits;                                       \
+  volatile TRIS##Q##bits_t TRIS##Q##bits;
+
+SIM_PORT(A)
+SIM_PORT(B)
+SIM_PORT(C)
+SIM_PORT(D)
+SIM_PORT(E)
+
+volatile INTCONbits_t INTCONbits;
+volatile INTCON2bits_t INTCON2bits;
+volatile PIR1bits_t PIR1bits;
+volatile PIE1bits_t PIE1bits;
+volatile IPR1bits_t IPR1bits;
+volatile T1CONbits_t T1CONbits;
+volatile T2CONbits_t T2CONbits;
+volatile T3CONbits_t T3CONbits;
+volatile TCLKCONbits_t TCLKCONbits;
+volatile CCP1CONbits_t CCP1CONbits;
+volatile CCP2CONbits_t CCP2CONbits;
+
+volatile unsigned char TMR1H;
+volatile unsigned char TMR1L;
+volatile unsigned short TMR1;
+volatile unsigned char TMR3H;
+volatile unsigned char TMR3L;
+volatile unsigned short TMR3;
+volatile unsigned char PR2;
+volatile unsigned char CCP1CON;
+volatile unsigned char CCPR1L;
+volatile unsigned short CCPR2;
+volatile unsigned char RPOR[25];
+
+// Put the pins into their idle (nothing pressed) states
+void sim_reset_sfrs(void)
+{
+  // PRG button (RA7) and alternate pause button (RB0) have pull-ups
+  PORTAbits.RA7 = 1;
+  PORTBbits.RB0 = 1;
+  // Interrupts are on, just like after UserInit()
+  INTCONbits.GIEH = 1;
+  INTCONbits.GIEL = 1;
+}
@@ -0,0 +1,240 @@
+/*********************************************************************
+ *
+ *                EiBotBoard Firmware - host simulator
+ *
+ *********************************************************************
+ * FileName:        sim_ubw.c
+ *
+ * The handful of things from UBW.c (and the rest of the firmware) that
+ * the motion code needs, done just well enough for the simulator.
+ * The command parser here follows extract_number() in UBW.c, including
+ * its range checks, but reads from a plain C string.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include "GenericTypeDefs.h"
+#include "UBW.h"
+#include "sim.h"
+
+unsigned char g_RX_buf[kRX_BUF_SIZE];
+unsigned char g_RX_buf_out;
+unsigned char error_byte;
+BOOL g_ack_enable = TRUE;
+BOOL g_binary_enable = FALSE;
+volatile unsigned long int gRCServoPoweroffCounterMS;
+volatile unsigned long int gRCServoPoweroffCounterReloadMS = 60000;
+volatile unsigned int ISR_A_FIFO[16];
+
+// Copy one command (without its two command letters) into g_RX_buf so that
+// extract_number() can pull parameters out of it, just like on the EBB.
+void sim_load_parameters(const char * Parameters)
+{
+  size_t len = strlen(Parameters);
+
+  if (len > kRX_BUF_SIZE - 2)
+  {
+    len = kRX_BUF_SIZE - 2;
+  }
+  memcpy(g_RX_buf, Parameters, len);
+  g_RX_buf[len] = kCR;
+  g_RX_buf_out = 0;
+}
+
+// Returns TRUE if the command parser ate all of the parameters
+BOOL sim_parameters_done(void)
+{
+  return (g_RX_buf[g_RX_buf_out] == kCR);
+}
+
+ExtractReturnType extract_number(
+  ExtractType Type,
+  void * ReturnValue,
+  unsigned char Required
+)
+{
+  UINT32 ULAccumulator = 0;
+  INT32 Accumulator = 0;
+  BOOL Negative = FALSE;
+  UINT8 digits = 0;
+
+  if (kCR == g_RX_buf[g_RX_buf_out])
+  {
+    if (0 == Required)
+    {
+      bitset (error_byte, kERROR_BYTE_MISSING_PARAMETER);
+    }
+    return (kEXTRACT_MISSING_PARAMETER);
+  }
+  if (g_RX_buf[g_RX_buf_out] != ',')
+  {
+    if (0 == Required)
+    {
+      printf ("!5 Err: Need comma next, found: '%c'\r\n", g_RX_buf[g_RX_buf_out]);
+      bitset (error_byte, kERROR_BYTE_PRINTED_ERROR);
+    }
+    return (kEXTRACT_COMMA_MISSING);
+  }
+  g_RX_buf_out++;
+  if (kCR == g_RX_buf[g_RX_buf_out])
+  {
+    if (0 == Required)
+    {
+      bitset (error_byte, kERROR_BYTE_MISSING_PARAMETER);
+    }
+    return (kEXTRACT_MISSING_PARAMETER);
+  }
+
+  if (kASCII_CHAR == Type || kUCASE_ASCII_CHAR == Type)
+  {
+    ULAccumulator = g_RX_buf[g_RX_buf_out];
+    if (kUCASE_ASCII_CHAR == Type)
+    {
+      ULAccumulator = toupper (ULAccumulator);
+    }
+    g_RX_buf_out++;
+    *(unsigned char *)ReturnValue = (unsigned char)ULAccumulator;
+    return (kEXTRACT_OK);
+  }
+
+  if ('-' == g_RX_buf[g_RX_buf_out])
+  {
+    if (kUCHAR == Type || kUINT == Type || kULONG == Type)
+    {
+      bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+      return (kEXTRACT_PARAMETER_OUTSIDE_LIMIT);
+    }
+    Negative = TRUE;
+    g_RX_buf_out++;
+  }
+
+  // Same as extract_digit(): at most 10 digits, wrapping at 32 bits
+  while (digits < 10 && isdigit (g_RX_buf[g_RX_buf_out]))
+  {
+    ULAccumulator = (ULAccumulator * 10) + (g_RX_buf[g_RX_buf_out] - '0');
+    g_RX_buf_out++;
+    digits++;
+  }
+
+  if (Negative)
+  {
+    if (
+      (kCHAR == Type && ULAccumulator > 128UL)
+      ||
+      (kINT == Type && ULAccumulator > 32768UL)
+      ||
+      (kLONG == Type && ULAccumulator > 0x80000000UL)
+    )
+    {
+      bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+      return (kEXTRACT_PARAMETER_OUTSIDE_LIMIT);
+    }
+    Accumulator = -(INT32)ULAccumulator;
+  }
+  else
+  {
+    if (
+      (kCHAR == Type && ULAccumulator > 127UL)
+      ||
+      (kUCHAR == Type && ULAccumulator > 255UL)
+      ||
+      (kINT == Type && ULAccumulator > 32767UL)
+      ||
+      (kUINT == Type && ULAccumulator > 65535UL)
+      ||
+      (kLONG == Type && ULAccumulator > 0x7FFFFFFFUL)
+    )
+    {
+      bitset (error_byte, kERROR_BYTE_PARAMETER_OUTSIDE_LIMIT);
+      return (kEXTRACT_PARAMETER_OUTSIDE_LIMIT);
+    }
+    Accumulator = (INT32)ULAccumulator;
+  }
+
+  switch (Type)
+  {
+    case kCHAR:
+      *(INT8 *)ReturnValue = (INT8)Accumulator;
+      break;
+    case kUCHAR:
+      *(UINT8 *)ReturnValue = (UINT8)Accumulator;
+      break;
+    case kINT:
+      *(INT16 *)ReturnValue = (INT16)Accumulator;
+      break;
+    case kUINT:
+      *(UINT16 *)ReturnValue = (UINT16)Accumulator;
+      break;
+    case kLONG:
+      *(INT32 *)ReturnValue = Accumulator;
+      break;
+    case kULONG:
+      *(UINT32 *)ReturnValue = ULAccumulator;
+      break;
+    default:
+      return (kEXTRACT_INVALID_TYPE);
+  }
+  return (kEXTRACT_OK);
+}
+
+void print_ack(void)
+{
+  if (g_ack_enable)
+  {
+    printf ("OK\r\n");
+  }
+}
+
+// Pin direction and level changes for RC servo outputs don't matter to
+// the simulator
+// printf() for the firmware's C18 format strings, where %lu and friends
+// are 32 bits wide. Those are plain ints here, so the 'l' is dropped.
+int sim_printf(const char * Format, ...)
+{
+  char HostFormat[128];
+  unsigned int i = 0;
+  BOOL InSpec = FALSE;
+  va_list Args;
+  int Ret;
+
+  while (*Format && i < sizeof(HostFormat) - 1)
+  {
+    if (InSpec)
+    {
+      if (*Format == 'l')
+      {
+        Format++;
+        continue;
+      }
+      if (isalpha((unsigned char)*Format) || *Format == '%')
+      {
+        InSpec = FALSE;
+      }
+    }
+    else if (*Format == '%')
+    {
+      InSpec = TRUE;
+    }
+    HostFormat[i++] = *Format++;
+  }
+  HostFormat[i] = 0;
+
+  va_start(Args, Format);
+  Ret = vprintf(HostFormat, Args);
+  va_end(Args);
+  return Ret;
+}
+
+// No analog inputs in the simulator; QC just reports zeros
+void AnalogConfigure(unsigned char Channel, unsigned char Enable)
+{
+}
+
+void SetPinTRISFromRPn(char Pin, char State)
+{
+}
+
+void SetPinLATFromRPn(char Pin, char State)
+{
+}
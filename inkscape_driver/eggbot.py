@@ -22,9 +22,20 @@
 # TODO: Add and honor advisory locking around device open/close for non Win32
 
 import gettext
+import hashlib
 import math
-import time
+import os
+import struct
 import sys
+import tempfile
+import threading
+import time
+import zlib
+
+try:
+    import Queue as queue  # Python 2
+except ImportError:
+    import queue
 
 import cubicsuperpath
 import ebb_motion  # https://github.com/evil-mad/plotink    Requires version 0.2 or newer.
@@ -45,6 +56,122 @@ N_SERVOSPEED = 50  # Default pen-lift speed
 N_WALK_DEFAULT = 10  # Default steps for walking stepper motors
 N_DEFAULT_LAYER = 1  # Default inkscape layer
 
+F_LM_RATE_PER_STEP_S = 2147483648 * 40e-6  # LM Rate for 1 step/s: 2^31 per step, 40 us per tick
+F_QUEUE_POLL_INTERVAL = 0.005  # seconds between QF polls while the EBB motion queue is full
+F_BUTTON_POLL_INTERVAL = 0.1  # seconds between pause button checks while plotting
+N_PLOT_QUEUE_LENGTH = 100  # flattened subpaths (and pen/resume actions) buffered ahead of the sender
+N_PLOT_STREAM_VERSION = 3  # bump when the plot stream format or the geometry code changes
+PLOT_STREAM_MAGIC = b'EBSTREAM'
+N_COALESCE_MAX_RUN = 64  # most points merged into one move (bounds the tolerance checks)
+N_USB_PACKET_SIZE = 64  # bytes; motion commands are packed into writes of up to this size
+N_DRY_RUN_QUEUE_SIZE = 15  # motion queue size the dry run reports (QF, as the EBB does), so moves are never paced by sleeping
+STR_DRY_RUN_VERSION = 'EBBv13_and_above EB Firmware Version 2.8.0'
+
+
+class DryRunPort(object):
+    """
+    Stands in for the EBB's serial port for a dry run. It answers each
+    command the way the EBB would, and adds up how long the EBB would take
+    to carry out the moves and pen lifts, so the plot goes through exactly
+    the same code (flow control, acceleration and all) as a real one.
+    """
+
+    def __init__(self):
+        self.responses = ''  # Reply bytes not read yet, framed as the EBB sends them
+        self.bPenIsUp = True
+        self.commandCount = 0
+        self.penLifts = 0
+        self.penUpTime = 0.0  # seconds
+        self.penDownTime = 0.0
+        self.servoTime = 0.0
+        self.penUpDistance = 0.0  # motor steps
+        self.penDownDistance = 0.0
+
+    def write(self, data):
+        for str_command in data.decode('ascii').split('\r'):
+            if str_command:
+                self.runCommand(str_command.split(','))
+
+    def readline(self):
+        n_end = self.responses.find('\n') + 1
+        if n_end == 0:
+            n_end = len(self.responses)
+        return self.read(n_end)
+
+    def read(self, size=1):
+        str_data = self.responses[:size]
+        self.responses = self.responses[size:]
+        return str_data.encode('ascii')
+
+    def close(self):
+        pass
+
+    def runCommand(self, fields):
+        str_name = fields[0].upper()
+        if str_name == 'QF':
+            self.responses += 'QF,0,{0:d}\n\r'.format(N_DRY_RUN_QUEUE_SIZE)  # QF and QM end in LF CR
+        elif str_name == 'QM':
+            self.responses += 'QM,0,0,0,0\n\r'
+        elif str_name == 'V':
+            self.responses += STR_DRY_RUN_VERSION + '\r\n'
+        elif str_name == 'QP':
+            self.responses += ('1\r\n' if self.bPenIsUp else '0\r\n') + 'OK\r\n'
+        elif str_name.startswith('Q'):
+            self.responses += '0\r\nOK\r\n'  # No button presses, nothing to report
+        else:
+            self.commandCount += 1  # Queries aren't counted: the button poller makes a varying number of them
+            self.responses += 'OK\r\n'
+            if str_name == 'SM':
+                self.addMove(float(fields[1]) / 1000.0, math.hypot(float(fields[2]), float(fields[3])))
+            elif str_name == 'LM':
+                self.addMove(self.timeLM(fields), math.hypot(float(fields[2]), float(fields[5])))
+            elif str_name == 'SP':
+                b_pen_up = (fields[1] == '1')
+                if b_pen_up and not self.bPenIsUp:
+                    self.penLifts += 1
+                self.bPenIsUp = b_pen_up
+                if len(fields) > 2:
+                    self.servoTime += float(fields[2]) / 1000.0
+
+    def addMove(self, f_time, f_distance):
+        if self.bPenIsUp:
+            self.penUpTime += f_time
+            self.penUpDistance += f_distance
+        else:
+            self.penDownTime += f_time
+            self.penDownDistance += f_distance
+
+    def timeLM(self, fields):
+        # Seconds for an LM move: each axis adds Rate to its step accumulator
+        # every 40 us tick (and Accel to Rate); it steps every 2^31 of that.
+        n_ticks = 0.0
+        for n_field in [1, 4]:
+            f_rate = float(fields[n_field])
+            f_steps = abs(float(fields[n_field + 1]))
+            f_accel = float(fields[n_field + 2])
+            if f_steps == 0:
+                continue
+            f_target = f_steps * 2147483648.0
+            f_root = f_rate * f_rate + 2.0 * f_accel * f_target
+            if f_accel == 0 or f_root < 0:
+                f_axis = f_target / max(f_rate, 1.0)
+            else:
+                f_axis = (math.sqrt(f_root) - f_rate) / f_accel
+            n_ticks = max(n_ticks, f_axis)
+        return n_ticks * 40e-6
+
+    def report(self):
+        f_total = self.penDownTime + self.penUpTime + self.servoTime
+        n_seconds = int(round(f_total))
+        inkex.errormsg(
+            gettext.gettext('Dry run (nothing was sent to the EggBot). Estimated plot time: {0:d}:{1:02d}:{2:02d}\n').format(
+                n_seconds // 3600, (n_seconds // 60) % 60, n_seconds % 60) +
+            gettext.gettext('  Pen down: {0:.0f} steps in {1:.1f} s\n').format(self.penDownDistance, self.penDownTime) +
+            gettext.gettext('  Pen up: {0:.0f} steps in {1:.1f} s\n').format(self.penUpDistance, self.penUpTime) +
+            gettext.gettext('  Pen lifts: {0:d}, with {1:.1f} s of pen up/down delays\n').format(
+                self.penLifts, self.servoTime) +
+            gettext.gettext('  Commands: {0:d}').format(self.commandCount))
+
 
 class EggBot(inkex.Effect):
 
@@ -63,6 +190,18 @@ class EggBot(inkex.Effect):
                                      action="store", type="inkbool",
                                      dest="wraparound", default=True,
                                      help="Egg (x) axis wraps around-- take shortcuts!")
+        self.OptionParser.add_option("--accelerate",
+                                     action="store", type="inkbool",
+                                     dest="accelerate", default=False,
+                                     help="Speed up and slow down smoothly (LM moves)")
+        self.OptionParser.add_option("--reorder",
+                                     action="store", type="inkbool",
+                                     dest="reorder", default=False,
+                                     help="Reorder paths within each layer to reduce pen-up travel")
+        self.OptionParser.add_option("--dryRun",
+                                     action="store", type="inkbool",
+                                     dest="dryRun", default=False,
+                                     help="Estimate plot time without an EggBot, instead of plotting")
         self.OptionParser.add_option("--penUpSpeed",
                                      action="store", type="int",
                                      dest="penUpSpeed", default=F_DEFAULT_SPEED,
@@ -161,6 +300,27 @@ class EggBot(inkex.Effect):
         self.svgTotalDeltaX = 0
         self.svgTotalDeltaY = 0
         self.serialPort = None
+        self.queueSize = None  # EBB motion queue size (from QF), or None to pace moves with time.sleep
+        self.queueFree = 0  # Motion commands we can still send before the EBB queue is full
+        self.pendingCommands = []  # Motion commands packed for the next write (see sendCommand)
+        self.pendingBytes = 0
+        self.unackedCommands = []  # Commands written whose "OK" hasn't been read yet
+        self.serialLock = threading.RLock()  # One command/response at a time while the button poller runs
+        self.buttonPoller = None
+        self.buttonPollerStop = threading.Event()
+        self.bButtonPressed = False  # Set by the button poller; acted on at the end of a node
+        self.bNoResponseFromEbb = False
+        self.plotQueue = None  # Actions waiting for the sender thread, or None to run them right away
+        self.plotSender = None
+        self.plotSenderError = None
+        self.resumePathTarget = None  # Path number to restart at when resuming (see playOp)
+        self.bSkipPath = False  # Current path was finished before the pause we're resuming from
+        self.plotRecord = None  # Plot stream being compiled, or None
+        self.bDeferStream = False  # Compile the plot stream without playing it (for optimizeStream)
+        self.optimizeBudget = 0
+        self.bAccelerate = False  # Moves go through the lookahead planner as LM commands
+        self.moveBuffer = []  # Moves waiting for the planner: (egg steps, pen steps, speed)
+        self.moveEntrySpeed = 0.0
 
         self.svg = None
         self.svgWidth = float(eggbot_conf.N_PAGE_WIDTH)
@@ -193,7 +353,10 @@ class EggBot(inkex.Effect):
         if self.options.tab in ["Help", "options", "timing"]:
             pass
         else:
-            self.serialPort = ebb_serial.openPort()
+            if self.options.dryRun and self.options.tab in ["splash", "resume", "layers"]:
+                self.serialPort = DryRunPort()
+            else:
+                self.serialPort = ebb_serial.openPort()
             if self.serialPort is None:
                 inkex.errormsg(gettext.gettext("Failed to connect to EggBot. :("))
 
@@ -242,6 +405,10 @@ class EggBot(inkex.Effect):
                 else:
                     self.manualCommand()
 
+            if isinstance(self.serialPort, DryRunPort):
+                self.serialPort.report()
+                return  # Leave the document's resume data as it was
+
             if self.serialPort is not None:
                 ebb_motion.doTimedPause(self.serialPort, 10)  # Pause a moment for underway commands to finish...
                 ebb_serial.closePort(self.serialPort)
@@ -440,17 +607,27 @@ class EggBot(inkex.Effect):
 
         self.ServoSetup()
         ebb_motion.sendEnableMotors(self.serialPort, 1)  # 16X microstepping
+        self.setupQueueFlowControl()
+        self.setupAcceleration()
 
         # Ensure that the engraver is turned off for the time being
         # It will be turned back on when the first non-virtual pen-down occurs
         if self.options.engraving:
             self.engraverOff()
 
+        self.startButtonPoller()
+
         try:
             # wrap everything in a try so we can for sure close the serial port
             # self.recursivelyTraverseSvg(self.document.getroot())
             self.penDownActivatesEngraver = True
-            self.recursivelyTraverseSvg(self.svg, self.svgTransform)
+            if self.resumeMode:
+                self.resumePathTarget = self.svgLastPath
+            self.startPlotSender()
+            try:
+                self.plotDocument()
+            finally:
+                self.finishPlotSender()
             self.penUp()  # Always end with pen-up
 
             # Logically, we want to turn the engraver off here as well,
@@ -464,6 +641,7 @@ class EggBot(inkex.Effect):
                 # self.penUp()
                 self.nodeCount = self.nodeTarget  # enables fpx return-to-home only option
                 self.plotLineAndTime()
+            self.flushMoves()
             # inkex.errormsg('Final node count: ' + str(self.svgNodeCount))  #Node Count - Debug option
             if not self.bStopped:
                 self.svgLayer = 0
@@ -474,6 +652,9 @@ class EggBot(inkex.Effect):
                 self.svgTotalDeltaY = 0
 
         finally:
+            if self.serialPort is not None:
+                self.collectAcks()
+            self.stopButtonPoller()
             # We may have had an exception and lost the serial port...
             self.penDownActivatesEngraver = False
             if self.serialPort is not None and self.options.engraving:
@@ -496,6 +677,7 @@ class EggBot(inkex.Effect):
             mat_current = [[1.0, 0.0, 0.0], [0.0, 1.0, 0.0]]
         for node in a_node_list:
             if self.bStopped:
+                self.plotRecord = None  # Paused: don't keep flattening the rest, or cache a partial stream
                 return
             # Ignore invisible nodes
             v = node.get('visibility', parent_visibility)
@@ -509,11 +691,13 @@ class EggBot(inkex.Effect):
 
             if node.tag in [inkex.addNS('g', 'svg'), 'g']:
 
-                self.penUp()
                 if node.get(inkex.addNS('groupmode', 'inkscape')) == 'layer':
+                    self.streamOp('L')
                     self.sCurrentLayerName = node.get(inkex.addNS('label', 'inkscape'))
                     if not self.allLayers:
                         self.DoWePlotLayer(self.sCurrentLayerName)
+                else:
+                    self.streamOp('U')
                 self.recursivelyTraverseSvg(node, mat_new, parent_visibility=v)
 
             elif node.tag in [inkex.addNS('use', 'svg'), 'use']:
@@ -553,27 +737,9 @@ class EggBot(inkex.Effect):
             elif self.plotCurrentLayer:  # Skip subsequent tag checks unless we are plotting this layer.
                 if node.tag == inkex.addNS('path', 'svg'):
 
-                    # if we're in resume mode AND self.pathcount < self.svgLastPath,
-                    #    then skip over this path.
-                    # if we're in resume mode and self.pathcount = self.svgLastPath,
-                    #    then start here, and set
-                    # self.nodeCount equal to self.svgLastPathNC
-
-                    do_we_plot_this_path = False
-                    if self.resumeMode:
-                        if self.pathcount < self.svgLastPath:
-                            self.pathcount += 1
-                        elif self.pathcount == self.svgLastPath:
-                            self.nodeCount = self.svgLastPathNC
-                            do_we_plot_this_path = True
-                    else:
-                        do_we_plot_this_path = True
-                    if do_we_plot_this_path:
-                        self.pathcount += 1
+                    if self.doWePlotThisPath():
                         self.plotPath(node, mat_new)
-                        if not self.bStopped:  # an "index" for resuming plots quickly-- record last complete path
-                            self.svgLastPath += 1
-                            self.svgLastPathNC = self.nodeCount
+                        self.streamOp('F')
 
                 elif node.tag in [inkex.addNS('rect', 'svg'), 'rect']:
 
@@ -588,17 +754,7 @@ class EggBot(inkex.Effect):
                     # I.e., explicitly draw three sides of the rectangle and the
                     # fourth side implicitly
 
-                    do_we_plot_this_path = False
-                    if self.resumeMode:
-                        if self.pathcount < self.svgLastPath:
-                            self.pathcount += 1
-                        elif self.pathcount == self.svgLastPath:
-                            self.nodeCount = self.svgLastPathNC
-                            do_we_plot_this_path = True
-                    else:
-                        do_we_plot_this_path = True
-                    if do_we_plot_this_path:
-                        self.pathcount += 1
+                    if self.doWePlotThisPath():
                         newpath = inkex.etree.Element(inkex.addNS('path', 'svg'))
                         x = float(node.get('x'))
                         y = float(node.get('y'))
@@ -618,9 +774,7 @@ class EggBot(inkex.Effect):
                              ]
                         newpath.set('d', simplepath.formatPath(a))
                         self.plotPath(newpath, mat_new)
-                        if not self.bStopped:  # an "index" for resuming plots quickly-- record last complete path
-                            self.svgLastPath += 1
-                            self.svgLastPathNC = self.nodeCount
+                        self.streamOp('F')
 
                 elif node.tag in [inkex.addNS('line', 'svg'), 'line']:
 
@@ -632,17 +786,7 @@ class EggBot(inkex.Effect):
                     #
                     #   <path d="MX1,Y1 LX2,Y2"/>
 
-                    do_we_plot_this_path = False
-                    if self.resumeMode:
-                        if self.pathcount < self.svgLastPath:
-                            self.pathcount += 1
-                        elif self.pathcount == self.svgLastPath:
-                            self.nodeCount = self.svgLastPathNC
-                            do_we_plot_this_path = True
-                    else:
-                        do_we_plot_this_path = True
-                    if do_we_plot_this_path:
-                        self.pathcount += 1
+                    if self.doWePlotThisPath():
                         newpath = inkex.etree.Element(inkex.addNS('path', 'svg'))
                         x1 = float(node.get('x1'))
                         y1 = float(node.get('y1'))
@@ -659,9 +803,7 @@ class EggBot(inkex.Effect):
                              ]
                         newpath.set('d', simplepath.formatPath(a))
                         self.plotPath(newpath, mat_new)
-                        if not self.bStopped:  # an "index" for resuming plots quickly-- record last complete path
-                            self.svgLastPath += 1
-                            self.svgLastPathNC = self.nodeCount
+                        self.streamOp('F')
 
                 elif node.tag in [inkex.addNS('polyline', 'svg'), 'polyline']:
 
@@ -679,17 +821,7 @@ class EggBot(inkex.Effect):
                     if pl == '':
                         pass
 
-                    do_we_plot_this_path = False
-                    if self.resumeMode:
-                        if self.pathcount < self.svgLastPath:
-                            self.pathcount += 1
-                        elif self.pathcount == self.svgLastPath:
-                            self.nodeCount = self.svgLastPathNC
-                            do_we_plot_this_path = True
-                    else:
-                        do_we_plot_this_path = True
-                    if do_we_plot_this_path:
-                        self.pathcount += 1
+                    if self.doWePlotThisPath():
                         pa = pl.split()
                         if not len(pa):
                             continue
@@ -709,9 +841,7 @@ class EggBot(inkex.Effect):
                         if t:
                             newpath.set('transform', t)
                         self.plotPath(newpath, mat_new)
-                        if not self.bStopped:  # an "index" for resuming plots quickly-- record last complete path
-                            self.svgLastPath += 1
-                            self.svgLastPathNC = self.nodeCount
+                        self.streamOp('F')
 
                 elif node.tag in [inkex.addNS('polygon', 'svg'), 'polygon']:
 
@@ -725,17 +855,7 @@ class EggBot(inkex.Effect):
                     if pl == '':
                         continue
 
-                    do_we_plot_this_path = False
-                    if self.resumeMode:
-                        if self.pathcount < self.svgLastPath:
-                            self.pathcount += 1
-                        elif self.pathcount == self.svgLastPath:
-                            self.nodeCount = self.svgLastPathNC
-                            do_we_plot_this_path = True
-                    else:
-                        do_we_plot_this_path = True
-                    if do_we_plot_this_path:
-                        self.pathcount += 1
+                    if self.doWePlotThisPath():
                         pa = pl.split()
                         if not len(pa):
                             continue
@@ -753,9 +873,7 @@ class EggBot(inkex.Effect):
                         if t:
                             newpath.set('transform', t)
                         self.plotPath(newpath, mat_new)
-                        if not self.bStopped:  # an "index" for resuming plots quickly-- record last complete path
-                            self.svgLastPath += 1
-                            self.svgLastPathNC = self.nodeCount
+                        self.streamOp('F')
 
                 elif node.tag in [inkex.addNS('ellipse', 'svg'), 'ellipse',
                                   inkex.addNS('circle', 'svg'), 'circle']:
@@ -785,17 +903,7 @@ class EggBot(inkex.Effect):
                     if rx == 0 or ry == 0:
                         pass
 
-                    do_we_plot_this_path = False
-                    if self.resumeMode:
-                        if self.pathcount < self.svgLastPath:
-                            self.pathcount += 1
-                        elif self.pathcount == self.svgLastPath:
-                            self.nodeCount = self.svgLastPathNC
-                            do_we_plot_this_path = True
-                    else:
-                        do_we_plot_this_path = True
-                    if do_we_plot_this_path:
-                        self.pathcount += 1
+                    if self.doWePlotThisPath():
                         cx = float(node.get('cx', '0'))
                         cy = float(node.get('cy', '0'))
                         x1 = cx - rx
@@ -820,9 +928,7 @@ class EggBot(inkex.Effect):
                         if t:
                             newpath.set('transform', t)
                         self.plotPath(newpath, mat_new)
-                        if not self.bStopped:  # an "index" for resuming plots quickly-- record last complete path
-                            self.svgLastPath += 1
-                            self.svgLastPathNC = self.nodeCount
+                        self.streamOp('F')
 
                 elif node.tag in [inkex.addNS('metadata', 'svg'), 'metadata']:
                     pass
@@ -946,8 +1052,9 @@ class EggBot(inkex.Effect):
 
     def plotPath(self, path, mat_transform):
         """
-        Plot the path while applying the transformation defined
-        by the matrix [mat_transform].
+        Flatten the path while applying the transformation defined
+        by the matrix [mat_transform], and pass each subpath, in step
+        coordinates, along the plot stream.
         """
         # turn this path into a cubicsuperpath (list of beziers)...
 
@@ -965,42 +1072,641 @@ class EggBot(inkex.Effect):
         # where the start-point is the last point in the previous segment.
         for sp in p:
 
+            if self.bStopped:
+                self.plotRecord = None
+                return
+
             plot_utils.subdivideCubicPath(sp, self.options.smoothness)
-            n_index = 0
 
-            for csp in sp:
+            points = [(2 * float(csp[1][0]) / self.step_scaling_factor,
+                       2 * float(csp[1][1]) / self.step_scaling_factor) for csp in sp]
+            self.streamOp('P', self.coalescePoints(points))
 
-                if self.bStopped:
-                    return
+    def coalescePoints(self, points):
+        """
+        Cut down the number of moves in a flattened subpath. Points that
+        round to the same whole step as the one before (zero-length moves)
+        are dropped, and so are points along (nearly) straight runs, as long
+        as every point dropped stays within COALESCE_TOLERANCE steps of the
+        line that replaces it. The first and last points are always kept.
+        """
+        if len(points) < 3 or eggbot_conf.COALESCE_TOLERANCE < 0:
+            return points
+
+        distinct = [points[0]]
+        for point in points[1:-1]:
+            if int(point[0]) != int(distinct[-1][0]) or int(point[1]) != int(distinct[-1][1]):
+                distinct.append(point)
+        distinct.append(points[-1])
+
+        kept = [distinct[0]]
+        run = []  # Points since the last kept one, all on the line from it to run[-1]
+        for point in distinct[1:]:
+            if run:
+                if len(run) < N_COALESCE_MAX_RUN and self.onLine(kept[-1], point, run):
+                    run.append(point)
+                    continue
+                kept.append(run[-1])
+                run = []
+            run.append(point)
+        kept.append(run[-1])
+        return kept
+
+    def onLine(self, pt_from, pt_to, points):
+        # Are all of the points within COALESCE_TOLERANCE of the segment pt_from-pt_to?
+        tolerance = eggbot_conf.COALESCE_TOLERANCE
+        f_dx = pt_to[0] - pt_from[0]
+        f_dy = pt_to[1] - pt_from[1]
+        f_length = math.hypot(f_dx, f_dy)
+        for point in points:
+            f_px = point[0] - pt_from[0]
+            f_py = point[1] - pt_from[1]
+            if f_length == 0:
+                if math.hypot(f_px, f_py) > tolerance:
+                    return False
+                continue
+            f_along = (f_px * f_dx + f_py * f_dy) / f_length
+            if f_along < -tolerance or f_along > f_length + tolerance:
+                return False  # Doubles back past one end of the line
+            if abs(f_px * f_dy - f_py * f_dx) / f_length > tolerance:
+                return False
+        return True
+
+    def plotSubpath(self, points):
+        """
+        Plot one flattened subpath: a pen-up move to its first point,
+        then pen-down moves through the rest.
+        """
+        n_index = 0
 
-                self.fX = 2 * float(csp[1][0]) / self.step_scaling_factor
-                self.fY = 2 * float(csp[1][1]) / self.step_scaling_factor
+        for point in points:
 
-                # store home
-                if self.ptFirst is None:
+            if self.bStopped:
+                return
 
-                    # Start with pen centered:
-                    self.fPrevX = self.svgWidth / self.step_scaling_factor
-                    self.fPrevY = self.svgHeight / self.step_scaling_factor
+            self.fX = point[0]
+            self.fY = point[1]
 
-                    self.ptFirst = (self.fPrevX, self.fPrevY)
+            # store home
+            if self.ptFirst is None:
 
-                if self.plotCurrentLayer:
-                    if n_index == 0:
-                        if plot_utils.distance(self.fX - self.fPrevX, self.fY - self.fPrevY) > eggbot_conf.MIN_GAP:
-                            # Only raise pen between two points if there is at least a 1 step gap between them.
-                            self.penUp()
-                            self.virtualPenIsUp = True
-                    elif n_index == 1:
-                        self.penDown()
-                        self.virtualPenIsUp = False
+                # Start with pen centered:
+                self.fPrevX = self.svgWidth / self.step_scaling_factor
+                self.fPrevY = self.svgHeight / self.step_scaling_factor
 
-                n_index += 1
+                self.ptFirst = (self.fPrevX, self.fPrevY)
 
-                if self.plotCurrentLayer:
-                    self.plotLineAndTime()
-                    self.fPrevX = self.fX
-                    self.fPrevY = self.fY
+            if n_index == 0:
+                if plot_utils.distance(self.fX - self.fPrevX, self.fY - self.fPrevY) > eggbot_conf.MIN_GAP:
+                    # Only raise pen between two points if there is at least a 1 step gap between them.
+                    self.penUp()
+                    self.virtualPenIsUp = True
+            elif n_index == 1:
+                self.penDown()
+                self.virtualPenIsUp = False
+
+            n_index += 1
+
+            self.plotLineAndTime()
+            self.fPrevX = self.fX
+            self.fPrevY = self.fY
+
+    def doWePlotThisPath(self):
+        """
+        Start the next path in the plot stream. Returns False if we don't need
+        its geometry: it was finished before the pause we're resuming from,
+        and there's no plot stream being compiled.
+        """
+        self.streamOp('S')
+        return not self.bSkipPath or self.plotRecord is not None
+
+    def setNodeCount(self, n_count):
+        self.nodeCount = n_count
+
+    def finishPath(self):
+        if not self.bStopped:  # an "index" for resuming plots quickly-- record last complete path
+            self.svgLastPath += 1
+            self.svgLastPathNC = self.nodeCount
+
+    def sendAction(self, action, *args):
+        """
+        Run a plotting action (pen lift, subpath, resume bookkeeping) in
+        order on the sender thread, or right away if it isn't running.
+        Blocks while the sender is N_PLOT_QUEUE_LENGTH actions behind.
+        """
+        if self.plotQueue is None:
+            action(*args)
+        else:
+            self.plotQueue.put((action, args))
+
+    def startPlotSender(self):
+        # SVG parsing and path flattening stay on this thread; serial output
+        # moves to a sender thread so the EBB keeps moving while we compute.
+        self.plotSenderError = None
+        self.plotQueue = queue.Queue(N_PLOT_QUEUE_LENGTH)
+        self.plotSender = threading.Thread(target=self.plotSenderLoop)
+        self.plotSender.daemon = True
+        self.plotSender.start()
+
+    def finishPlotSender(self):
+        if self.plotSender is None:
+            return
+        self.plotQueue.put(None)
+        self.plotSender.join()
+        self.plotSender = None
+        self.plotQueue = None
+        if self.plotSenderError is not None:
+            raise self.plotSenderError
+
+    def plotSenderLoop(self):
+        while True:
+            if self.plotQueue.empty():
+                self.flushCommands()  # Nothing more to pack in with them for now
+            item = self.plotQueue.get()
+            if item is None:
+                return
+            if self.bStopped:
+                continue  # Keep draining so that sendAction never blocks for good
+            try:
+                item[0](*item[1])
+            except Exception as err:
+                self.plotSenderError = err
+                self.bStopped = True
+
+    def streamOp(self, op, payload=None):
+        """
+        Geometry for the plot goes out as a stream of simple operations:
+          'U'  pen up (entering a group)
+          'L'  pen up (entering a layer); optimizeStream won't move paths across these
+          'S'  start of a path
+          'P'  one flattened subpath, as a list of (x, y) step positions
+          'F'  end of a path
+        Each one is saved to the plot stream being compiled (if any), then played.
+        """
+        if self.plotRecord is not None:
+            self.plotRecord.append((op, payload))
+        if not self.bDeferStream:
+            self.playOp(op, payload)
+
+    def playOp(self, op, payload):
+        # Hand one stream operation to the sender, skipping the paths that
+        # were finished before the pause when we're resuming.
+        if op in ['U', 'L']:
+            self.sendAction(self.penUp)
+        elif op == 'S':
+            self.bSkipPath = False
+            if self.resumePathTarget is not None:
+                if self.pathcount < self.resumePathTarget:
+                    self.bSkipPath = True
+                elif self.pathcount == self.resumePathTarget:
+                    self.sendAction(self.setNodeCount, self.svgLastPathNC)
+            self.pathcount += 1
+        elif op == 'P':
+            if not self.bSkipPath:
+                self.sendAction(self.plotSubpath, payload)
+        elif op == 'F':
+            if not self.bSkipPath:
+                self.sendAction(self.finishPath)
+
+    def plotStreamKey(self):
+        """
+        Hash of everything that goes into the plot stream: the drawing (but
+        not the resume data we store in it), the layer selection and the
+        options used to flatten (and reorder) it. Speeds and pen delays are
+        applied as the stream is sent, so they are not part of the key.
+        """
+        digest = hashlib.sha1()
+        digest.update(('{0:d} {1!r} {2!r} {3!r} {4!r}'.format(
+                N_PLOT_STREAM_VERSION, sorted(self.svg.attrib.items()), self.svgTransform,
+                self.options.smoothness, self.step_scaling_factor)).encode('utf-8'))
+        digest.update(('coalesce {0!r}'.format(eggbot_conf.COALESCE_TOLERANCE)).encode('utf-8'))
+        if self.options.reorder:
+            digest.update(('reorder {0:d} {1!r}'.format(eggbot_conf.REORDER_MAX_WORK, self.options.wraparound)).encode('utf-8'))
+        if self.allLayers:
+            digest.update(b'all')
+        else:
+            digest.update(('layer {0!r}'.format(self.svgLayer)).encode('utf-8'))
+        for node in self.svg:
+            if node.tag in [inkex.addNS('eggbot', 'svg'), 'eggbot', inkex.addNS('WCB', 'svg'), 'WCB',
+                            inkex.addNS('namedview', 'sodipodi'), 'namedview']:
+                continue  # Resume data and Inkscape's view settings don't change the plot
+            digest.update(inkex.etree.tostring(node))
+        return digest.hexdigest()
+
+    def plotStreamFile(self, str_key):
+        cache_dir = eggbot_conf.PLOT_CACHE_DIR
+        if cache_dir is None:
+            cache_dir = os.path.join(tempfile.gettempdir(), 'eggbot_plot_cache')
+        return os.path.join(cache_dir, str_key + '.ebs')
+
+    def loadPlotStream(self, str_file):
+        """
+        Read a compiled plot stream back in.
+        Returns (layers_plotted, list of operations), or None if there is no usable file.
+        """
+        try:
+            with open(str_file, 'rb') as stream_file:
+                data = zlib.decompress(stream_file.read())
+        except (IOError, OSError, zlib.error):
+            return None
+        if data[:len(PLOT_STREAM_MAGIC)] != PLOT_STREAM_MAGIC:
+            return None
+        pos = len(PLOT_STREAM_MAGIC)
+        layers_plotted, = struct.unpack_from('<I', data, pos)
+        pos += 4
+        ops = []
+        try:
+            while pos < len(data):
+                op = data[pos:pos + 1].decode('ascii')
+                pos += 1
+                if op == 'P':
+                    n_points, = struct.unpack_from('<I', data, pos)
+                    pos += 4
+                    values = struct.unpack_from('<{0:d}d'.format(2 * n_points), data, pos)
+                    pos += 16 * n_points
+                    ops.append((op, list(zip(values[0::2], values[1::2]))))
+                elif op in ['U', 'L', 'S', 'F']:
+                    ops.append((op, None))
+                else:
+                    return None
+        except (struct.error, UnicodeDecodeError):
+            return None
+        return layers_plotted, ops
+
+    def savePlotStream(self, str_file, layers_plotted, ops):
+        # Compact binary form: one byte per operation, and little-endian
+        # doubles for subpath points (so replays round exactly the same way).
+        chunks = [PLOT_STREAM_MAGIC, struct.pack('<I', layers_plotted)]
+        for op, payload in ops:
+            chunks.append(op.encode('ascii'))
+            if op == 'P':
+                chunks.append(struct.pack('<I', len(payload)))
+                values = [value for point in payload for value in point]
+                chunks.append(struct.pack('<{0:d}d'.format(len(values)), *values))
+        cache_dir = os.path.dirname(str_file)
+        try:
+            if not os.path.isdir(cache_dir):
+                os.makedirs(cache_dir)
+            with open(str_file + '.tmp', 'wb') as stream_file:
+                stream_file.write(zlib.compress(b''.join(chunks)))
+            if os.path.exists(str_file):
+                os.remove(str_file)  # Windows won't rename over an existing file
+            os.rename(str_file + '.tmp', str_file)
+        except (IOError, OSError):
+            return  # A cache we can't write just means the next plot compiles again
+
+        # Only keep the most recently used streams
+        try:
+            stream_files = [os.path.join(cache_dir, name) for name in os.listdir(cache_dir) if name.endswith('.ebs')]
+            stream_files.sort(key=os.path.getmtime, reverse=True)
+            for old_file in stream_files[eggbot_conf.PLOT_CACHE_FILES:]:
+                os.remove(old_file)
+        except (IOError, OSError):
+            pass
+
+    def plotDocument(self):
+        """
+        Send the whole document to the sender thread: straight from a compiled
+        plot stream if we've plotted this drawing before, otherwise by
+        walking the SVG (compiling a new stream along the way). With path
+        reordering on, the whole stream is compiled and optimized first.
+        """
+        str_file = None
+        if eggbot_conf.PLOT_CACHE_FILES > 0:
+            str_file = self.plotStreamFile(self.plotStreamKey())
+            cached = self.loadPlotStream(str_file)
+            if cached is not None:
+                self.LayersPlotted = cached[0]
+                for op, payload in cached[1]:
+                    if self.bStopped:
+                        break
+                    self.playOp(op, payload)
+                try:
+                    os.utime(str_file, None)  # Mark as recently used
+                except OSError:
+                    pass
+                return
+            self.plotRecord = []
+
+        if self.options.reorder:
+            self.plotRecord = []
+            self.bDeferStream = True
+        try:
+            self.recursivelyTraverseSvg(self.svg, self.svgTransform)
+        finally:
+            self.bDeferStream = False
+
+        ops = self.plotRecord
+        self.plotRecord = None
+        if ops is None:
+            return  # Paused part way through; the stream is incomplete
+        if self.options.reorder:
+            ops = self.optimizeStream(ops)
+            for op, payload in ops:
+                if self.bStopped:
+                    break
+                self.playOp(op, payload)
+        if str_file is not None:
+            self.savePlotStream(str_file, self.LayersPlotted, ops)
+
+
+    def wrapDeltaX(self, n_delta_x):
+        # The egg (x) axis is a circle: fold an x move into the short way around
+        while n_delta_x > self.halfWrapSteps:
+            n_delta_x -= self.wrapSteps
+        while n_delta_x < -1 * self.halfWrapSteps:
+            n_delta_x += self.wrapSteps
+        return n_delta_x
+
+    def travelDistance(self, pt_from, pt_to):
+        # Pen-up travel (in steps) from one point to another. With wraparound,
+        # plotLineAndTime takes pen-up moves the short way around the egg, so
+        # paths on either side of the seam are close neighbors.
+        n_delta_x = pt_to[0] - pt_from[0]
+        if self.options.wraparound:
+            n_delta_x = self.wrapDeltaX(n_delta_x)
+        return math.hypot(n_delta_x, pt_to[1] - pt_from[1])
+
+    def chainTravel(self, subpaths, pt_start):
+        # Total pen-up travel to plot the subpaths in the given order
+        travel = 0.0
+        for points in subpaths:
+            travel += self.travelDistance(pt_start, points[0])
+            pt_start = points[-1]
+        return travel
+
+    def optimizeStream(self, ops):
+        """
+        Reorder (and where it helps, reverse) the subpaths within each layer
+        of the plot stream to cut down on pen-up travel. Layers themselves
+        stay in document order. Returns the new list of stream operations.
+        """
+        self.optimizeBudget = eggbot_conf.REORDER_MAX_WORK
+        pt_home = (self.svgWidth / self.step_scaling_factor, self.svgHeight / self.step_scaling_factor)
+        pt_before = pt_home
+        pt_after = pt_home
+        travel_before = 0.0
+        travel_after = 0.0
+
+        new_ops = []
+        subpaths = []
+        for op, payload in ops + [('L', None)]:
+            if op == 'P':
+                if payload:
+                    subpaths.append(payload)
+            elif op == 'L':
+                if subpaths:
+                    travel_before += self.chainTravel(subpaths, pt_before)
+                    pt_before = subpaths[-1][-1]
+
+                    ordered = self.orderSubpaths(subpaths, pt_after)
+                    if self.chainTravel(ordered, pt_after) < self.chainTravel(subpaths, pt_after):
+                        subpaths = ordered
+                    travel_after += self.chainTravel(subpaths, pt_after)
+                    pt_after = subpaths[-1][-1]
+
+                    # Each subpath becomes a path of its own, for resuming
+                    for points in subpaths:
+                        new_ops.extend([('S', None), ('P', points), ('F', None)])
+                    subpaths = []
+                new_ops.append((op, payload))
+        new_ops.pop()  # The end marker added above
+
+        if travel_before > 0:
+            inkex.errormsg(gettext.gettext(
+                    'Path reordering cut pen-up travel from {0:.0f} to {1:.0f} steps ({2:.0f}% less).').format(
+                        travel_before, travel_after, 100.0 * (travel_before - travel_after) / travel_before))
+        return new_ops
+
+    def orderSubpaths(self, subpaths, pt_start):
+        """
+        Pick an order (and direction) for one layer's subpaths, starting from
+        pt_start: a nearest neighbor tour, then 2-opt passes over it.
+        Both stop early once self.optimizeBudget (distance checks) runs out,
+        so big documents don't take forever. Counting work rather than time
+        keeps the result the same from run to run, which resuming relies on.
+        """
+        n_paths = len(subpaths)
+        starts = [points[0] for points in subpaths]
+        ends = [points[-1] for points in subpaths]
+
+        # Nearest neighbor; each entry is (subpath index, reversed)
+        order = []
+        unused = list(range(n_paths))
+        pt_pen = pt_start
+        while unused:
+            if self.optimizeBudget < 2 * len(unused):
+                order.extend([(index, False) for index in unused])  # Out of time: document order for the rest
+                break
+            self.optimizeBudget -= 2 * len(unused)
+            best_dist = None
+            best_pos = 0
+            best_reversed = False
+            for pos, index in enumerate(unused):
+                dist = self.travelDistance(pt_pen, starts[index])
+                if best_dist is None or dist < best_dist:
+                    best_dist, best_pos, best_reversed = dist, pos, False
+                dist = self.travelDistance(pt_pen, ends[index])
+                if dist < best_dist:
+                    best_dist, best_pos, best_reversed = dist, pos, True
+            index = unused.pop(best_pos)
+            order.append((index, best_reversed))
+            pt_pen = starts[index] if best_reversed else ends[index]
+
+        # 2-opt: plot a run of subpaths backwards (each one reversed too)
+        # whenever that shortens the two pen-up moves at its ends.
+        entry = [ends[index] if rev else starts[index] for index, rev in order]
+        leave = [starts[index] if rev else ends[index] for index, rev in order]
+        improved = True
+        while improved:
+            improved = False
+            for i in range(n_paths - 1):
+                if self.optimizeBudget < 2 * n_paths:
+                    improved = False
+                    break
+                self.optimizeBudget -= 2 * (n_paths - i)
+                pt_prev = leave[i - 1] if i > 0 else pt_start
+                dist_in = self.travelDistance(pt_prev, entry[i])
+                for j in range(i + 1, n_paths):
+                    delta = self.travelDistance(pt_prev, leave[j]) - dist_in
+                    if j + 1 < n_paths:
+                        delta += self.travelDistance(entry[i], entry[j + 1]) - self.travelDistance(leave[j], entry[j + 1])
+                    if delta < -1e-6:
+                        entry[i:j + 1], leave[i:j + 1] = leave[i:j + 1][::-1], entry[i:j + 1][::-1]
+                        order[i:j + 1] = [(index, not rev) for index, rev in reversed(order[i:j + 1])]
+                        dist_in = self.travelDistance(pt_prev, entry[i])
+                        improved = True
+
+        return [subpaths[index][::-1] if rev else subpaths[index] for index, rev in order]
+
+    def setupAcceleration(self):
+        # LM (with per-axis acceleration) needs EBB firmware 2.7.0 or newer
+        self.bAccelerate = False
+        self.moveBuffer = []
+        self.moveEntrySpeed = eggbot_conf.ACCEL_MIN_SPEED
+        if not self.options.accelerate:
+            return
+        with self.serialLock:
+            str_version = ebb_serial.query(self.serialPort, 'V\r')
+        try:
+            version = tuple(int(part) for part in str_version.split()[-1].split('.'))
+        except (IndexError, ValueError):
+            version = (0,)
+        if version >= (2, 7, 0):
+            self.bAccelerate = True
+        else:
+            inkex.errormsg(gettext.gettext('Smooth acceleration needs EBB firmware 2.7.0 or newer; ' +
+                                           'plotting at constant speed instead.'))
+
+    def sendMove(self, n_delta_x, n_delta_y, n_time):
+        """
+        Send one move, already in motor steps (egg motor x, pen motor y).
+        With acceleration on, it is held back for the lookahead planner;
+        otherwise it goes out right away as an SM move of n_time ms.
+        """
+        if self.bAccelerate:
+            self.moveBuffer.append((n_delta_x, n_delta_y, float(self.fSpeed)))
+            if len(self.moveBuffer) >= eggbot_conf.ACCEL_LOOKAHEAD:
+                self.flushMoves(eggbot_conf.ACCEL_LOOKAHEAD // 2)
+            return
+        self.waitForQueueSpace()
+        self.sendCommand('SM,{0},{1},{2}\r'.format(n_time, n_delta_y, n_delta_x))  # As ebb_motion.doXYMove
+
+    def flushMoves(self, n_keep=0):
+        """
+        Plan the buffered moves with trapezoidal speed profiles and send them
+        as LM commands. The last move plans to come to a stop, but with n_keep,
+        that many moves are kept back (to plan along with the moves still to
+        come), and the moves sent end at whatever speed the plan had there.
+        """
+        if not self.moveBuffer:
+            return
+        accel = float(eggbot_conf.ACCEL_RATE)
+        v_min = float(eggbot_conf.ACCEL_MIN_SPEED)
+        moves = self.moveBuffer
+        n_moves = len(moves)
+        lengths = [math.hypot(move[0], move[1]) for move in moves]
+
+        # Highest speed each move may start at: its own and the previous
+        # move's top speed, and how sharp the corner between them is
+        entry = [self.moveEntrySpeed] + [0.0] * n_moves
+        for i in range(1, n_moves):
+            v_max = min(moves[i - 1][2], moves[i][2])
+            cos_theta = -(moves[i - 1][0] * moves[i][0] + moves[i - 1][1] * moves[i][1]) / (lengths[i - 1] * lengths[i])
+            sin_half = math.sqrt(max(0.0, (1.0 - cos_theta) / 2.0))
+            if sin_half < 0.999:
+                v_max = min(v_max, math.sqrt(accel * eggbot_conf.ACCEL_JUNCTION_DEVIATION * sin_half / (1.0 - sin_half)))
+            entry[i] = max(v_min, v_max)
+        entry[n_moves] = v_min
+
+        # Backward pass: every move has to be able to slow down for the next
+        for i in range(n_moves - 1, 0, -1):
+            entry[i] = min(entry[i], math.sqrt(entry[i + 1] ** 2 + 2.0 * accel * lengths[i]))
+        # Forward pass: and it can only speed up so much within a move
+        for i in range(n_moves):
+            entry[i + 1] = min(entry[i + 1], math.sqrt(entry[i] ** 2 + 2.0 * accel * lengths[i]))
+
+        n_send = n_moves - n_keep
+        for i in range(n_send):
+            self.sendTrapezoid(moves[i][0], moves[i][1], lengths[i], entry[i], moves[i][2], entry[i + 1], accel)
+        self.moveEntrySpeed = entry[n_send]
+        self.moveBuffer = moves[n_send:]
+
+    def sendTrapezoid(self, n_delta_x, n_delta_y, f_length, v_in, v_cruise, v_out, accel):
+        # Split one move into speed-up, cruise and slow-down LM pieces
+        v_cruise = max(v_cruise, v_in, v_out)
+        d_up = (v_cruise ** 2 - v_in ** 2) / (2.0 * accel)
+        d_down = (v_cruise ** 2 - v_out ** 2) / (2.0 * accel)
+        if d_up + d_down > f_length:
+            # No room to reach cruise speed: peak part way through instead
+            v_cruise = math.sqrt(max(v_in ** 2, v_out ** 2, (2.0 * accel * f_length + v_in ** 2 + v_out ** 2) / 2.0))
+            d_up = max(0.0, min(f_length, (v_cruise ** 2 - v_in ** 2) / (2.0 * accel)))
+            d_down = f_length - d_up
+        pieces = [(d_up, v_in, v_cruise), (f_length - d_up - d_down, v_cruise, v_cruise), (d_down, v_cruise, v_out)]
+
+        # Whole steps per piece, from where each piece ends along the move.
+        # The last piece always ends at the end, so every step gets sent.
+        f_done = 0.0
+        n_sent_x = 0
+        n_sent_y = 0
+        f_pending = 0.0
+        v_start = v_in
+        for f_dist, v_from, v_to in pieces:
+            if f_pending == 0.0:
+                v_start = v_from
+            f_done += f_dist
+            f_pending += f_dist
+            n_x = int(round(n_delta_x * f_done / f_length)) - n_sent_x
+            n_y = int(round(n_delta_y * f_done / f_length)) - n_sent_y
+            if n_x == 0 and n_y == 0:
+                continue  # Too short for a step; fold into the next piece
+            self.sendLM(n_x, n_y, f_pending, v_start, v_to)
+            n_sent_x += n_x
+            n_sent_y += n_y
+            f_pending = 0.0
+
+    def sendLM(self, n_steps_x, n_steps_y, f_dist, v_from, v_to):
+        """
+        Send one constant-acceleration LM piece covering f_dist steps of path
+        length, going from v_from to v_to steps/s along the path.
+        Rates are in units of 1/2^31 step per 40 us tick, as LM expects.
+        """
+        f_time = 2.0 * f_dist / (v_from + v_to)
+        f_ticks = max(1.0, f_time * 25000.0)
+        fields = []
+        for n_steps in [n_steps_y, n_steps_x]:  # Axis 1 is the pen motor, axis 2 the egg motor
+            if n_steps == 0:
+                fields.extend(['0', '0', '0'])
+                continue
+            # Scale the path speeds so that this axis covers its steps in f_time
+            f_scale = abs(n_steps) / f_dist
+            rate_from = v_from * f_scale * F_LM_RATE_PER_STEP_S
+            rate_to = v_to * f_scale * F_LM_RATE_PER_STEP_S
+            n_accel = int(round((rate_to - rate_from) / f_ticks))
+            n_rate = int(round(rate_from))
+            if n_accel > 0:
+                n_rate = max(n_rate, n_accel // 2 + 1)  # The EBB starts from Rate - Accel/2
+            n_rate = min(n_rate, 0x7FFFFFFF)
+            fields.extend([str(n_rate), str(n_steps), str(n_accel)])
+        self.waitForQueueSpace()
+        self.sendCommand('LM,' + ','.join(fields) + '\r')
+        if self.queueSize is None and f_time > 0.05:
+            # No QF to keep the queue full by, so sleep through the piece as
+            # plotLineAndTime does for SM moves, or the EBB's "OK"s would be
+            # held back until the serial read times out.
+            time.sleep(f_time - 0.05)
+
+    def startButtonPoller(self):
+        # Check the pause button from a background thread, so that sending
+        # moves never has to wait on a QB round trip.
+        self.bButtonPressed = False
+        self.bNoResponseFromEbb = False
+        self.buttonPollerStop.clear()
+        self.buttonPoller = threading.Thread(target=self.buttonPollLoop)
+        self.buttonPoller.daemon = True
+        self.buttonPoller.start()
+
+    def stopButtonPoller(self):
+        if self.buttonPoller is not None:
+            self.buttonPollerStop.set()
+            self.buttonPoller.join()
+            self.buttonPoller = None
+
+    def buttonPollLoop(self):
+        while not self.buttonPollerStop.wait(F_BUTTON_POLL_INTERVAL):
+            with self.serialLock:
+                self.collectAcks()
+                str_button = ebb_motion.QueryPRGButton(self.serialPort)  # Query if button pressed
+            str_button = str_button.strip()  # Don't let a stray CR or space hide a press
+            if str_button == "":
+                # Can't get a response from EBB, so
+                # attempt to shut down in a way which allows user to continue.
+                self.bNoResponseFromEbb = True
+                self.bButtonPressed = True
+                return
+            if str_button[0] == '1':
+                self.bButtonPressed = True
+                return
 
     def sendDisableMotors(self):
         # Insist on turning the engraver off.  Otherwise, if it is on
@@ -1013,8 +1719,10 @@ class EggBot(inkex.Effect):
         self.virtualPenIsUp = True  # Virtual pen keeps track of state for resuming plotting.
         if not self.bPenIsUp:  # Continue only if pen state is down (or unknown)
             if not self.resumeMode:  # or if we're resuming.
-                ebb_motion.sendPenUp(self.serialPort, self.options.penUpDelay)
-                if self.options.penUpDelay > 15:
+                self.flushMoves()
+                self.waitForQueueSpace()
+                self.sendCommand('SP,1,{0}\r'.format(self.options.penUpDelay))  # As ebb_motion.sendPenUp
+                if self.queueSize is None and self.options.penUpDelay > 15:
                     if self.options.tab != "manual":
                         time.sleep(float(self.options.penUpDelay - 10) / 1000.0)  # pause before issuing next command
                 self.bPenIsUp = True
@@ -1024,10 +1732,12 @@ class EggBot(inkex.Effect):
         if self.bPenIsUp:  # Continue only if pen state is up (or unknown)
             if not self.resumeMode and not self.bStopped:  # skip if we're resuming or stopped
                 self.bPenIsUp = False
+                self.flushMoves()
                 if self.penDownActivatesEngraver:
                     self.engraverOn()  # will check self.enableEngraver
-                ebb_motion.sendPenDown(self.serialPort, self.options.penDownDelay)
-                if self.options.penUpDelay > 15:
+                self.waitForQueueSpace()
+                self.sendCommand('SP,0,{0}\r'.format(self.options.penDownDelay))  # As ebb_motion.sendPenDown
+                if self.queueSize is None and self.options.penUpDelay > 15:
                     if self.options.tab != "manual":
                         time.sleep(float(self.options.penDownDelay - 10) / 1000.0)  # pause before issuing next command
 
@@ -1035,7 +1745,9 @@ class EggBot(inkex.Effect):
         # Note: we don't bother checking self.engraverIsOn -- turn it off regardless
         # Reason being that we may not know the true hardware state
         if self.options.engraving:
-            ebb_serial.command(self.serialPort, 'PO,B,3,0\r')
+            self.waitForQueueEmpty()
+            with self.serialLock:
+                ebb_serial.command(self.serialPort, 'PO,B,3,0\r')
             self.engraverIsOn = False
 
     def engraverOffManual(self):
@@ -1047,8 +1759,10 @@ class EggBot(inkex.Effect):
     def engraverOn(self):
         if self.options.engraving and not self.engraverIsOn:
             self.engraverIsOn = True
-            ebb_serial.command(self.serialPort, 'PD,B,3,0\r')  # Added 6/6/2011, necessary.
-            ebb_serial.command(self.serialPort, 'PO,B,3,1\r')
+            self.waitForQueueEmpty()  # PD/PO act right away, so let queued moves finish first
+            with self.serialLock:
+                ebb_serial.command(self.serialPort, 'PD,B,3,0\r')  # Added 6/6/2011, necessary.
+                ebb_serial.command(self.serialPort, 'PO,B,3,1\r')
 
     def ServoSetupWrapper(self):
         self.ServoSetup()
@@ -1084,6 +1798,139 @@ class EggBot(inkex.Effect):
     def stop(self):
         self.bStopped = True
 
+    def sendCommand(self, str_command):
+        """
+        Send one motion queue command (SM, LM, SP). With QF flow control,
+        commands are packed together into writes of up to N_USB_PACKET_SIZE
+        bytes, one USB packet, and their "OK"s are read later, by
+        collectAcks. Without it, the command goes out on its own and we
+        wait for its "OK", as ebb_serial.command does.
+        """
+        with self.serialLock:
+            if self.queueSize is None:
+                ebb_serial.command(self.serialPort, str_command)
+                return
+            if self.pendingBytes + len(str_command) > N_USB_PACKET_SIZE:
+                self.flushCommands()
+            self.pendingCommands.append(str_command)
+            self.pendingBytes += len(str_command)
+            if self.pendingBytes == N_USB_PACKET_SIZE:
+                self.flushCommands()
+
+    def flushCommands(self):
+        # Write out the packed commands, without waiting for their "OK"s
+        with self.serialLock:
+            if not self.pendingCommands:
+                return
+            self.serialPort.write(''.join(self.pendingCommands).encode('ascii'))
+            self.unackedCommands.extend(self.pendingCommands)
+            self.pendingCommands = []
+            self.pendingBytes = 0
+
+    def collectAcks(self):
+        """
+        Send any packed commands, then read the "OK" for each command sent
+        so far, so that the next reply read is the one for the next query.
+        The EBB answers commands in order, so each line read belongs to the
+        oldest command still waiting for one.
+        """
+        with self.serialLock:
+            self.flushCommands()
+            while self.unackedCommands:
+                str_command = self.unackedCommands.pop(0)
+                str_response = self.serialPort.readline().decode('ascii').strip()
+                if str_response.startswith('OK'):
+                    continue
+                if str_response:
+                    inkex.errormsg('Error: Unexpected response from EBB.\n   Command: ' + str_command.strip() +
+                                   '\n   Response: ' + str_response)
+                else:
+                    # No reply at all; the rest won't be coming either
+                    inkex.errormsg('EBB Serial Timeout after command: ' + str_command.strip())
+                    self.unackedCommands = []
+
+    def queryQueueDepth(self):
+        """
+        Ask the EBB how full its motion queue is, with the QF command.
+        Returns a (depth, size) tuple, or None if the firmware has no QF command.
+        QF answers with a single line and no "OK", so it is read here directly.
+        """
+        try:
+            with self.serialLock:
+                self.collectAcks()
+                self.serialPort.write('QF\r'.encode('ascii'))
+                str_response = self.readQueueReply()
+        except Exception:
+            return None
+        if not str_response.startswith('QF,'):
+            return None
+        fields = str_response.split(',')
+        try:
+            return int(fields[1]), int(fields[2])
+        except (IndexError, ValueError):
+            return None
+
+    def readQueueReply(self):
+        # QF and QM end their reply with "\n\r" rather than "\r\n", so the CR is
+        # still waiting after readline(). Read it too, or it would be taken as
+        # the start of the next reply (which then fails to parse). Anything
+        # else (an error from firmware without QF) ends in "\r\n" as usual.
+        str_response = self.serialPort.readline().decode('ascii')
+        if str_response.startswith(('QF,', 'QM,')):
+            self.serialPort.read(1)
+        return str_response.strip()
+
+    def setupQueueFlowControl(self):
+        # Firmware with QF lets us keep its motion queue full instead of
+        # sleeping through each move; older firmware falls back to time.sleep.
+        self.queueSize = None
+        self.queueFree = 0
+        queue_state = self.queryQueueDepth()
+        if queue_state is not None and queue_state[1] > 0:
+            self.queueSize = queue_state[1]
+            self.queueFree = queue_state[1] - queue_state[0]
+
+    def waitForQueueSpace(self):
+        """
+        Block until the EBB has room in its motion queue for one more command,
+        then count that command against the free space. The EBB would take the
+        command anyway, but its "OK" would then be held back until a move
+        finished, and long moves would outlast the serial read timeout.
+        """
+        if self.queueSize is None:
+            return
+        if self.queueFree <= 0:
+            # Once it's full, wait for half of the queue to drain, so that the
+            # commands after this one go out packed together (see sendCommand)
+            # rather than one at a time as each move finishes.
+            n_wanted = max(1, self.queueSize // 2)
+            while True:
+                queue_state = self.queryQueueDepth()
+                if queue_state is None:
+                    # Lost contact; let the next command (and button check) report it.
+                    break
+                self.queueFree = queue_state[1] - queue_state[0]
+                if self.queueFree >= n_wanted:
+                    break
+                time.sleep(F_QUEUE_POLL_INTERVAL)
+        self.queueFree -= 1
+
+    def waitForQueueEmpty(self):
+        # Wait for every queued motion command to finish, for commands (like
+        # the engraver outputs) that take effect immediately rather than in order.
+        self.flushMoves()
+        if self.queueSize is None:
+            return
+        while True:
+            with self.serialLock:
+                self.collectAcks()
+                self.serialPort.write('QM\r'.encode('ascii'))
+                str_status = self.readQueueReply()
+            if not str_status.startswith('QM,') or str_status.split(',')[1] == '0':
+                break
+            time.sleep(F_QUEUE_POLL_INTERVAL)
+        self.queueFree = self.queueSize
+
     def plotLineAndTime(self):
         """
         Send commands out the com port as a line segment (dx, dy) and a time (ms) the segment
@@ -1102,12 +1949,7 @@ class EggBot(inkex.Effect):
             self.fSpeed = self.options.penUpSpeed
 
             if self.options.wraparound:
-                if n_delta_x > self.halfWrapSteps:
-                    while n_delta_x > self.halfWrapSteps:
-                        n_delta_x -= self.wrapSteps
-                elif n_delta_x < -1 * self.halfWrapSteps:
-                    while n_delta_x < -1 * self.halfWrapSteps:
-                        n_delta_x += self.wrapSteps
+                n_delta_x = self.wrapDeltaX(n_delta_x)
 
         else:
             self.fSpeed = self.options.penDownSpeed
@@ -1148,30 +1990,25 @@ class EggBot(inkex.Effect):
 
                     self.svgTotalDeltaX += xd
                     self.svgTotalDeltaY += yd
-                    ebb_motion.doXYMove(self.serialPort, xd2, yd2, td)
-                    if td > 50:
+                    self.sendMove(xd2, yd2, td)
+                    if self.queueSize is None and not self.bAccelerate and td > 50:
                         time.sleep(float(td - 50) / 1000.0)  # pause before issuing next command
 
                 n_delta_x -= xd
                 n_delta_y -= yd
                 n_time -= td
 
-            str_button = ebb_motion.QueryPRGButton(self.serialPort)  # Query if button pressed
-            if str_button == "":
-                # Can't get a response from EBB, so
-                # attempt to shut down in a way which allows user to continue.
-                b_no_response_from_ebb = True
-                str_button = '1'  # simulate pushed button for pause
-            else:
-                b_no_response_from_ebb = False
-
-            if str_button[0] == '1':  # button pressed, or simulated pressed because of communication error to allow resume
+            # The button poller only flags the press; stopping here, at the end
+            # of a node, keeps svgNodeCount in step with what was sent for resume.
+            if self.bButtonPressed:  # button pressed, or simulated pressed because of communication error to allow resume
                 self.svgNodeCount = self.nodeCount
-                if b_no_response_from_ebb:
+                if self.bNoResponseFromEbb:
                     inkex.errormsg('Plot halted by communication error after node number ' + str(self.nodeCount) + '.')
                 else:
                     inkex.errormsg('Plot paused by button press after node number ' + str(self.nodeCount) + '.')
                 inkex.errormsg('Use the "resume" feature to continue.')
+                self.flushMoves()  # Moves already counted in nodeCount have to be made
+                self.penUp()  # Right away, not once the rest of the document has been walked
                 self.engraverOff()
                 self.bStopped = True
                 return
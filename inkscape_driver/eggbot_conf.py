@@ -37,3 +37,28 @@ Other _integer_ scaling values can be used as well, with similar scaling.
 STEP_SCALE = 2
 
 MIN_GAP = 1.0  # Minimum pen-up movement that results in an actual pen lift.
+
+# Compiled plot streams: after a drawing has been plotted once, replots and
+# resumes of the same drawing (with the same smoothness and layer) skip all of
+# the SVG and curve work and play back a saved stream instead.
+PLOT_CACHE_FILES = 20  # Number of plot streams to keep. Set to 0 to turn the cache off.
+PLOT_CACHE_DIR = None  # Where to keep them. None for an "eggbot_plot_cache" folder in the system temp folder.
+
+# Path reordering ("Reorder paths" option) gives up and keeps document order
+# for whatever is left after this many distance checks, so that very busy
+# drawings don't take too long to start. Roughly a few seconds' worth.
+REORDER_MAX_WORK = 5000000
+
+# Smooth acceleration ("Smooth acceleration" option). Moves speed up and slow
+# down at ACCEL_RATE instead of starting and stopping at full speed, which
+# allows much higher pen-up and pen-down speeds without skipped steps.
+ACCEL_RATE = 4000.0  # steps/s^2
+ACCEL_MIN_SPEED = 50.0  # steps/s; speed at a full stop (start and end of each run of moves)
+ACCEL_JUNCTION_DEVIATION = 2.0  # steps; larger values take corners faster
+ACCEL_LOOKAHEAD = 32  # moves planned together
+
+# Before they are plotted, points along (nearly) straight runs of a curve are
+# merged into single moves, as long as no point strays more than this many
+# steps from the merged line. Points closer together than one step are
+# always merged. Set to -1 to send every point, as older versions did.
+COALESCE_TOLERANCE = 0.5